@@ -13,10 +13,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 
+#include <algorithm>
 #include <set>
 #include <string>
 
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
 #include <epicsEvent.h>
 #include <epicsTime.h>
 #include <epicsThread.h>
@@ -39,6 +45,8 @@ using namespace std;
 #include <epicsExport.h>
 #include "SPFeature.h"
 #include "ADSpinnaker.h"
+#include "SPBandwidth.h"
+#include "SPPreview.h"
 
 #define DRIVER_VERSION      3
 #define DRIVER_REVISION     5
@@ -49,6 +57,15 @@ static const char *driverName = "ADSpinnaker";
 // Size of message queue for callback function
 #define CALLBACK_MESSAGE_QUEUE_SIZE 100
 
+// Number of clock latches used for the clock correlation
+#define CLOCK_CORRELATION_SAMPLES 32
+
+// IP, UDP and GVSP headers of each stream packet
+#define GVSP_PACKET_OVERHEAD 36
+
+// Time to wait for an image before checking whether a camera that counts frames has stopped
+#define HW_FRAME_COUNT_POLL_TIME 0.5
+
 typedef enum {
     SPPixelConvertNone,
     SPPixelConvertMono8,
@@ -68,6 +85,70 @@ typedef enum {
     UniqueIdDriver
 } SPUniqueId_t;
 
+typedef enum {
+    SPPreTriggerOff,
+    SPPreTriggerArmed,
+    SPPreTriggerTriggered
+} SPPreTriggerState_t;
+
+typedef enum {
+    SPBurstIdle,
+    SPBurstFilling,
+    SPBurstDraining
+} SPBurstState_t;
+
+typedef enum {
+    SPBufferCountManual,
+    SPBufferCountAuto
+} SPBufferCountMode_t;
+
+// Choices of StreamBufferHandlingMode, in the order of the SP_BUFFER_HANDLING_MODE record
+typedef enum {
+    SPBufferOldestFirst,
+    SPBufferOldestFirstOverwrite,
+    SPBufferNewestOnly,
+    SPBufferNewestFirst
+} SPBufferHandlingMode_t;
+
+typedef enum {
+    SPBackpressureAbort,
+    SPBackpressureDrop,
+    SPBackpressureDecimate
+} SPBackpressureMode_t;
+
+typedef enum {
+    SPAccumulateSum,
+    SPAccumulateAverage
+} SPAccumulateMode_t;
+
+static const char *spBufferHandlingModes[] = {
+    "OldestFirst",
+    "OldestFirstOverwrite",
+    "NewestOnly",
+    "NewestFirst"
+};
+
+// Chunks that can be attached to each NDArray as attributes.  Bit i of SP_CHUNK_SELECT enables spChunks[i].
+typedef struct {
+    const char *selector;
+    const char *attrName;
+    const char *description;
+    int64_t (ChunkData::*getInteger)() const;
+    float64_t (ChunkData::*getDouble)() const;
+} SPChunk_t;
+
+static const SPChunk_t spChunks[] = {
+    {"ExposureTime",             "ChunkExposureTime", "Exposure time (us)",          NULL,                                    &ChunkData::GetExposureTime},
+    {"Gain",                     "ChunkGain",         "Gain (dB)",                   NULL,                                    &ChunkData::GetGain},
+    {"FrameID",                  "ChunkFrameID",      "Frame ID",                    &ChunkData::GetFrameID,                  NULL},
+    {"Timestamp",                "ChunkTimestamp",    "Camera timestamp (ns)",       &ChunkData::GetTimestamp,                NULL},
+    {"ExposureEndLineStatusAll", "ChunkLineStatus",   "Line status at exposure end", &ChunkData::GetExposureEndLineStatusAll, NULL},
+    {"CounterValue",             "ChunkCounterValue", "Counter value",               &ChunkData::GetCounterValue,             NULL},
+    {"EncoderValue",             "ChunkEncoderValue", "Encoder value",               &ChunkData::GetEncoderValue,             NULL},
+    {"CRC",                      "ChunkCRC",          "Image CRC",                   &ChunkData::GetCRC,                      NULL},
+};
+#define NUM_SP_CHUNKS ((int)(sizeof(spChunks)/sizeof(spChunks[0])))
+
 
 /** Configuration function to configure one camera.
  *
@@ -103,6 +184,27 @@ static void imageGrabTaskC(void *drvPvt)
     pPvt->imageGrabTask();
 }
 
+static void featureTaskC(void *drvPvt)
+{
+    ADSpinnaker *pPvt = (ADSpinnaker *)drvPvt;
+
+    pPvt->featureTask();
+}
+
+static void featureIOTaskC(void *drvPvt)
+{
+    ADSpinnaker *pPvt = (ADSpinnaker *)drvPvt;
+
+    pPvt->featureIOTask();
+}
+
+static void autoTuneTaskC(void *drvPvt)
+{
+    ADSpinnaker *pPvt = (ADSpinnaker *)drvPvt;
+
+    pPvt->autoTuneTask();
+}
+
 /** Constructor for the ADSpinnaker class
  * \param[in] portName asyn port name to assign to the camera.
  * \param[in] cameraId The camera index or serial number; <1000 is assumed to be index, >=1000 is assumed to be serial number.
@@ -115,7 +217,19 @@ static void imageGrabTaskC(void *drvPvt)
 ADSpinnaker::ADSpinnaker(const char *portName, int cameraId, int numSPBuffers,
                          size_t maxMemory, int priority, int stackSize )
     : ADGenICam(portName, maxMemory, priority, stackSize),
-    cameraId_(cameraId), numSPBuffers_(numSPBuffers), exiting_(0), pRaw_(NULL), uniqueId_(0)
+    cameraId_(cameraId), numSPBuffers_(numSPBuffers), streamBufferCount_(0), streamBufferCountMax_(0),
+    featureBatchActive_(false),
+    exiting_(0), pRaw_(NULL), uniqueId_(0),
+    hwFrameCountActive_(false), hwFrameCount_(0), streamFrameCount_(0), hwAcquisitionStopped_(false),
+    preTriggerState_(SPPreTriggerOff), preTriggerCount_(0), preTriggerFired_(false), postTriggerRemaining_(0),
+    burstState_(SPBurstIdle), burstArena_(NULL), burstArenaSize_(0), burstSlotSize_(0), burstCount_(0),
+    chunksValid_(false), chunkModeSet_(false), clockCorrelator_(CLOCK_CORRELATION_SAMPLES),
+    linkDemand_(0.), linkAllocation_(0.), linkCapacity_(0.), linkAllocationPending_(false),
+    autoTuneActive_(false), bufferHandlingMode_(SPBufferOldestFirst), queueSkipped_(0),
+    latencyValid_(false), latencyCount_(0), latencySum_(0.), latencyMax_(0.),
+    backpressureActive_(false), decimation_(1), decimationCounter_(0), backpressureDropped_(0),
+    accumulateFrames_(0), accumulateUniqueId_(0), accumulateFirstTime_(0.), accumulateLastTime_(0.),
+    pPreview_(0)
 {
     static const char *functionName = "ADSpinnaker";
     asynStatus status;
@@ -125,6 +239,15 @@ ADSpinnaker::ADSpinnaker(const char *portName, int cameraId, int numSPBuffers,
     if (numSPBuffers_ == 0) numSPBuffers_ = 100;
     //if (numSPBuffers_ < 10) numSPBuffers_ = 10;
 
+    // Node callbacks can signal this event as soon as features are created
+    featureEventId_ = epicsEventCreate(epicsEventEmpty);
+    featureIOEventId_ = epicsEventCreate(epicsEventEmpty);
+    featureTaskDoneEventId_ = epicsEventCreate(epicsEventEmpty);
+    featureIOTaskDoneEventId_ = epicsEventCreate(epicsEventEmpty);
+    featureWriteMutex_ = epicsMutexCreate();
+    featureIOMutex_ = epicsMutexCreate();
+    linkMutex_ = epicsMutexCreate();
+
     // Retrieve singleton reference to system object
     system_ = System::GetInstance();
 
@@ -153,6 +276,150 @@ ADSpinnaker::ADSpinnaker(const char *portName, int cameraId, int numSPBuffers,
     createParam(SPResendReceivedPacketCountString,  asynParamInt32,   &SPResendReceivedPacketCount);
     createParam(SPTimeStampModeString,              asynParamInt32,   &SPTimeStampMode);
     createParam(SPUniqueIdModeString,               asynParamInt32,   &SPUniqueIdMode);
+    createParam(SPFeatureRefreshTimeString,         asynParamFloat64, &SPFeatureRefreshTime);
+    createParam(SPFeatureRefreshCountString,        asynParamInt32,   &SPFeatureRefreshCount);
+    createParam(SPFeaturePollPeriodString,          asynParamFloat64, &SPFeaturePollPeriod);
+    createParam(SPFeatureBatchBeginString,          asynParamInt32,   &SPFeatureBatchBegin);
+    createParam(SPFeatureBatchCommitString,         asynParamInt32,   &SPFeatureBatchCommit);
+    createParam(SPFeatureBatchActiveString,         asynParamInt32,   &SPFeatureBatchActive);
+    createParam(SPFeatureBatchSizeString,           asynParamInt32,   &SPFeatureBatchSize);
+    createParam(SPHardwareFrameCountString,         asynParamInt32,   &SPHardwareFrameCount);
+    createParam(SPHardwareFrameCountActiveString,   asynParamInt32,   &SPHardwareFrameCountActive);
+    createParam(SPPreTriggerEnableString,           asynParamInt32,   &SPPreTriggerEnable);
+    createParam(SPPreTriggerCountString,            asynParamInt32,   &SPPreTriggerCount);
+    createParam(SPPostTriggerCountString,           asynParamInt32,   &SPPostTriggerCount);
+    createParam(SPPreTriggerTriggerString,          asynParamInt32,   &SPPreTriggerTrigger);
+    createParam(SPPreTriggerStateString,            asynParamInt32,   &SPPreTriggerState);
+    createParam(SPPreTriggerFillString,             asynParamInt32,   &SPPreTriggerFill);
+    createParam(SPBurstEnableString,                asynParamInt32,   &SPBurstEnable);
+    createParam(SPBurstCountString,                 asynParamInt32,   &SPBurstCount);
+    createParam(SPBurstDrainQueueString,            asynParamInt32,   &SPBurstDrainQueue);
+    createParam(SPBurstStateString,                 asynParamInt32,   &SPBurstState);
+    createParam(SPBurstFramesString,                asynParamInt32,   &SPBurstFrames);
+    createParam(SPBurstFillRateString,              asynParamFloat64, &SPBurstFillRate);
+    createParam(SPBurstDrainRateString,             asynParamFloat64, &SPBurstDrainRate);
+    createParam(SPChunkEnableString,                asynParamInt32,   &SPChunkEnable);
+    createParam(SPChunkSelectString,                asynParamUInt32Digital, &SPChunkSelect);
+    createParam(SPChunkActiveString,                asynParamInt32,   &SPChunkActive);
+    createParam(SPClockCorrelationString,           asynParamInt32,   &SPClockCorrelation);
+    createParam(SPClockLatchPeriodString,           asynParamFloat64, &SPClockLatchPeriod);
+    createParam(SPClockOffsetString,                asynParamFloat64, &SPClockOffset);
+    createParam(SPClockDriftString,                 asynParamFloat64, &SPClockDrift);
+    createParam(SPClockResidualString,              asynParamFloat64, &SPClockResidual);
+    createParam(SPClockSamplesString,               asynParamInt32,   &SPClockSamples);
+    createParam(SPPtpEnableString,                  asynParamInt32,   &SPPtpEnable);
+    createParam(SPPtpStatusString,                  asynParamOctet,   &SPPtpStatus);
+    createParam(SPPtpLockedString,                  asynParamInt32,   &SPPtpLocked);
+    createParam(SPPtpOffsetString,                  asynParamFloat64, &SPPtpOffset);
+    createParam(SPActionDeviceKeyString,            asynParamInt32,   &SPActionDeviceKey);
+    createParam(SPActionGroupKeyString,             asynParamInt32,   &SPActionGroupKey);
+    createParam(SPActionGroupMaskString,            asynParamInt32,   &SPActionGroupMask);
+    createParam(SPActionDelayString,                asynParamFloat64, &SPActionDelay);
+    createParam(SPActionSendString,                 asynParamInt32,   &SPActionSend);
+    createParam(SPActionTimeString,                 asynParamFloat64, &SPActionTime);
+    createParam(SPLinkNameString,                   asynParamOctet,   &SPLinkName);
+    createParam(SPLinkDemandString,                 asynParamFloat64, &SPLinkDemand);
+    createParam(SPLinkAllocationString,             asynParamFloat64, &SPLinkAllocation);
+    createParam(SPLinkCapacityString,               asynParamFloat64, &SPLinkCapacity);
+    createParam(SPLinkPacketDelayString,            asynParamInt32,   &SPLinkPacketDelay);
+    createParam(SPAutoTuneString,                   asynParamInt32,   &SPAutoTune);
+    createParam(SPAutoTuneDwellString,              asynParamFloat64, &SPAutoTuneDwell);
+    createParam(SPAutoTuneSaveString,               asynParamInt32,   &SPAutoTuneSave);
+    createParam(SPAutoTuneUserSetString,            asynParamInt32,   &SPAutoTuneUserSet);
+    createParam(SPAutoTuneSetDefaultString,         asynParamInt32,   &SPAutoTuneSetDefault);
+    createParam(SPAutoTuneStatusString,             asynParamOctet,   &SPAutoTuneStatus);
+    createParam(SPAutoTunePacketSizeString,         asynParamInt32,   &SPAutoTunePacketSize);
+    createParam(SPAutoTunePacketDelayString,        asynParamInt32,   &SPAutoTunePacketDelay);
+    createParam(SPAutoTuneThroughputString,         asynParamFloat64, &SPAutoTuneThroughput);
+    createParam(SPAutoTuneErrorsString,             asynParamInt32,   &SPAutoTuneErrors);
+    createParam(SPBufferCountModeString,            asynParamInt32,   &SPBufferCountMode);
+    createParam(SPBufferLatencyString,              asynParamFloat64, &SPBufferLatency);
+    createParam(SPBufferMemoryLimitString,          asynParamFloat64, &SPBufferMemoryLimit);
+    createParam(SPBufferCountRequestedString,       asynParamInt32,   &SPBufferCountRequested);
+    createParam(SPBufferCountActualString,          asynParamInt32,   &SPBufferCountActual);
+    createParam(SPBufferCountMaxString,             asynParamInt32,   &SPBufferCountMax);
+    createParam(SPBufferHandlingModeString,         asynParamInt32,   &SPBufferHandlingMode);
+    createParam(SPQueueSkippedString,               asynParamInt32,   &SPQueueSkipped);
+    createParam(SPLatencyString,                    asynParamFloat64, &SPLatency);
+    createParam(SPLatencyMeanString,                asynParamFloat64, &SPLatencyMean);
+    createParam(SPLatencyMaxString,                 asynParamFloat64, &SPLatencyMax);
+    createParam(SPBackpressureModeString,           asynParamInt32,   &SPBackpressureMode);
+    createParam(SPBackpressureHighString,           asynParamFloat64, &SPBackpressureHigh);
+    createParam(SPBackpressureLowString,            asynParamFloat64, &SPBackpressureLow);
+    createParam(SPBackpressureMaxDecimationString,  asynParamInt32,   &SPBackpressureMaxDecimation);
+    createParam(SPBackpressureLevelString,          asynParamFloat64, &SPBackpressureLevel);
+    createParam(SPBackpressureActiveString,         asynParamInt32,   &SPBackpressureActive);
+    createParam(SPBackpressureDecimationString,     asynParamInt32,   &SPBackpressureDecimation);
+    createParam(SPBackpressureDroppedString,        asynParamInt32,   &SPBackpressureDropped);
+    createParam(SPCropXString,                      asynParamInt32,   &SPCropX);
+    createParam(SPCropYString,                      asynParamInt32,   &SPCropY);
+    createParam(SPCropSizeXString,                  asynParamInt32,   &SPCropSizeX);
+    createParam(SPCropSizeYString,                  asynParamInt32,   &SPCropSizeY);
+    createParam(SPFlipXString,                      asynParamInt32,   &SPFlipX);
+    createParam(SPFlipYString,                      asynParamInt32,   &SPFlipY);
+    createParam(SPRotationString,                   asynParamInt32,   &SPRotation);
+    createParam(SPBitShiftString,                   asynParamInt32,   &SPBitShift);
+    createParam(SPCopyTimeString,                   asynParamFloat64, &SPCopyTime);
+    createParam(SPDarkEnableString,                 asynParamInt32,   &SPDarkEnable);
+    createParam(SPFlatEnableString,                 asynParamInt32,   &SPFlatEnable);
+    createParam(SPCorrectionTypeString,             asynParamInt32,   &SPCorrectionType);
+    createParam(SPCorrectionActiveString,           asynParamInt32,   &SPCorrectionActive);
+    createParam(SPCorrectionSimdString,             asynParamOctet,   &SPCorrectionSimd);
+    createParam(SPCorrectionStatusString,           asynParamOctet,   &SPCorrectionStatus);
+    createParam(SPReferenceFramesString,            asynParamInt32,   &SPReferenceFrames);
+    createParam(SPCollectDarkString,                asynParamInt32,   &SPCollectDark);
+    createParam(SPCollectFlatString,                asynParamInt32,   &SPCollectFlat);
+    createParam(SPCollectRemainingString,           asynParamInt32,   &SPCollectRemaining);
+    createParam(SPDarkValidString,                  asynParamInt32,   &SPDarkValid);
+    createParam(SPFlatValidString,                  asynParamInt32,   &SPFlatValid);
+    createParam(SPDarkFileString,                   asynParamOctet,   &SPDarkFile);
+    createParam(SPFlatFileString,                   asynParamOctet,   &SPFlatFile);
+    createParam(SPLoadDarkString,                   asynParamInt32,   &SPLoadDark);
+    createParam(SPLoadFlatString,                   asynParamInt32,   &SPLoadFlat);
+    createParam(SPSaveDarkString,                   asynParamInt32,   &SPSaveDark);
+    createParam(SPSaveFlatString,                   asynParamInt32,   &SPSaveFlat);
+    createParam(SPDefectEnableString,               asynParamInt32,   &SPDefectEnable);
+    createParam(SPDefectActiveString,               asynParamInt32,   &SPDefectActive);
+    createParam(SPDefectCountString,                asynParamInt32,   &SPDefectCount);
+    createParam(SPHotThresholdString,               asynParamFloat64, &SPHotThreshold);
+    createParam(SPDeadThresholdString,              asynParamFloat64, &SPDeadThreshold);
+    createParam(SPDetectDefectsString,              asynParamInt32,   &SPDetectDefects);
+    createParam(SPDefectFileString,                 asynParamOctet,   &SPDefectFile);
+    createParam(SPLoadDefectsString,                asynParamInt32,   &SPLoadDefects);
+    createParam(SPSaveDefectsString,                asynParamInt32,   &SPSaveDefects);
+    createParam(SPAccumulateEnableString,           asynParamInt32,   &SPAccumulateEnable);
+    createParam(SPAccumulateFramesString,           asynParamInt32,   &SPAccumulateFrames);
+    createParam(SPAccumulateTypeString,             asynParamInt32,   &SPAccumulateType);
+    createParam(SPAccumulateModeString,             asynParamInt32,   &SPAccumulateMode);
+    createParam(SPAccumulateCountString,            asynParamInt32,   &SPAccumulateCount);
+    createParam(SPStatsEnableString,                asynParamInt32,   &SPStatsEnable);
+    createParam(SPStatsRateString,                  asynParamFloat64, &SPStatsRate);
+    createParam(SPHistSizeString,                   asynParamInt32,   &SPHistSize);
+    createParam(SPHistMinString,                    asynParamFloat64, &SPHistMin);
+    createParam(SPHistMaxString,                    asynParamFloat64, &SPHistMax);
+    createParam(SPSaturationLevelString,            asynParamFloat64, &SPSaturationLevel);
+    createParam(SPStatsMinString,                   asynParamFloat64, &SPStatsMin);
+    createParam(SPStatsMaxString,                   asynParamFloat64, &SPStatsMax);
+    createParam(SPStatsMeanString,                  asynParamFloat64, &SPStatsMean);
+    createParam(SPStatsSigmaString,                 asynParamFloat64, &SPStatsSigma);
+    createParam(SPStatsSaturatedString,             asynParamInt32,   &SPStatsSaturated);
+    createParam(SPHistogramString,                  asynParamFloat64Array, &SPHistogram);
+    createParam(SPCentroidEnableString,             asynParamInt32,   &SPCentroidEnable);
+    createParam(SPCentroidOnlyString,               asynParamInt32,   &SPCentroidOnly);
+    createParam(SPCentroidThresholdString,          asynParamFloat64, &SPCentroidThreshold);
+    createParam(SPCentroidMinXString,               asynParamInt32,   &SPCentroidMinX);
+    createParam(SPCentroidMinYString,               asynParamInt32,   &SPCentroidMinY);
+    createParam(SPCentroidSizeXString,              asynParamInt32,   &SPCentroidSizeX);
+    createParam(SPCentroidSizeYString,              asynParamInt32,   &SPCentroidSizeY);
+    createParam(SPCentroidTotalString,              asynParamFloat64, &SPCentroidTotal);
+    createParam(SPCentroidXString,                  asynParamFloat64, &SPCentroidX);
+    createParam(SPCentroidYString,                  asynParamFloat64, &SPCentroidY);
+    createParam(SPSigmaXString,                     asynParamFloat64, &SPSigmaX);
+    createParam(SPSigmaYString,                     asynParamFloat64, &SPSigmaY);
+    createParam(SPSigmaXYString,                    asynParamFloat64, &SPSigmaXY);
+    createParam(SPPeakXString,                      asynParamInt32,   &SPPeakX);
+    createParam(SPPeakYString,                      asynParamInt32,   &SPPeakY);
+    createParam(SPPeakValueString,                  asynParamFloat64, &SPPeakValue);
 
     /* Set initial values of some parameters */
     setIntegerParam(NDDataType, NDUInt8);
@@ -162,6 +429,144 @@ ADSpinnaker::ADSpinnaker(const char *portName, int cameraId, int numSPBuffers,
     setIntegerParam(ADMinY, 0);
     setStringParam(ADStringToServer, "<not used by driver>");
     setStringParam(ADStringFromServer, "<not used by driver>");
+    setDoubleParam(SPFeaturePollPeriod, 1.0);
+    setIntegerParam(SPFeatureBatchActive, 0);
+    setIntegerParam(SPFeatureBatchSize, 0);
+    setIntegerParam(SPHardwareFrameCount, 0);
+    setIntegerParam(SPHardwareFrameCountActive, 0);
+    setIntegerParam(SPPreTriggerEnable, 0);
+    setIntegerParam(SPPreTriggerCount, 10);
+    setIntegerParam(SPPostTriggerCount, 10);
+    setIntegerParam(SPPreTriggerState, SPPreTriggerOff);
+    setIntegerParam(SPPreTriggerFill, 0);
+    setIntegerParam(SPBurstEnable, 0);
+    setIntegerParam(SPBurstCount, 1000);
+    setIntegerParam(SPBurstDrainQueue, 10);
+    setIntegerParam(SPBurstState, SPBurstIdle);
+    setIntegerParam(SPBurstFrames, 0);
+    setDoubleParam(SPBurstFillRate, 0.);
+    setDoubleParam(SPBurstDrainRate, 0.);
+    setIntegerParam(SPChunkEnable, 0);
+    setUIntDigitalParam(SPChunkSelect, 0, 0xFFFFFFFF);
+    setIntegerParam(SPChunkActive, 0);
+    setIntegerParam(SPClockCorrelation, 0);
+    setDoubleParam(SPClockLatchPeriod, 1.0);
+    setDoubleParam(SPClockOffset, 0.);
+    setDoubleParam(SPClockDrift, 0.);
+    setDoubleParam(SPClockResidual, 0.);
+    setIntegerParam(SPClockSamples, 0);
+    setIntegerParam(SPPtpEnable, 0);
+    setStringParam(SPPtpStatus, "Unknown");
+    setIntegerParam(SPPtpLocked, 0);
+    setDoubleParam(SPPtpOffset, 0.);
+    setIntegerParam(SPActionDeviceKey, 0);
+    setIntegerParam(SPActionGroupKey, 0);
+    setIntegerParam(SPActionGroupMask, 0);
+    setDoubleParam(SPActionDelay, 1.0);
+    setIntegerParam(SPActionSend, 0);
+    setDoubleParam(SPActionTime, 0.);
+    setStringParam(SPLinkName, "");
+    setDoubleParam(SPLinkDemand, 0.);
+    setDoubleParam(SPLinkAllocation, 0.);
+    setDoubleParam(SPLinkCapacity, 0.);
+    setIntegerParam(SPLinkPacketDelay, 0);
+    setIntegerParam(SPAutoTune, 0);
+    setDoubleParam(SPAutoTuneDwell, 2.0);
+    setIntegerParam(SPAutoTuneSave, 0);
+    setIntegerParam(SPAutoTuneUserSet, 1);
+    setIntegerParam(SPAutoTuneSetDefault, 0);
+    setStringParam(SPAutoTuneStatus, "Idle");
+    setIntegerParam(SPAutoTunePacketSize, 0);
+    setIntegerParam(SPAutoTunePacketDelay, 0);
+    setDoubleParam(SPAutoTuneThroughput, 0.);
+    setIntegerParam(SPAutoTuneErrors, 0);
+    setIntegerParam(SPBufferCountMode, SPBufferCountManual);
+    setDoubleParam(SPBufferLatency, 500.);
+    setDoubleParam(SPBufferMemoryLimit, 0.);
+    setIntegerParam(SPBufferCountRequested, numSPBuffers_);
+    setIntegerParam(SPBufferCountActual, streamBufferCount_);
+    setIntegerParam(SPBufferCountMax, streamBufferCountMax_);
+    setIntegerParam(SPBufferHandlingMode, SPBufferOldestFirst);
+    setIntegerParam(SPQueueSkipped, 0);
+    setDoubleParam(SPLatency, 0.);
+    setDoubleParam(SPLatencyMean, 0.);
+    setDoubleParam(SPLatencyMax, 0.);
+    setIntegerParam(SPBackpressureMode, SPBackpressureAbort);
+    setDoubleParam(SPBackpressureHigh, 80.);
+    setDoubleParam(SPBackpressureLow, 50.);
+    setIntegerParam(SPBackpressureMaxDecimation, 16);
+    setDoubleParam(SPBackpressureLevel, 0.);
+    setIntegerParam(SPBackpressureActive, 0);
+    setIntegerParam(SPBackpressureDecimation, 1);
+    setIntegerParam(SPBackpressureDropped, 0);
+    setIntegerParam(SPCropX, 0);
+    setIntegerParam(SPCropY, 0);
+    setIntegerParam(SPCropSizeX, 0);
+    setIntegerParam(SPCropSizeY, 0);
+    setIntegerParam(SPFlipX, 0);
+    setIntegerParam(SPFlipY, 0);
+    setIntegerParam(SPRotation, SPRotateNone);
+    setIntegerParam(SPBitShift, 0);
+    setDoubleParam(SPCopyTime, 0.);
+    setIntegerParam(SPDarkEnable, 0);
+    setIntegerParam(SPFlatEnable, 0);
+    setIntegerParam(SPCorrectionType, SPCorrectionNative);
+    setIntegerParam(SPCorrectionActive, 0);
+    setStringParam(SPCorrectionSimd, SPFrameProcessor::getSimd());
+    setStringParam(SPCorrectionStatus, "");
+    setIntegerParam(SPReferenceFrames, 16);
+    setIntegerParam(SPCollectDark, 0);
+    setIntegerParam(SPCollectFlat, 0);
+    setIntegerParam(SPCollectRemaining, 0);
+    setIntegerParam(SPDarkValid, 0);
+    setIntegerParam(SPFlatValid, 0);
+    setStringParam(SPDarkFile, "");
+    setStringParam(SPFlatFile, "");
+    setIntegerParam(SPLoadDark, 0);
+    setIntegerParam(SPLoadFlat, 0);
+    setIntegerParam(SPSaveDark, 0);
+    setIntegerParam(SPSaveFlat, 0);
+    setIntegerParam(SPDefectEnable, 0);
+    setIntegerParam(SPDefectActive, 0);
+    setIntegerParam(SPDefectCount, 0);
+    setDoubleParam(SPHotThreshold, 5.0);
+    setDoubleParam(SPDeadThreshold, 50.0);
+    setIntegerParam(SPDetectDefects, 0);
+    setStringParam(SPDefectFile, "");
+    setIntegerParam(SPLoadDefects, 0);
+    setIntegerParam(SPSaveDefects, 0);
+    setIntegerParam(SPAccumulateEnable, 0);
+    setIntegerParam(SPAccumulateFrames, 10);
+    setIntegerParam(SPAccumulateType, SPAccumulateUInt32);
+    setIntegerParam(SPAccumulateMode, SPAccumulateSum);
+    setIntegerParam(SPAccumulateCount, 0);
+    setIntegerParam(SPStatsEnable, 0);
+    setDoubleParam(SPStatsRate, 10.0);
+    setIntegerParam(SPHistSize, 256);
+    setDoubleParam(SPHistMin, 0.0);
+    setDoubleParam(SPHistMax, 0.0);
+    setDoubleParam(SPSaturationLevel, 0.0);
+    setDoubleParam(SPStatsMin, 0.0);
+    setDoubleParam(SPStatsMax, 0.0);
+    setDoubleParam(SPStatsMean, 0.0);
+    setDoubleParam(SPStatsSigma, 0.0);
+    setIntegerParam(SPStatsSaturated, 0);
+    setIntegerParam(SPCentroidEnable, 0);
+    setIntegerParam(SPCentroidOnly, 0);
+    setDoubleParam(SPCentroidThreshold, 0.0);
+    setIntegerParam(SPCentroidMinX, 0);
+    setIntegerParam(SPCentroidMinY, 0);
+    setIntegerParam(SPCentroidSizeX, 0);
+    setIntegerParam(SPCentroidSizeY, 0);
+    setDoubleParam(SPCentroidTotal, 0.0);
+    setDoubleParam(SPCentroidX, 0.0);
+    setDoubleParam(SPCentroidY, 0.0);
+    setDoubleParam(SPSigmaX, 0.0);
+    setDoubleParam(SPSigmaY, 0.0);
+    setDoubleParam(SPSigmaXY, 0.0);
+    setIntegerParam(SPPeakX, 0);
+    setIntegerParam(SPPeakY, 0);
+    setDoubleParam(SPPeakValue, 0.0);
 
     // Create the message queue to pass images from the callback class
     pCallbackMsgQ_ = new epicsMessageQueue(CALLBACK_MESSAGE_QUEUE_SIZE, sizeof(ImagePtr));
@@ -180,6 +585,18 @@ ADSpinnaker::ADSpinnaker(const char *portName, int cameraId, int numSPBuffers,
                       epicsThreadGetStackSize(epicsThreadStackMedium),
                       imageGrabTaskC, this);
 
+    // launch the low priority task that updates pushed and volatile features
+    epicsThreadCreate("ADSpinnakerFeatureTask", 
+                      epicsThreadPriorityLow,
+                      epicsThreadGetStackSize(epicsThreadStackMedium),
+                      featureTaskC, this);
+
+    // launch the task that writes GC_ and mapped features
+    epicsThreadCreate("ADSpinnakerFeatureIOTask", 
+                      epicsThreadPriorityMedium,
+                      epicsThreadGetStackSize(epicsThreadStackMedium),
+                      featureIOTaskC, this);
+
     // shutdown on exit
     epicsAtExit(c_shutdown, this);
 
@@ -191,11 +608,25 @@ void ADSpinnaker::shutdown(void)
 {
     static const char *functionName = "shutdown";
     
+    SPBandwidthManager::getInstance()->removeCamera(this);
     lock();
     exiting_ = 1;
+    unlock();
+    // featureTask, featureIOTask and autoTuneTask access the node map without the driver lock,
+    // so they must have exited before the node map is destroyed
+    epicsEventSignal(featureEventId_);
+    epicsEventSignal(featureIOEventId_);
+    epicsEventWait(featureTaskDoneEventId_);
+    epicsEventWait(featureIOTaskDoneEventId_);
+    while (autoTuneActive_) epicsThreadSleep(0.1);
+    lock();
     try {
         pCamera_->UnregisterEventHandler(*pImageEventHandler_);
         delete pImageEventHandler_;
+        // The node callbacks must be removed before the node map is destroyed
+        for (size_t i=0; i<spFeatures_.size(); i++) {
+            spFeatures_[i]->deregisterCallback();
+        }
         pNodeMap_ = 0;
         pCamera_->DeInit();
         pCamera_ = 0;
@@ -213,13 +644,457 @@ void ADSpinnaker::shutdown(void)
 GenICamFeature *ADSpinnaker::createFeature(GenICamFeatureSet *set, 
                                            std::string const & asynName, asynParamType asynType, int asynIndex,
                                            std::string const & featureName, GCFeatureType_t featureType) {
-    return new SPFeature(set, asynName, asynType, asynIndex, featureName, featureType);
+    SPFeature *pFeature = new SPFeature(set, asynName, asynType, asynIndex, featureName, featureType);
+    // The feature lists are also used by featureTask, lock() is recursive so this is safe
+    // whether or not the caller holds the lock
+    lock();
+    spFeatures_.push_back(pFeature);
+    spFeatureNodeMap_[featureName].push_back(pFeature);
+    // Features created from GC_ drvInfo strings, and the areaDetector parameters that ADGenICam maps
+    // to a feature without any other action, are written by featureIOTask.  writeFeatureValue() does
+    // the unit conversion of AcquireTime and AcquirePeriod that GenICamFeature::write() would do.
+    if (((asynName.compare(0, 3, "GC_") == 0) || isQueuedMappedParam(asynIndex)) && pFeature->isImplemented()) {
+        spQueuedFeatureMap_[asynIndex] = pFeature;
+    }
+    unlock();
+    return pFeature;
+}
+
+/** Returns true for the areaDetector parameters whose writes can take the same path as GC_ features.
+  * ADImageMode, ADNumImages and ADTriggerMode are left to ADGenICam, because startCapture() and
+  * setHardwareFrameCount() also write the features they map to.
+  */
+bool ADSpinnaker::isQueuedMappedParam(int param)
+{
+    return (param == ADAcquireTime) || (param == ADAcquirePeriod) || (param == ADGain) ||
+           (param == ADMinX) || (param == ADMinY) || (param == ADSizeX) || (param == ADSizeY) ||
+           (param == ADBinX) || (param == ADBinY) || (param == ADReverseX) || (param == ADReverseY);
+}
+
+/** Returns the feature of a parameter whose writes are queued to featureIOTask, or NULL */
+SPFeature *ADSpinnaker::getQueuedFeature(int param)
+{
+    std::map<int, SPFeature *>::iterator it = spQueuedFeatureMap_.find(param);
+    if (it == spQueuedFeatureMap_.end()) return NULL;
+    return it->second;
+}
+
+/** Returns the features that can change when pFeature is written.
+  * These are the features whose nodes depend on pFeature (ctDependingNodes), for example
+  * AcquisitionFrameRate when pFeature is ExposureTime, and the features selected by pFeature
+  * if it is a selector.  The list is computed from the node map the first time it is needed.
+  */
+std::vector<SPFeature *> & ADSpinnaker::getDependents(SPFeature *pFeature)
+{
+    static const char *functionName = "getDependents";
+
+    std::map<SPFeature *, std::vector<SPFeature *> >::iterator it = spFeatureDependents_.find(pFeature);
+    if (it != spFeatureDependents_.end()) return it->second;
+
+    std::vector<SPFeature *> &dependents = spFeatureDependents_[pFeature];
+    std::set<std::string> names;
+    try {
+        INode *pNode = pFeature->getNode();
+        NodeList_t nodes;
+        pNode->GetChildren(nodes, ctDependingNodes);
+        for (size_t i=0; i<nodes.size(); i++) {
+            names.insert(nodes[i]->GetName().c_str());
+        }
+        FeatureList_t selected;
+        pNode->GetSelectedFeatures(selected);
+        for (size_t i=0; i<selected.size(); i++) {
+            names.insert(selected[i]->GetNode()->GetName().c_str());
+        }
+    }
+    catch (Spinnaker::Exception &e) {
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+            "%s::%s exception %s\n",
+            driverName, functionName, e.what());
+    }
+    for (std::set<std::string>::iterator name=names.begin(); name!=names.end(); ++name) {
+        std::map<std::string, std::vector<SPFeature *> >::iterator features = spFeatureNodeMap_.find(*name);
+        if (features == spFeatureNodeMap_.end()) continue;
+        dependents.insert(dependents.end(), features->second.begin(), features->second.end());
+    }
+    return dependents;
+}
+
+/** Reads back the features affected by writes to the features in written.
+  * These are the written features, their dependents from the node map, and any feature whose node
+  * callback has fired since it was last read.  The values are first read into the SPFeature cache
+  * without the driver lock, so only the parameter updates are done with the lock held.
+  * Returns the number of features that were read.
+  */
+int ADSpinnaker::refreshFeatures(std::set<SPFeature *> &written)
+{
+    std::set<SPFeature *> refresh;
+
+    lock();
+    for (std::set<SPFeature *>::iterator it=written.begin(); it!=written.end(); ++it) {
+        std::vector<SPFeature *> &dependents = getDependents(*it);
+        refresh.insert(*it);
+        refresh.insert(dependents.begin(), dependents.end());
+    }
+    for (size_t i=0; i<spFeatures_.size(); i++) {
+        if (spFeatures_[i]->isStale()) refresh.insert(spFeatures_[i]);
+    }
+    unlock();
+    for (std::set<SPFeature *>::iterator it=refresh.begin(); it!=refresh.end(); ++it) {
+        if (exiting_) return 0;
+        (*it)->prefetch();
+    }
+    lock();
+    for (std::set<SPFeature *>::iterator it=refresh.begin(); it!=refresh.end(); ++it) {
+        (*it)->read(NULL, true);
+    }
+    unlock();
+    return (int)refresh.size();
+}
+
+/** Queues a write to a GC_ or mapped feature for featureIOTask.
+  * If the last queued write is to the same feature it is replaced, so a burst of writes
+  * to one feature, for example from a slider, only results in one register write.
+  * Writes to command features are never combined, because each one must be executed.
+  */
+void ADSpinnaker::queueFeatureWrite(SPFeature *pFeature, asynParamType valueType, epicsInt64 intValue, double doubleValue)
+{
+    SPFeatureWrite_t request;
+
+    request.pFeature = pFeature;
+    request.valueType = valueType;
+    request.intValue = intValue;
+    request.doubleValue = doubleValue;
+    epicsMutexLock(featureWriteMutex_);
+    if (!featureWriteQueue_.empty() && (featureWriteQueue_.back().pFeature == pFeature) &&
+        (pFeature->getType() != GCFeatureTypeCmd)) {
+        featureWriteQueue_.back() = request;
+    } else {
+        featureWriteQueue_.push_back(request);
+    }
+    setIntegerParam(SPFeatureBatchSize, featureBatchActive_ ? (int)featureWriteQueue_.size() : 0);
+    epicsMutexUnlock(featureWriteMutex_);
+    epicsEventSignal(featureIOEventId_);
+}
+
+/** Writes a value to a feature, converting it to the feature type.
+  * AcquireTime is in seconds and written to ExposureTime in us, and AcquirePeriod is written to
+  * AcquisitionFrameRate as its inverse, with 0 giving the maximum rate.
+  * This is called from featureIOTask without the driver lock held, so the caller sets the parameter status
+  * from the returned status.
+  */
+asynStatus ADSpinnaker::writeFeatureValue(SPFeature *pFeature, asynParamType valueType, epicsInt64 intValue, double doubleValue)
+{
+    static const char *functionName = "writeFeatureValue";
+
+    if (valueType == asynParamFloat64) {
+        intValue = (epicsInt64)doubleValue;
+    } else {
+        doubleValue = (double)intValue;
+    }
+    try {
+        if (!pFeature->isWritable()) {
+            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+                "%s::%s feature %s is not writable\n",
+                driverName, functionName, pFeature->getNode()->GetName().c_str());
+            return asynError;
+        }
+        switch (pFeature->getType()) {
+            case GCFeatureTypeInteger: {
+                // Clip to the valid range and increment, rather than have SetValue() throw an exception
+                epicsInt64 min = pFeature->readIntegerMin();
+                epicsInt64 max = pFeature->readIntegerMax();
+                epicsInt64 inc = pFeature->readIncrement();
+                if (intValue < min) intValue = min;
+                if (intValue > max) intValue = max;
+                if (inc > 1) intValue = min + ((intValue - min) / inc) * inc;
+                pFeature->writeInteger(intValue);
+                break;
+            }
+            case GCFeatureTypeDouble: {
+                double min = pFeature->readDoubleMin();
+                double max = pFeature->readDoubleMax();
+                if (pFeature->getParamIndex() == ADAcquireTime) {
+                    doubleValue *= 1e6;
+                } else if (pFeature->getParamIndex() == ADAcquirePeriod) {
+                    doubleValue = (doubleValue > 0) ? 1. / doubleValue : max;
+                }
+                if (doubleValue < min) doubleValue = min;
+                if (doubleValue > max) doubleValue = max;
+                pFeature->writeDouble(doubleValue);
+                break;
+            }
+            case GCFeatureTypeBoolean:
+                pFeature->writeBoolean(intValue != 0);
+                break;
+            case GCFeatureTypeEnum:
+                pFeature->writeEnumIndex((int)intValue);
+                break;
+            case GCFeatureTypeCmd:
+                if (intValue) pFeature->writeCommand();
+                break;
+            default:
+                asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+                    "%s::%s unsupported feature type %d for %s\n",
+                    driverName, functionName, pFeature->getType(), pFeature->getNode()->GetName().c_str());
+                return asynError;
+        }
+    }
+    catch (Spinnaker::Exception &e) {
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+            "%s::%s exception %s\n",
+            driverName, functionName, e.what());
+        return asynError;
+    }
+    return asynSuccess;
+}
+
+/** Does the queued feature writes now, instead of in featureIOTask.  startCapture() calls this with the driver
+  * lock held, so that features written before Acquire=1 are set before BeginAcquisition(), while nodes that
+  * are locked during streaming can still be written.  Writes held by an open batch are also done.
+  */
+void ADSpinnaker::flushFeatureWrites()
+{
+    std::set<SPFeature *> written;
+    SPFeatureWrite_t request;
+    asynStatus status;
+
+    // featureIOTask holds featureIOMutex_ while it does a write, so any write it has taken from the queue is complete
+    epicsMutexLock(featureIOMutex_);
+    while (1) {
+        epicsMutexLock(featureWriteMutex_);
+        if (featureWriteQueue_.empty()) {
+            epicsMutexUnlock(featureWriteMutex_);
+            break;
+        }
+        request = featureWriteQueue_.front();
+        featureWriteQueue_.pop_front();
+        epicsMutexUnlock(featureWriteMutex_);
+        status = writeFeatureValue(request.pFeature, request.valueType, request.intValue, request.doubleValue);
+        setParamStatus(request.pFeature->getParamIndex(), status);
+        written.insert(request.pFeature);
+    }
+    epicsMutexUnlock(featureIOMutex_);
+    if (written.empty()) return;
+    setIntegerParam(SPFeatureBatchSize, 0);
+    refreshFeatures(written);
+}
+
+/** Task to write GC_ features and the mapped features of isQueuedMappedParam().
+ *
+ * Writes are queued by writeInt32, writeInt64 and writeFloat64, which return immediately.
+ * The register access is done here without the driver lock, so a slow GigE control channel
+ * never delays imageGrabTask.  When the queue is empty the affected features are read back
+ * once, and the readbacks are updated through the normal parameter callbacks.
+ * Between SPFeatureBatchBegin and SPFeatureBatchCommit the writes are held in the queue,
+ * and they are then all written followed by a single read back.
+ * A write that fails sets the status of its parameter, so the record goes into alarm.
+ */
+void ADSpinnaker::featureIOTask()
+{
+    std::set<SPFeature *> written;
+    std::map<SPFeature *, asynStatus> writeStatus;
+    SPFeatureWrite_t request;
+    int numRefreshed;
+    epicsTimeStamp tStart, tEnd;
+
+    while (1) {
+        epicsEventWait(featureIOEventId_);
+        if (exiting_) break;
+        while (!exiting_) {
+            epicsMutexLock(featureIOMutex_);
+            epicsMutexLock(featureWriteMutex_);
+            // While a batch is open the writes stay queued until it is committed
+            if (featureWriteQueue_.empty() || featureBatchActive_) {
+                epicsMutexUnlock(featureWriteMutex_);
+                epicsMutexUnlock(featureIOMutex_);
+                break;
+            }
+            request = featureWriteQueue_.front();
+            featureWriteQueue_.pop_front();
+            epicsMutexUnlock(featureWriteMutex_);
+            writeStatus[request.pFeature] = 
+                writeFeatureValue(request.pFeature, request.valueType, request.intValue, request.doubleValue);
+            epicsMutexUnlock(featureIOMutex_);
+            written.insert(request.pFeature);
+        }
+        if (exiting_) break;
+        if (written.empty()) continue;
+        lock();
+        setIntegerParam(SPFeatureBatchSize, 0);
+        for (std::map<SPFeature *, asynStatus>::iterator it=writeStatus.begin(); it!=writeStatus.end(); ++it) {
+            setParamStatus(it->first->getParamIndex(), it->second);
+        }
+        unlock();
+        writeStatus.clear();
+        epicsTimeGetCurrent(&tStart);
+        numRefreshed = refreshFeatures(written);
+        epicsTimeGetCurrent(&tEnd);
+        written.clear();
+        lock();
+        setDoubleParam(SPFeatureRefreshTime, epicsTimeDiffInSeconds(&tEnd, &tStart)*1000.);
+        setIntegerParam(SPFeatureRefreshCount, numRefreshed);
+        callParamCallbacks();
+        unlock();
+        // The write may have changed the payload size or frame rate, so featureTask updates the link demand
+        epicsEventSignal(featureEventId_);
+    }
+    epicsEventSignal(featureIOTaskDoneEventId_);
+}
+
+asynStatus ADSpinnaker::writeInt32(asynUser *pasynUser, epicsInt32 value)
+{
+    int function = pasynUser->reason;
+    SPFeature *pFeature = getQueuedFeature(function);
+
+    if (pFeature) {
+        setIntegerParam(function, value);
+        queueFeatureWrite(pFeature, asynParamInt32, value, 0.);
+        callParamCallbacks();
+        return asynSuccess;
+    }
+    if ((function == SPFeatureBatchBegin) || (function == SPFeatureBatchCommit)) {
+        if (value) {
+            epicsMutexLock(featureWriteMutex_);
+            featureBatchActive_ = (function == SPFeatureBatchBegin);
+            epicsMutexUnlock(featureWriteMutex_);
+            setIntegerParam(SPFeatureBatchActive, featureBatchActive_);
+            // On commit featureIOTask writes everything that was queued during the batch
+            if (!featureBatchActive_) epicsEventSignal(featureIOEventId_);
+        }
+        setIntegerParam(function, 0);
+        callParamCallbacks();
+        return asynSuccess;
+    }
+    if (function == SPClockCorrelation) {
+        setIntegerParam(function, value);
+        // Latching stops while the correlation is disabled, so the fit is discarded and starts again
+        clockCorrelator_.reset();
+        epicsEventSignal(featureEventId_);
+        callParamCallbacks();
+        return asynSuccess;
+    }
+    if (function == SPPtpEnable) {
+        setIntegerParam(function, value);
+        enablePtp(value != 0);
+        callParamCallbacks();
+        return asynSuccess;
+    }
+    if (function == SPActionSend) {
+        asynStatus status = asynSuccess;
+        if (value) status = sendActionCommand();
+        setIntegerParam(function, 0);
+        callParamCallbacks();
+        return status;
+    }
+    if (function == SPAutoTune) {
+        // The sweep takes several seconds per step so it runs in its own thread
+        if (value && !autoTuneActive_) {
+            autoTuneActive_ = true;
+            setIntegerParam(function, 1);
+            epicsThreadCreate("ADSpinnakerAutoTune",
+                              epicsThreadPriorityLow,
+                              epicsThreadGetStackSize(epicsThreadStackMedium),
+                              autoTuneTaskC, this);
+        }
+        callParamCallbacks();
+        return asynSuccess;
+    }
+    if ((function == SPCollectDark) || (function == SPCollectFlat) ||
+        (function == SPLoadDark) || (function == SPLoadFlat) ||
+        (function == SPSaveDark) || (function == SPSaveFlat)) {
+        asynStatus status;
+        setIntegerParam(function, value);
+        status = value ? referenceCommand(function) : asynSuccess;
+        // Writing 0 to CollectDark or CollectFlat cancels the collection
+        if (!value && ((function == SPCollectDark) || (function == SPCollectFlat))) {
+            frameProcessor_.startCollect(SPReferenceDark, 0);
+        }
+        updateReferenceStatus();
+        callParamCallbacks();
+        return status;
+    }
+    if ((function == SPDetectDefects) || (function == SPLoadDefects) || (function == SPSaveDefects)) {
+        asynStatus status = value ? defectCommand(function) : asynSuccess;
+        setIntegerParam(function, 0);
+        callParamCallbacks();
+        return status;
+    }
+    if (function == SPPreTriggerTrigger) {
+        // imageGrabTask flushes the ring when it receives the next image
+        if (value && (preTriggerState_ == SPPreTriggerArmed)) preTriggerFired_ = true;
+        setIntegerParam(function, 0);
+        callParamCallbacks();
+        return asynSuccess;
+    }
+    return ADGenICam::writeInt32(pasynUser, value);
+}
+
+asynStatus ADSpinnaker::writeInt64(asynUser *pasynUser, epicsInt64 value)
+{
+    int function = pasynUser->reason;
+    SPFeature *pFeature = getQueuedFeature(function);
+
+    if (pFeature) {
+        setInteger64Param(function, value);
+        queueFeatureWrite(pFeature, asynParamInt64, value, 0.);
+        callParamCallbacks();
+        return asynSuccess;
+    }
+    return ADGenICam::writeInt64(pasynUser, value);
+}
+
+asynStatus ADSpinnaker::writeFloat64(asynUser *pasynUser, epicsFloat64 value)
+{
+    int function = pasynUser->reason;
+    SPFeature *pFeature = getQueuedFeature(function);
+
+    if (pFeature) {
+        setDoubleParam(function, value);
+        queueFeatureWrite(pFeature, asynParamFloat64, 0, value);
+        callParamCallbacks();
+        return asynSuccess;
+    }
+    if ((function == SPFeaturePollPeriod) || (function == SPClockLatchPeriod)) {
+        setDoubleParam(function, value);
+        // Wake featureTask so the new period takes effect immediately
+        epicsEventSignal(featureEventId_);
+        callParamCallbacks();
+        return asynSuccess;
+    }
+    return ADGenICam::writeFloat64(pasynUser, value);
+}
+
+asynStatus ADSpinnaker::writeOctet(asynUser *pasynUser, const char *value, size_t nChars, size_t *nActual)
+{
+    int function = pasynUser->reason;
+
+    if (function == SPLinkName) {
+        std::string linkName(value, nChars);
+        setStringParam(function, linkName);
+        epicsMutexLock(linkMutex_);
+        linkName_ = linkName;
+        epicsMutexUnlock(linkMutex_);
+        // featureTask registers the camera on the new link
+        epicsEventSignal(featureEventId_);
+        *nActual = nChars;
+        callParamCallbacks();
+        return asynSuccess;
+    }
+    return ADGenICam::writeOctet(pasynUser, value, nChars, nActual);
 }
 
 INodeMap *ADSpinnaker::getNodeMap() {
     return pNodeMap_;
 }
 
+/** Sets the preview port that is passed each NDArray after it is published.  Called by SPPreviewConfig. */
+void ADSpinnaker::setPreview(SPPreview *pPreview)
+{
+    lock();
+    pPreview_ = pPreview;
+    unlock();
+}
+
 
 asynStatus ADSpinnaker::connectCamera(void)
 {
@@ -301,9 +1176,8 @@ asynStatus ADSpinnaker::connectCamera(void)
         CEnumerationPtr ptrStreamBufferCountMode = pTLStreamNodeMap_->GetNode("StreamBufferCountMode");
         CEnumEntryPtr ptrStreamBufferCountModeManual = ptrStreamBufferCountMode->GetEntryByName("Manual");
         // Retrieve and modify Stream Buffer Count
-        CIntegerPtr ptrBufferCount = pTLStreamNodeMap_->GetNode("StreamBufferCountManual");
         ptrStreamBufferCountMode->SetIntValue(ptrStreamBufferCountModeManual->GetValue());
-        ptrBufferCount->SetValue(numSPBuffers_);
+        setStreamBufferCount(numSPBuffers_);
     }
 
     catch (Spinnaker::Exception &e) {
@@ -362,95 +1236,658 @@ void ADSpinnaker::updateStreamStat(const char *nodeName, int param)
     }
 }
 
-/** Task to grab images off the camera and send them up to areaDetector
+/** Called from SPFeature node callbacks when a pushed feature changes.
+  * This can be called from SDK threads while the node map is locked, so it only signals featureTask.
+  */
+void ADSpinnaker::featureChanged()
+{
+    epicsEventSignal(featureEventId_);
+}
+
+/** Task to update features that change without being written by the driver.
  *
+ * Pushed features are read back when their node callback fires.  Volatile features are
+ * read every SPFeaturePollPeriod seconds, and INodeMap::Poll() is called at the same rate so that
+ * nodes with a PollingTime in the XML are invalidated and fire their callbacks.
+ * This runs at low priority off the port thread.  A poll period of 0 disables polling.
+ * The camera clock is latched every SPClockLatchPeriod seconds, but only while SPClockCorrelation is enabled,
+ * so cameras that do not use the correlation get no latch traffic on the control channel.
+ * The poll and the reads are done without the driver lock, which is only taken to update the parameters.
  */
-
-void ADSpinnaker::imageGrabTask()
+void ADSpinnaker::featureTask()
 {
-    asynStatus status = asynSuccess;
-    int imageCounter;
-    int numImages, numImagesCounter;
-    int imageMode;
-    int arrayCallbacks;
-    epicsTimeStamp startTime;
-    int acquire;
-    static const char *functionName = "imageGrabTask";
-
-    lock();
-
+    int clockCorrelation;
+    double pollPeriod, latchPeriod;
+    double elapsed, waitTime, latchWait;
+    bool poll, latch, timed;
+    epicsTimeStamp lastPoll, lastLatch, now;
+    std::vector<SPFeature *> update;
+    static const char *functionName = "featureTask";
+
+    epicsTimeGetCurrent(&lastPoll);
+    lastLatch = lastPoll;
     while (1) {
-        // Is acquisition active? 
-        getIntegerParam(ADAcquire, &acquire);
-        // If we are not acquiring then wait for a semaphore that is given when acquisition is started 
-        if (!acquire) {
-            setIntegerParam(ADStatus, ADStatusIdle);
-            callParamCallbacks();
-
-            // Wait for a signal that tells this thread that the transmission
-            // has started and we can start asking for image buffers...
-            asynPrint(pasynUserSelf, ASYN_TRACE_FLOW,
-                "%s::%s waiting for acquire to start\n", 
-                driverName, functionName);
-            // Release the lock while we wait for an event that says acquire has started, then lock again
-            unlock();
-            epicsEventWait(startEventId_);
-            lock();
-            asynPrint(pasynUserSelf, ASYN_TRACE_FLOW,
-                "%s::%s started!\n", 
-                driverName, functionName);
-            setIntegerParam(ADNumImagesCounter, 0);
-            setIntegerParam(ADAcquire, 1);
+        lock();
+        getDoubleParam(SPFeaturePollPeriod, &pollPeriod);
+        getDoubleParam(SPClockLatchPeriod, &latchPeriod);
+        getIntegerParam(SPClockCorrelation, &clockCorrelation);
+        unlock();
+        if (!clockCorrelation) latchPeriod = 0.;
+        // Wait until the next poll or clock latch is due
+        epicsTimeGetCurrent(&now);
+        timed = false;
+        waitTime = 0.;
+        if (pollPeriod > 0) {
+            waitTime = pollPeriod - epicsTimeDiffInSeconds(&now, &lastPoll);
+            timed = true;
         }
-
-        // Get the current time 
-        epicsTimeGetCurrent(&startTime);
-        // We are now waiting for an image
-        setIntegerParam(ADStatus, ADStatusWaiting);
-        // Call the callbacks to update any changes
-        callParamCallbacks();
-
-        status = grabImage();
-        if (status == asynError) {
-            // remember to release the NDArray back to the pool now
-            // that we are not using it (we didn't get an image...)
-            if (pRaw_) pRaw_->release();
-            pRaw_ = NULL;
-            continue;
+        if (latchPeriod > 0) {
+            latchWait = latchPeriod - epicsTimeDiffInSeconds(&now, &lastLatch);
+            if (!timed || (latchWait < waitTime)) waitTime = latchWait;
+            timed = true;
         }
-
-        getIntegerParam(NDArrayCounter, &imageCounter);
-        getIntegerParam(ADNumImages, &numImages);
-        getIntegerParam(ADNumImagesCounter, &numImagesCounter);
-        getIntegerParam(ADImageMode, &imageMode);
-        getIntegerParam(NDArrayCallbacks, &arrayCallbacks);
-        imageCounter++;
-        numImagesCounter++;
-        setIntegerParam(NDArrayCounter, imageCounter);
-        setIntegerParam(ADNumImagesCounter, numImagesCounter);
-
-        if (arrayCallbacks) {
-            // Call the NDArray callback
-            doCallbacksGenericPointer(pRaw_, NDArrayData, 0);
+        if (!timed) {
+            epicsEventWait(featureEventId_);
+        } else if (waitTime > 0) {
+            epicsEventWaitWithTimeout(featureEventId_, waitTime);
         }
-        // Release the NDArray buffer now that we are done with it.
-        // After the callback just above we don't need it anymore
-        // Release the NDArray buffer now that we are done with it.
-        if (this->pArrays[0]) {
-            this->pArrays[0]->release();
+        lock();
+        if (exiting_) {
+            unlock();
+            break;
         }
-        this->pArrays[0] = pRaw_;
-        pRaw_ = NULL;
-
-        getIntegerParam(ADAcquire, &acquire);
-        // See if acquisition is done if we are in single or multiple mode
-        // The check for acquire=0 means this thread will call stopCapture and hence pCamera_->EndAcquisition().
-        // Failure to do this result in hang in call to pCamera_->EndAcquisition() in other thread
+        epicsTimeGetCurrent(&now);
+        elapsed = epicsTimeDiffInSeconds(&now, &lastPoll);
+        poll = (pollPeriod > 0) && (elapsed >= pollPeriod);
+        latch = (latchPeriod > 0) && (epicsTimeDiffInSeconds(&now, &lastLatch) >= latchPeriod);
+        if (latch) lastLatch = now;
+        if (poll) lastPoll = now;
+        unlock();
+        try {
+            if (poll) pNodeMap_->Poll((int64_t)(elapsed * 1000.));
+        }
+        catch (Spinnaker::Exception &e) {
+            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+                "%s::%s exception %s\n",
+                driverName, functionName, e.what());
+        }
+        // spFeatures_ is only changed with the lock held
+        lock();
+        update.clear();
+        for (size_t i=0; i<spFeatures_.size(); i++) {
+            SPFeature *pFeature = spFeatures_[i];
+            if ((pFeature->isPushed() && pFeature->isStale()) ||
+                (poll && pFeature->isVolatile())) {
+                update.push_back(pFeature);
+            }
+        }
+        unlock();
+        for (size_t i=0; i<update.size() && !exiting_; i++) {
+            update[i]->prefetch();
+        }
+        lock();
+        try {
+            for (size_t i=0; i<update.size(); i++) {
+                update[i]->read(NULL, true);
+            }
+        }
+        catch (Spinnaker::Exception &e) {
+            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+                "%s::%s exception %s\n",
+                driverName, functionName, e.what());
+        }
+        callParamCallbacks();
+        unlock();
+        // Each of these checks exiting_ before it accesses the node map without the driver lock
+        if (latch) latchClock();
+        if (poll) pollPtp();
+        updateLinkDemand();
+        applyLinkAllocation();
+    }
+    epicsEventSignal(featureTaskDoneEventId_);
+}
+
+/** Returns the node with the SFNC name, or the older name if the camera only implements that */
+INode *ADSpinnaker::findNode(const char *name, const char *altName)
+{
+    INode *pNode = pNodeMap_->GetNode(name);
+
+    if (!IsAvailable(pNode)) pNode = pNodeMap_->GetNode(altName);
+    return pNode;
+}
+
+/** Latches the camera clock.  pHostTime is the host time at the middle of the latch command.
+  * With PTP enabled the camera clock is the PTP time.
+  */
+bool ADSpinnaker::readCameraTime(epicsInt64 *pCameraTime, epicsTimeStamp *pHostTime)
+{
+    epicsTimeStamp after;
+    CCommandPtr pLatch = findNode("TimestampLatch", "GevTimestampControlLatch");
+    CIntegerPtr pLatchValue = findNode("TimestampLatchValue", "GevTimestampValue");
+
+    if (!IsWritable(pLatch) || !IsReadable(pLatchValue)) return false;
+    epicsTimeGetCurrent(pHostTime);
+    pLatch->Execute();
+    epicsTimeGetCurrent(&after);
+    *pCameraTime = pLatchValue->GetValue(false, true);
+    epicsTimeAddSeconds(pHostTime, epicsTimeDiffInSeconds(&after, pHostTime) / 2.);
+    return true;
+}
+
+/** Latches the camera clock and adds it, with the host time at the middle of the latch command,
+  * to the clock correlation.  Called from featureTask without the driver lock.
+  */
+void ADSpinnaker::latchClock()
+{
+    epicsTimeStamp hostTime;
+    epicsInt64 cameraTime;
+    static const char *functionName = "latchClock";
+
+    if (exiting_) return;
+    try {
+        if (!readCameraTime(&cameraTime, &hostTime)) return;
+        clockCorrelator_.addSample(cameraTime, hostTime);
+    }
+    catch (Spinnaker::Exception &e) {
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+            "%s::%s exception %s\n",
+            driverName, functionName, e.what());
+        return;
+    }
+    lock();
+    setDoubleParam(SPClockOffset, clockCorrelator_.getOffset());
+    setDoubleParam(SPClockDrift, clockCorrelator_.getDrift());
+    setDoubleParam(SPClockResidual, clockCorrelator_.getResidual() * 1e6);
+    setIntegerParam(SPClockSamples, clockCorrelator_.getNumSamples());
+    callParamCallbacks();
+    unlock();
+}
+
+/** Computes the rate at which the camera sends stream data, from the payload size, the resulting
+  * frame rate and the packet headers, and passes it to SPBandwidthManager if it has changed by more
+  * than 1% or the camera has moved to another link.  Called from featureTask without the driver lock.
+  */
+void ADSpinnaker::updateLinkDemand()
+{
+    std::string linkName;
+    double demand = 0.;
+    static const char *functionName = "updateLinkDemand";
+
+    if (exiting_) return;
+    epicsMutexLock(linkMutex_);
+    linkName = linkName_;
+    epicsMutexUnlock(linkMutex_);
+    if (linkName.empty() && linkNameApplied_.empty()) return;
+    if (!linkName.empty()) {
+        try {
+            CIntegerPtr pPayloadSize = pNodeMap_->GetNode("PayloadSize");
+            CFloatPtr pFrameRate = findNode("AcquisitionResultingFrameRate", "AcquisitionFrameRate");
+            CIntegerPtr pPacketSize = findNode("GevSCPSPacketSize", "DeviceStreamChannelPacketSize");
+            if (!IsReadable(pPayloadSize) || !IsReadable(pFrameRate)) return;
+            demand = (double)pPayloadSize->GetValue() * pFrameRate->GetValue();
+            if (IsReadable(pPacketSize) && (pPacketSize->GetValue() > GVSP_PACKET_OVERHEAD)) {
+                double packetSize = (double)pPacketSize->GetValue();
+                demand *= packetSize / (packetSize - GVSP_PACKET_OVERHEAD);
+            }
+        }
+        catch (Spinnaker::Exception &e) {
+            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+                "%s::%s exception %s\n",
+                driverName, functionName, e.what());
+            return;
+        }
+    }
+    if ((linkName == linkNameApplied_) && (fabs(demand - linkDemand_) <= 0.01 * linkDemand_)) return;
+    linkNameApplied_ = linkName;
+    linkDemand_ = demand;
+    SPBandwidthManager::getInstance()->setDemand(this, linkName, demand);
+    lock();
+    setDoubleParam(SPLinkDemand, demand / 1e6);
+    if (linkName.empty()) {
+        setDoubleParam(SPLinkAllocation, 0.);
+        setDoubleParam(SPLinkCapacity, 0.);
+    }
+    callParamCallbacks();
+    unlock();
+}
+
+/** Called by SPBandwidthManager with the bandwidth allocated to this camera and the capacity of its link,
+  * in bytes/s.  This can be called from the thread of another camera, so it only signals featureTask.
+  */
+void ADSpinnaker::setLinkAllocation(double allocation, double capacity)
+{
+    epicsMutexLock(linkMutex_);
+    linkAllocation_ = allocation;
+    linkCapacity_ = capacity;
+    linkAllocationPending_ = true;
+    epicsMutexUnlock(linkMutex_);
+    epicsEventSignal(featureEventId_);
+}
+
+/** Writes a new link allocation to the camera.  Cameras with DeviceLinkThroughputLimit compute the
+  * inter-packet delay themselves.  For other GigE cameras GevSCPD is set so that packets of
+  * GevSCPSPacketSize leave at the allocated rate.  Called from featureTask without the driver lock.
+  * While autoTune() is running the allocation is left pending, so it does not change the stream settings
+  * being measured, and is applied when the tune is done.
+  */
+void ADSpinnaker::applyLinkAllocation()
+{
+    double allocation, capacity;
+    int packetDelay = 0;
+    static const char *functionName = "applyLinkAllocation";
+
+    if (exiting_ || autoTuneActive_) return;
+    epicsMutexLock(linkMutex_);
+    if (!linkAllocationPending_ || linkName_.empty()) {
+        linkAllocationPending_ = false;
+        epicsMutexUnlock(linkMutex_);
+        return;
+    }
+    allocation = linkAllocation_;
+    capacity = linkCapacity_;
+    linkAllocationPending_ = false;
+    epicsMutexUnlock(linkMutex_);
+    try {
+        CIntegerPtr pLimit = pNodeMap_->GetNode("DeviceLinkThroughputLimit");
+        CIntegerPtr pDelay = pNodeMap_->GetNode("GevSCPD");
+        if (IsWritable(pLimit)) {
+            epicsInt64 limit = (epicsInt64)allocation;
+            epicsInt64 increment = pLimit->GetInc();
+            if (increment > 1) limit -= limit % increment;
+            limit = std::max((epicsInt64)pLimit->GetMin(), std::min((epicsInt64)pLimit->GetMax(), limit));
+            pLimit->SetValue(limit);
+        } else if (IsWritable(pDelay) && (allocation > 0)) {
+            CIntegerPtr pPacketSize = findNode("GevSCPSPacketSize", "DeviceStreamChannelPacketSize");
+            CIntegerPtr pLinkSpeed = pNodeMap_->GetNode("DeviceLinkSpeed");
+            CIntegerPtr pTickFrequency = findNode("GevTimestampTickFrequency", "TimestampTickFrequency");
+            double packetSize = IsReadable(pPacketSize) ? (double)pPacketSize->GetValue() : 1500.;
+            double linkSpeed = IsReadable(pLinkSpeed) ? (double)pLinkSpeed->GetValue() : capacity;
+            double tickFrequency = IsReadable(pTickFrequency) ? (double)pTickFrequency->GetValue() : 1e9;
+            // The delay is the time between packets at the allocated rate less the time to send one
+            double delay = packetSize / allocation - ((linkSpeed > 0) ? packetSize / linkSpeed : 0.);
+            epicsInt64 ticks = (epicsInt64)(std::max(delay, 0.) * tickFrequency);
+            ticks = std::min((epicsInt64)pDelay->GetMax(), ticks);
+            pDelay->SetValue(ticks);
+        }
+        if (IsReadable(pDelay)) packetDelay = (int)pDelay->GetValue(false, true);
+    }
+    catch (Spinnaker::Exception &e) {
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+            "%s::%s exception %s\n",
+            driverName, functionName, e.what());
+    }
+    lock();
+    setDoubleParam(SPLinkAllocation, allocation / 1e6);
+    setDoubleParam(SPLinkCapacity, capacity / 1e6);
+    setIntegerParam(SPLinkPacketDelay, packetDelay);
+    callParamCallbacks();
+    unlock();
+}
+
+void ADSpinnaker::setAutoTuneStatus(const char *status)
+{
+    lock();
+    setStringParam(SPAutoTuneStatus, status);
+    callParamCallbacks();
+    unlock();
+}
+
+/** Runs autoTune() and clears SPAutoTune when it is done.  The link allocation, which was held back
+  * during the tune, is then applied again for the new packet size.  This thread exits after one tune.
+  */
+void ADSpinnaker::autoTuneTask()
+{
+    autoTune();
+    lock();
+    autoTuneActive_ = false;
+    setIntegerParam(SPAutoTune, 0);
+    callParamCallbacks();
+    unlock();
+    epicsMutexLock(linkMutex_);
+    if (!linkName_.empty()) linkAllocationPending_ = true;
+    epicsMutexUnlock(linkMutex_);
+    epicsEventSignal(featureEventId_);
+}
+
+/** Waits for a new packet delay or throughput limit to settle, then counts the stream packets for dwell seconds.
+  * pThroughput is the payload rate in bytes/s, and pErrors the number of missed packets plus resend requests.
+  * Returns false if acquisition was stopped meanwhile.
+  */
+bool ADSpinnaker::measureStream(double dwell, int packetSize, double *pThroughput, int *pErrors)
+{
+    epicsInt64 startReceived, startErrors;
+    epicsInt64 received, errors;
+    int acquire;
+    CIntegerPtr pReceived = pTLStreamNodeMap_->GetNode("StreamReceivedPacketCount");
+    CIntegerPtr pMissed = pTLStreamNodeMap_->GetNode("StreamMissedPacketCount");
+    CIntegerPtr pResend = pTLStreamNodeMap_->GetNode("StreamPacketResendRequestedPacketCount");
+
+    epicsThreadSleep(dwell / 4.);
+    startReceived = IsReadable(pReceived) ? pReceived->GetValue() : 0;
+    startErrors = (IsReadable(pMissed) ? pMissed->GetValue() : 0) + (IsReadable(pResend) ? pResend->GetValue() : 0);
+    epicsThreadSleep(dwell);
+    lock();
+    getIntegerParam(ADAcquire, &acquire);
+    unlock();
+    if (!acquire || exiting_) return false;
+    received = (IsReadable(pReceived) ? pReceived->GetValue() : 0) - startReceived;
+    errors = (IsReadable(pMissed) ? pMissed->GetValue() : 0) + (IsReadable(pResend) ? pResend->GetValue() : 0) - startErrors;
+    *pThroughput = received * (double)(packetSize - GVSP_PACKET_OVERHEAD) / dwell;
+    *pErrors = (int)errors;
+    return true;
+}
+
+/** Finds the fastest stream settings the network path carries without packet loss.
+  * The largest packet size the path allows is found with DiscoverMaxPacketSize(), which must be done
+  * while the camera is not streaming.  The driver then acquires and steps GevSCPD up from 0, or
+  * DeviceLinkThroughputLimit down from its maximum on cameras where GevSCPD is computed by the camera,
+  * for SPAutoTuneDwell seconds per step.  The first step without missed packets or resend requests is kept.
+  * When the camera is on a link managed by SPBandwidthManager (SPLinkName set) the delay or limit belongs to
+  * the bandwidth manager, so only the packet size is tuned and the stream is measured once at the current delay.
+  * If SPAutoTuneSave is set the settings are saved to user set SPAutoTuneUserSet, which is also made the
+  * default user set if SPAutoTuneSetDefault is set.  Neither is done by default, so a saved configuration
+  * is not overwritten unless the user asks for it.
+  */
+asynStatus ADSpinnaker::autoTune()
+{
+    int acquire, imageMode, save, userSet, setDefault;
+    char userSetName[16];
+    double dwell;
+    int packetSize;
+    bool sweepDelay, linkManaged;
+    std::vector<epicsInt64> candidates;
+    CIntegerPtr pPacketSize, pDelay, pLimit, pSweep;
+    double throughput, bestThroughput = 0.;
+    int errors, bestErrors = 0;
+    int best = -1;
+    char message[64];
+    asynStatus status;
+    size_t i;
+    static const char *functionName = "autoTune";
+
+    lock();
+    getIntegerParam(ADAcquire, &acquire);
+    getIntegerParam(ADImageMode, &imageMode);
+    getDoubleParam(SPAutoTuneDwell, &dwell);
+    getIntegerParam(SPAutoTuneSave, &save);
+    getIntegerParam(SPAutoTuneUserSet, &userSet);
+    getIntegerParam(SPAutoTuneSetDefault, &setDefault);
+    unlock();
+    epicsSnprintf(userSetName, sizeof(userSetName), "UserSet%d", userSet);
+    epicsMutexLock(linkMutex_);
+    linkManaged = !linkName_.empty();
+    epicsMutexUnlock(linkMutex_);
+    if (acquire) {
+        setAutoTuneStatus("Stop acquisition first");
+        return asynError;
+    }
+    if (imageMode != ADImageContinuous) {
+        setAutoTuneStatus("ImageMode must be Continuous");
+        return asynError;
+    }
+    if (dwell <= 0) dwell = 1.;
+    try {
+        pPacketSize = findNode("GevSCPSPacketSize", "DeviceStreamChannelPacketSize");
+        pDelay = pNodeMap_->GetNode("GevSCPD");
+        pLimit = pNodeMap_->GetNode("DeviceLinkThroughputLimit");
+        if (!IsWritable(pPacketSize)) {
+            setAutoTuneStatus("Not a GigE camera");
+            return asynError;
+        }
+        setAutoTuneStatus("Discovering packet size");
+        packetSize = (int)pCamera_->DiscoverMaxPacketSize();
+        packetSize -= packetSize % std::max((int)pPacketSize->GetInc(), 1);
+        packetSize = std::max((int)pPacketSize->GetMin(), std::min((int)pPacketSize->GetMax(), packetSize));
+        pPacketSize->SetValue(packetSize);
+        packetSize = (int)pPacketSize->GetValue(false, true);
+
+        // Candidates in order of decreasing throughput
+        sweepDelay = IsWritable(pDelay);
+        if (linkManaged && (sweepDelay || IsWritable(pLimit))) {
+            pSweep = sweepDelay ? pDelay : pLimit;
+            candidates.push_back(pSweep->GetValue());
+        } else if (sweepDelay) {
+            static const double delayFactors[] = {0., 0.1, 0.25, 0.5, 1., 2., 4.};
+            CIntegerPtr pLinkSpeed = pNodeMap_->GetNode("DeviceLinkSpeed");
+            CIntegerPtr pTickFrequency = findNode("GevTimestampTickFrequency", "TimestampTickFrequency");
+            double linkSpeed = IsReadable(pLinkSpeed) ? (double)pLinkSpeed->GetValue() : 125e6;
+            double tickFrequency = IsReadable(pTickFrequency) ? (double)pTickFrequency->GetValue() : 1e9;
+            // Delays are multiples of the time to send one packet
+            double packetTicks = packetSize / linkSpeed * tickFrequency;
+            for (i=0; i<sizeof(delayFactors)/sizeof(delayFactors[0]); i++) {
+                candidates.push_back(std::min((epicsInt64)pDelay->GetMax(), (epicsInt64)(delayFactors[i] * packetTicks)));
+            }
+            pSweep = pDelay;
+        } else if (IsWritable(pLimit)) {
+            static const double limitFactors[] = {1., 0.9, 0.8, 0.7, 0.6, 0.5};
+            epicsInt64 increment = std::max((epicsInt64)pLimit->GetInc(), (epicsInt64)1);
+            for (i=0; i<sizeof(limitFactors)/sizeof(limitFactors[0]); i++) {
+                epicsInt64 limit = (epicsInt64)(limitFactors[i] * pLimit->GetMax());
+                limit -= limit % increment;
+                candidates.push_back(std::max((epicsInt64)pLimit->GetMin(), limit));
+            }
+            pSweep = pLimit;
+        } else {
+            setAutoTuneStatus("No packet delay or throughput limit");
+            return asynError;
+        }
+    }
+    catch (Spinnaker::Exception &e) {
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+            "%s::%s exception %s\n",
+            driverName, functionName, e.what());
+        setAutoTuneStatus("Error setting packet size");
+        return asynError;
+    }
+
+    lock();
+    setIntegerParam(ADAcquire, 1);
+    status = startCapture();
+    if (status) setIntegerParam(ADAcquire, 0);
+    callParamCallbacks();
+    unlock();
+    if (status) {
+        setAutoTuneStatus("Cannot start acquisition");
+        return asynError;
+    }
+    try {
+        for (i=0; i<candidates.size(); i++) {
+            epicsSnprintf(message, sizeof(message), "Testing %s %lld",
+                sweepDelay ? "GevSCPD" : "limit", (long long)candidates[i]);
+            setAutoTuneStatus(message);
+            pSweep->SetValue(candidates[i]);
+            if (!measureStream(dwell, packetSize, &throughput, &errors)) break;
+            asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER,
+                "%s::%s %s=%lld throughput=%.1f MB/s errors=%d\n",
+                driverName, functionName, sweepDelay ? "GevSCPD" : "DeviceLinkThroughputLimit",
+                (long long)candidates[i], throughput / 1e6, errors);
+            if ((best < 0) || (errors < bestErrors)) {
+                best = (int)i;
+                bestErrors = errors;
+                bestThroughput = throughput;
+            }
+            // Every later candidate is slower
+            if (errors == 0) break;
+        }
+    }
+    catch (Spinnaker::Exception &e) {
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+            "%s::%s exception %s\n",
+            driverName, functionName, e.what());
+    }
+
+    // The user set can only be saved while the camera is not streaming
+    lock();
+    getIntegerParam(ADAcquire, &acquire);
+    if (acquire) stopCapture();
+    callParamCallbacks();
+    unlock();
+    if (exiting_) return asynError;
+    if (best < 0) {
+        setAutoTuneStatus("Aborted");
+        return asynError;
+    }
+    try {
+        pSweep->SetValue(candidates[best]);
+        lock();
+        setIntegerParam(SPAutoTunePacketSize, packetSize);
+        setIntegerParam(SPAutoTunePacketDelay, IsReadable(pDelay) ? (int)pDelay->GetValue(false, true) : 0);
+        setDoubleParam(SPAutoTuneThroughput, bestThroughput / 1e6);
+        setIntegerParam(SPAutoTuneErrors, bestErrors);
+        callParamCallbacks();
+        unlock();
+        if (save) {
+            CEnumerationPtr pSelector = pNodeMap_->GetNode("UserSetSelector");
+            CCommandPtr pSave = pNodeMap_->GetNode("UserSetSave");
+            CEnumerationPtr pDefault = findNode("UserSetDefault", "UserSetDefaultSelector");
+            if (!IsWritable(pSelector) || !IsWritable(pSave)) {
+                setAutoTuneStatus("Done, camera has no user sets");
+                return asynSuccess;
+            }
+            CEnumEntryPtr pEntry = pSelector->GetEntryByName(userSetName);
+            if (!IsReadable(pEntry)) {
+                epicsSnprintf(message, sizeof(message), "Done, camera has no %s", userSetName);
+                setAutoTuneStatus(message);
+                return asynSuccess;
+            }
+            pSelector->SetIntValue(pEntry->GetValue());
+            pSave->Execute();
+            if (setDefault && IsWritable(pDefault)) {
+                CEnumEntryPtr pDefaultEntry = pDefault->GetEntryByName(userSetName);
+                if (IsReadable(pDefaultEntry)) pDefault->SetIntValue(pDefaultEntry->GetValue());
+            }
+        }
+    }
+    catch (Spinnaker::Exception &e) {
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+            "%s::%s exception %s\n",
+            driverName, functionName, e.what());
+        setAutoTuneStatus("Error saving settings");
+        return asynError;
+    }
+    if (bestErrors) {
+        epicsSnprintf(message, sizeof(message), "Done, errors at every setting");
+    } else if (save) {
+        epicsSnprintf(message, sizeof(message), "Done, saved to %s", userSetName);
+    } else {
+        epicsSnprintf(message, sizeof(message), "Done");
+    }
+    setAutoTuneStatus(message);
+    return asynSuccess;
+}
+
+/** Task to grab images off the camera and send them up to areaDetector
+ *
+ */
+
+void ADSpinnaker::imageGrabTask()
+{
+    asynStatus status = asynSuccess;
+    int numImages, numImagesCounter;
+    int imageMode;
+    epicsTimeStamp startTime;
+    ImagePtr pImage;
+    epicsTimeStamp epicsTS;
+    int acquire;
+    static const char *functionName = "imageGrabTask";
+
+    lock();
+
+    while (1) {
+        // Is acquisition active? 
+        getIntegerParam(ADAcquire, &acquire);
+        // If we are not acquiring then wait for a semaphore that is given when acquisition is started 
+        if (!acquire) {
+            // A burst that was stopped early still publishes the images it captured
+            if ((burstState_ == SPBurstFilling) && !burstImages_.empty()) drainBurst();
+            setIntegerParam(ADStatus, ADStatusIdle);
+            callParamCallbacks();
+
+            // Wait for a signal that tells this thread that the transmission
+            // has started and we can start asking for image buffers...
+            asynPrint(pasynUserSelf, ASYN_TRACE_FLOW,
+                "%s::%s waiting for acquire to start\n", 
+                driverName, functionName);
+            // Release the lock while we wait for an event that says acquire has started, then lock again
+            unlock();
+            epicsEventWait(startEventId_);
+            lock();
+            asynPrint(pasynUserSelf, ASYN_TRACE_FLOW,
+                "%s::%s started!\n", 
+                driverName, functionName);
+            setIntegerParam(ADNumImagesCounter, 0);
+            setIntegerParam(ADAcquire, 1);
+        }
+
+        // Get the current time 
+        epicsTimeGetCurrent(&startTime);
+        // We are now waiting for an image
+        setIntegerParam(ADStatus, ADStatusWaiting);
+        // Call the callbacks to update any changes
+        callParamCallbacks();
+
+        status = grabImage(pImage, epicsTS);
+        if (status == asynTimeout) {
+            // A camera that counts frames stops without sending the frames that the transport layer lost
+            getIntegerParam(ADAcquire, &acquire);
+            if (acquire && hardwareFrameCountDone(true)) {
+                setIntegerParam(ADStatus, ADStatusIdle);
+                stopCapture();
+            }
+            continue;
+        }
+        if (status == asynSuccess) {
+            if (burstState_ == SPBurstFilling) {
+                status = burstImage(pImage, epicsTS);
+            } else if (preTriggerState_ != SPPreTriggerOff) {
+                status = preTriggerImage(pImage, epicsTS);
+            } else if (checkBackpressure()) {
+                try {
+                    pImage->Release();
+                }
+                catch (Spinnaker::Exception &e) {
+                    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+                        "%s::%s pImage->Release() exception %s\n",
+                        driverName, functionName, e.what());
+                }
+                // Nothing to publish, but a dropped image still counts towards a hardware frame count
+                status = asynError;
+            } else {
+                status = processImage(pImage, epicsTS);
+                if (status == asynSuccess) publishImage();
+            }
+        }
+        if (status == asynError) {
+            // remember to release the NDArray back to the pool now
+            // that we are not using it (we didn't get an image...)
+            if (pRaw_) pRaw_->release();
+            pRaw_ = NULL;
+            // With a hardware frame count the camera does not send a replacement for a bad frame
+            getIntegerParam(ADAcquire, &acquire);
+            if (acquire && hardwareFrameCountDone(false)) {
+                setIntegerParam(ADStatus, ADStatusIdle);
+                stopCapture();
+            }
+            continue;
+        }
+
+        getIntegerParam(ADNumImages, &numImages);
+        getIntegerParam(ADNumImagesCounter, &numImagesCounter);
+        getIntegerParam(ADImageMode, &imageMode);
+        getIntegerParam(ADAcquire, &acquire);
+        // See if acquisition is done if we are in single or multiple mode
+        // The check for acquire=0 means this thread will call stopCapture and hence pCamera_->EndAcquisition().
+        // Failure to do this result in hang in call to pCamera_->EndAcquisition() in other thread
+        // While the pre-trigger ring is filling no images have been published yet.
+        // A burst is published after the camera has stopped.
         if ((acquire == 0) || 
-            (imageMode == ADImageSingle) || 
+            (burstState_ == SPBurstDraining) ||
+            hardwareFrameCountDone(false) ||
+            ((imageMode == ADImageSingle) && (numImagesCounter > 0)) || 
             ((imageMode == ADImageMultiple) && (numImagesCounter >= numImages))) {
             setIntegerParam(ADStatus, ADStatusIdle);
             status = stopCapture();
+            if (burstState_ == SPBurstDraining) drainBurst();
         }
         //epicsTimeStamp tstart, tend;
         //epicsTimeGetCurrent(&tstart);
@@ -476,270 +1913,1378 @@ void ADSpinnaker::imageGrabTask()
     }
 }
 
-asynStatus ADSpinnaker::grabImage()
+/** Publishes pRaw_ to the plugins and advances the image counters.  pRaw_ is NULL in centroid only mode. */
+void ADSpinnaker::publishImage()
+{
+    int imageCounter;
+    int numImagesCounter;
+    int arrayCallbacks;
+
+    getIntegerParam(NDArrayCounter, &imageCounter);
+    getIntegerParam(ADNumImagesCounter, &numImagesCounter);
+    getIntegerParam(NDArrayCallbacks, &arrayCallbacks);
+    imageCounter++;
+    numImagesCounter++;
+    setIntegerParam(NDArrayCounter, imageCounter);
+    setIntegerParam(ADNumImagesCounter, numImagesCounter);
+
+    if (latencyValid_) {
+        epicsTimeStamp now;
+        double latency;
+        epicsTimeGetCurrent(&now);
+        latency = epicsTimeDiffInSeconds(&now, &latencyStart_) * 1000.;
+        latencyCount_++;
+        latencySum_ += latency;
+        if (latency > latencyMax_) latencyMax_ = latency;
+        setDoubleParam(SPLatency, latency);
+        setDoubleParam(SPLatencyMean, latencySum_ / latencyCount_);
+        setDoubleParam(SPLatencyMax, latencyMax_);
+        latencyValid_ = false;
+    }
+    // In centroid only mode there is no NDArray, the image is only counted
+    if (!pRaw_) return;
+    if (pPreview_) {
+        pPreview_->submit(pRaw_);
+    }
+    if (arrayCallbacks) {
+        // Call the NDArray callback
+        doCallbacksGenericPointer(pRaw_, NDArrayData, 0);
+    }
+    // Release the NDArray buffer now that we are done with it.
+    // After the callback just above we don't need it anymore
+    if (this->pArrays[0]) {
+        this->pArrays[0]->release();
+    }
+    this->pArrays[0] = pRaw_;
+    pRaw_ = NULL;
+}
+
+/** Receives the next image from the transport layer.
+  * The image is still held in its Spinnaker buffer; epicsTS is the time it was received.
+  */
+asynStatus ADSpinnaker::grabImage(ImagePtr &pImage, epicsTimeStamp &epicsTS)
+{
+    ImageStatus imageStatus;
+    int acquiring;
+    ImagePtr *imagePtrAddr=0;
+    static const char *functionName = "grabImage";
+
+    try {
+        int recvSize;
+        unlock();
+        if (hwFrameCountActive_) {
+            recvSize = pCallbackMsgQ_->receive(&imagePtrAddr, sizeof(imagePtrAddr), HW_FRAME_COUNT_POLL_TIME);
+        } else {
+            recvSize = pCallbackMsgQ_->receive(&imagePtrAddr, sizeof(imagePtrAddr));
+        }
+        lock();
+        if ((recvSize < 0) && hwFrameCountActive_) {
+            return asynTimeout;
+        }
+        if (recvSize != sizeof(imagePtrAddr)) {
+            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+                    "%s::%s error receiving from message queue\n",
+                    driverName, functionName);
+            return asynError;
+        }
+        // We are sent a null pointer to flag acquisition complete so return
+        if (imagePtrAddr == NULL)  {
+            return asynError;
+        }
+        // In NewestOnly mode the images that are already queued behind this one replace it,
+        // so the plugins always get the newest image
+        if (bufferHandlingMode_ == SPBufferNewestOnly) {
+            ImagePtr *newerAddr;
+            while (pCallbackMsgQ_->tryReceive(&newerAddr, sizeof(newerAddr)) == sizeof(newerAddr)) {
+                (*imagePtrAddr)->Release();
+                delete imagePtrAddr;
+                imagePtrAddr = newerAddr;
+                if (imagePtrAddr == NULL) return asynError;
+                streamFrameCount_++;
+                queueSkipped_++;
+            }
+            setIntegerParam(SPQueueSkipped, queueSkipped_);
+        }
+        pImage = *imagePtrAddr;
+        // Delete the ImagePtr that was passed to us
+        delete imagePtrAddr;
+        streamFrameCount_++;
+        hwAcquisitionStopped_ = false;
+        imageStatus = pImage->GetImageStatus();
+        if (imageStatus != SPINNAKER_IMAGE_STATUS_NO_ERROR) {
+            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s::%s error GetImageStatus  %d, description:  %s\n",
+                driverName, functionName, imageStatus, Image::GetImageStatusDescription(imageStatus));
+            pImage->Release();
+            return asynError;
+        } 
+        if (pImage->IsIncomplete()) {
+            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s::%s error image is incomplete\n",
+                driverName, functionName);
+            pImage->Release();
+            return asynError;
+        }
+        // There is a problem on Windows in SDK 4.0.
+        // If acquisition has stopped we can receive an image,
+        // but when we try to read the data we get an access violation
+        // Prevent that by ignoring this image.
+        getIntegerParam(ADAcquire, &acquiring);
+        if (!acquiring) {
+            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s::%s received image after acquisition stopped, ignoring\n",
+                driverName, functionName);
+            return asynError;
+        }
+        updateTimeStamp(&epicsTS);
+        return asynSuccess;
+    }
+    catch (Spinnaker::Exception &e) {
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+            "%s::%s exception %s\n",
+            driverName, functionName, e.what());
+        return asynError;
+    }
+}
+
+/** Converts an image received by grabImage() into pRaw_ and releases its Spinnaker buffer */
+asynStatus ADSpinnaker::processImage(ImagePtr pImage, epicsTimeStamp &epicsTS)
+{
+    asynStatus status;
+    SPImageInfo_t info;
+    bool imageConverted;
+    static const char *functionName = "processImage";
+
+    try {
+        // Print the first 16 bytes of the buffer in hex
+        //pData = pImage->GetData();
+        //for (int i=0; i<16; i++) printf("%x ", ((epicsUInt8 *)pData)[i]); printf("\n");
+     
+        // Chunk data is only in the image from the camera, not in a converted image
+        readChunks(pImage);
+        imageConverted = convertImage(pImage);
+        info.width = pImage->GetWidth();
+        info.height = pImage->GetHeight();
+        info.pixelFormat = pImage->GetPixelFormat();
+        info.bufferSize = pImage->GetBufferSize();
+        info.frameID = pImage->GetFrameID();
+        info.timeStamp = pImage->GetTimeStamp();
+        info.epicsTS = epicsTS;
+        if (!clockCorrelator_.cameraToHost((epicsInt64)info.timeStamp, &latencyStart_)) latencyStart_ = epicsTS;
+        latencyValid_ = true;
+        status = copyImage(info, pImage->GetData());
+        if ((status == asynSuccess) && pRaw_) addChunkAttributes(pRaw_->pAttributeList);
+        try {
+            // We get a "No Stream Available" exception if pImage points to an image resulting from ConvertPixeFormat
+            // Not sure why?
+            if (!imageConverted) {
+                pImage->Release();
+            } 
+        }
+        catch (Spinnaker::Exception &e) {
+            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+                "%s::%s pImage->Release() exception %s\n",
+                driverName, functionName, e.what());
+        }
+        return status;
+    }
+    catch (Spinnaker::Exception &e) {
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+            "%s::%s exception %s\n",
+            driverName, functionName, e.what());
+        return asynError;
+    }
+}
+
+/** Converts the pixel format of pImage if SPConvertPixelFormat requests it.
+  * Returns true if pImage now points to the converted image.
+  */
+bool ADSpinnaker::convertImage(ImagePtr &pImage)
+{
+    int convertPixelFormat;
+    bool imageConverted = false;
+    static const char *functionName = "convertImage";
+
+    // Convert the pixel format if requested
+    getIntegerParam(SPConvertPixelFormat, &convertPixelFormat);
+    if (convertPixelFormat != SPPixelConvertNone) {
+        PixelFormatEnums convertedFormat;
+        switch (convertPixelFormat) {
+            case SPPixelConvertMono8:
+                convertedFormat = PixelFormat_Mono8;
+                break;
+            case SPPixelConvertMono16:
+                convertedFormat = PixelFormat_Mono16;
+                break;
+            case SPPixelConvertRaw16:
+                convertedFormat = PixelFormat_Raw16;
+                break;
+            case SPPixelConvertRGB8:
+                convertedFormat = PixelFormat_RGB8;
+                break;
+            case SPPixelConvertRGB16:
+                convertedFormat = PixelFormat_RGB16;
+                break;
+            default:
+                asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+                    "%s::%s Error: Unknown pixel conversion format %d\n",
+                    driverName, functionName, convertPixelFormat);
+                convertedFormat = PixelFormat_Mono8;
+                break;
+        }
+
+        ImageProcessor processor; 
+        unlock();
+        try {
+            //epicsTimeStamp tstart, tend;
+            //epicsTimeGetCurrent(&tstart);
+            pImage  = processor.Convert(pImage, convertedFormat);
+            //epicsTimeGetCurrent(&tend);
+            //asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, "%s::%s time for pImage->convert=%f\n", 
+            //    driverName, functionName, epicsTimeDiffInSeconds(&tend, &tstart));
+            imageConverted = true;
+        }
+        catch (Spinnaker::Exception &e) {
+             asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+                 "%s::%s pixel format conversion exception %s\n",
+             driverName, functionName, e.what());
+        }
+        lock();
+    }
+    return imageConverted;
+}
+
+/** Collects, loads or saves a dark or flat reference */
+asynStatus ADSpinnaker::referenceCommand(int function)
+{
+    int reference = ((function == SPCollectDark) || (function == SPLoadDark) || (function == SPSaveDark)) ?
+                    SPReferenceDark : SPReferenceFlat;
+    const char *name = (reference == SPReferenceDark) ? "dark" : "flat";
+    std::string fileName;
+    std::string error;
+    char message[64];
+    int numFrames;
+    static const char *functionName = "referenceCommand";
+
+    if ((function == SPCollectDark) || (function == SPCollectFlat)) {
+        // The next frames copied by the image thread are averaged into the reference
+        getIntegerParam(SPReferenceFrames, &numFrames);
+        if (numFrames < 1) numFrames = 1;
+        setIntegerParam((function == SPCollectDark) ? SPCollectFlat : SPCollectDark, 0);
+        frameProcessor_.startCollect(reference, numFrames);
+        epicsSnprintf(message, sizeof(message), "Collecting %s", name);
+        setStringParam(SPCorrectionStatus, message);
+        return asynSuccess;
+    }
+    setIntegerParam(function, 0);
+    getStringParam((reference == SPReferenceDark) ? SPDarkFile : SPFlatFile, fileName);
+    if ((function == SPLoadDark) || (function == SPLoadFlat)) {
+        if (!frameProcessor_.loadReference(reference, fileName.c_str(), error)) {
+            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s::%s error loading %s: %s\n",
+                driverName, functionName, name, error.c_str());
+            setStringParam(SPCorrectionStatus, error);
+            return asynError;
+        }
+        epicsSnprintf(message, sizeof(message), "Loaded %s", name);
+    } else {
+        if (!frameProcessor_.saveReference(reference, fileName.c_str(), error)) {
+            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s::%s error saving %s: %s\n",
+                driverName, functionName, name, error.c_str());
+            setStringParam(SPCorrectionStatus, error);
+            return asynError;
+        }
+        epicsSnprintf(message, sizeof(message), "Saved %s", name);
+    }
+    setStringParam(SPCorrectionStatus, message);
+    return asynSuccess;
+}
+
+/** Updates the reference parameters, and ends CollectDark or CollectFlat when the collection is complete */
+void ADSpinnaker::updateReferenceStatus()
+{
+    int remaining = frameProcessor_.getCollectRemaining();
+    int collectDark, collectFlat;
+
+    getIntegerParam(SPCollectDark, &collectDark);
+    getIntegerParam(SPCollectFlat, &collectFlat);
+    if ((remaining == 0) && (collectDark || collectFlat)) {
+        setIntegerParam(SPCollectDark, 0);
+        setIntegerParam(SPCollectFlat, 0);
+        setStringParam(SPCorrectionStatus, collectDark ? "Collected dark" : "Collected flat");
+    }
+    setIntegerParam(SPCollectRemaining, remaining);
+    setIntegerParam(SPDarkValid, frameProcessor_.hasReference(SPReferenceDark));
+    setIntegerParam(SPFlatValid, frameProcessor_.hasReference(SPReferenceFlat));
+}
+
+/** Finds the defects in the dark and flat references, or loads or saves the defect list */
+asynStatus ADSpinnaker::defectCommand(int function)
+{
+    std::string fileName;
+    std::string error;
+    char message[64];
+    double hotSigma, deadPercent;
+    static const char *functionName = "defectCommand";
+
+    if (function == SPDetectDefects) {
+        getDoubleParam(SPHotThreshold, &hotSigma);
+        getDoubleParam(SPDeadThreshold, &deadPercent);
+        int count = frameProcessor_.detectDefects(hotSigma, deadPercent);
+        if (count < 0) {
+            setStringParam(SPCorrectionStatus, "No dark to find defects");
+            return asynError;
+        }
+        epicsSnprintf(message, sizeof(message), "Found %d defects", count);
+    } else {
+        getStringParam(SPDefectFile, fileName);
+        bool ok = (function == SPLoadDefects) ? frameProcessor_.loadDefects(fileName.c_str(), error)
+                                                : frameProcessor_.saveDefects(fileName.c_str(), error);
+        if (!ok) {
+            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s::%s error %s defects: %s\n",
+                driverName, functionName, (function == SPLoadDefects) ? "loading" : "saving", error.c_str());
+            setStringParam(SPCorrectionStatus, error);
+            return asynError;
+        }
+        epicsSnprintf(message, sizeof(message), (function == SPLoadDefects) ? "Loaded defects" : "Saved defects");
+    }
+    setIntegerParam(SPDefectCount, frameProcessor_.getDefectCount());
+    setStringParam(SPCorrectionStatus, message);
+    return asynSuccess;
+}
+
+/** Reads the transform, the dark and flat correction, the defect replacement, the accumulation, the
+  * statistics and the centroid that are applied while an image is copied into its NDArray */
+void ADSpinnaker::configureFrameProcessor()
+{
+    SPTransform_t transform;
+    int value;
+    int darkEnable, flatEnable, correctionType;
+    int numFrames, accumulateType, accumulateMode;
+    int histSize;
+    double histMin, histMax, saturation;
+    int centroidOnly, roiX, roiY, roiWidth, roiHeight;
+    double threshold;
+
+    getIntegerParam(SPCropX, &value);
+    transform.cropX = std::max(value, 0);
+    getIntegerParam(SPCropY, &value);
+    transform.cropY = std::max(value, 0);
+    getIntegerParam(SPCropSizeX, &value);
+    transform.cropWidth = std::max(value, 0);
+    getIntegerParam(SPCropSizeY, &value);
+    transform.cropHeight = std::max(value, 0);
+    getIntegerParam(SPFlipX, &value);
+    transform.flipX = (value != 0);
+    getIntegerParam(SPFlipY, &value);
+    transform.flipY = (value != 0);
+    getIntegerParam(SPRotation, &transform.rotation);
+    getIntegerParam(SPBitShift, &value);
+    // The widest pixel is 16 bits
+    transform.shift = std::min(std::max(value, -15), 15);
+    frameProcessor_.setTransform(transform);
+    getIntegerParam(SPDarkEnable, &darkEnable);
+    getIntegerParam(SPFlatEnable, &flatEnable);
+    getIntegerParam(SPCorrectionType, &correctionType);
+    frameProcessor_.setCorrection(darkEnable != 0, flatEnable != 0, correctionType);
+    getIntegerParam(SPDefectEnable, &value);
+    frameProcessor_.setDefectCorrection(value != 0);
+    getIntegerParam(SPAccumulateEnable, &value);
+    getIntegerParam(SPAccumulateFrames, &numFrames);
+    getIntegerParam(SPAccumulateType, &accumulateType);
+    getIntegerParam(SPAccumulateMode, &accumulateMode);
+    frameProcessor_.setAccumulation(value ? std::max(numFrames, 1) : 0, accumulateType,
+                                    accumulateMode == SPAccumulateAverage);
+    getIntegerParam(SPStatsEnable, &value);
+    getIntegerParam(SPHistSize, &histSize);
+    getDoubleParam(SPHistMin, &histMin);
+    getDoubleParam(SPHistMax, &histMax);
+    getDoubleParam(SPSaturationLevel, &saturation);
+    frameProcessor_.setStatistics(value != 0, histSize, histMin, histMax, saturation);
+    getIntegerParam(SPCentroidEnable, &value);
+    getIntegerParam(SPCentroidOnly, &centroidOnly);
+    getDoubleParam(SPCentroidThreshold, &threshold);
+    getIntegerParam(SPCentroidMinX, &roiX);
+    getIntegerParam(SPCentroidMinY, &roiY);
+    getIntegerParam(SPCentroidSizeX, &roiWidth);
+    getIntegerParam(SPCentroidSizeY, &roiHeight);
+    frameProcessor_.setCentroid(value != 0, threshold, std::max(roiX, 0), std::max(roiY, 0),
+                                std::max(roiWidth, 0), std::max(roiHeight, 0), centroidOnly != 0);
+}
+
+/** Sets the centroid parameters from the last image and does the callbacks immediately, so that a feedback
+  * loop gets them with the lowest latency */
+void ADSpinnaker::updateCentroid()
+{
+    SPCentroid_t const & centroid = frameProcessor_.getCentroid();
+
+    setDoubleParam(SPCentroidTotal, centroid.total);
+    setDoubleParam(SPCentroidX, centroid.x);
+    setDoubleParam(SPCentroidY, centroid.y);
+    setDoubleParam(SPSigmaX, centroid.sigmaX);
+    setDoubleParam(SPSigmaY, centroid.sigmaY);
+    setDoubleParam(SPSigmaXY, centroid.sigmaXY);
+    setIntegerParam(SPPeakX, (int)centroid.peakX);
+    setIntegerParam(SPPeakY, (int)centroid.peakY);
+    setDoubleParam(SPPeakValue, centroid.peakValue);
+    callParamCallbacks();
+}
+
+/** Sets the statistics parameters and the histogram from the last image, at most SPStatsRate times per second.
+  * A rate of 0 updates them for every image. */
+void ADSpinnaker::updateStatistics()
+{
+    SPStatistics_t const & stats = frameProcessor_.getStatistics();
+    epicsFloat64 *pHistogram = const_cast<epicsFloat64 *>(&stats.histogram[0]);
+    epicsTimeStamp now;
+    double rate;
+
+    getDoubleParam(SPStatsRate, &rate);
+    epicsTimeGetCurrent(&now);
+    if ((rate > 0.) && (epicsTimeDiffInSeconds(&now, &statsUpdateTime_) < 1. / rate)) return;
+    statsUpdateTime_ = now;
+    setDoubleParam(SPStatsMin, stats.min);
+    setDoubleParam(SPStatsMax, stats.max);
+    setDoubleParam(SPStatsMean, stats.mean);
+    setDoubleParam(SPStatsSigma, stats.sigma);
+    setIntegerParam(SPStatsSaturated, (int)stats.saturated);
+    doCallbacksFloat64Array(pHistogram, stats.histogram.size(), SPHistogram, 0);
+}
+
+/** Copies the data of an image into a new pRaw_ and sets its metadata and attributes */
+asynStatus ADSpinnaker::copyImage(SPImageInfo_t &info, void *pData)
+{
+    size_t nRows, nCols;
+    size_t outCols, outRows;
+    NDDataType_t outType;
+    int outPixelSize;
+    epicsTimeStamp copyStart, copyEnd;
+    NDDataType_t dataType;
+    NDColorMode_t colorMode;
+    int timeStampMode;
+    int uniqueIdMode;
+    int clockCorrelation;
+    int uniqueId;
+    epicsTimeStamp epicsTS;
+    double timeStamp;
+    bool accumulateFirst;
+    int numColors;
+    size_t dims[3];
+    PixelFormatEnums pixelFormat;
+    int pixelSize;
+    size_t dataSize, dataSizePG;
+    int nDims;
+    static const char *functionName = "copyImage";
+
+    nCols = info.width;
+    nRows = info.height;
+    pixelFormat = info.pixelFormat;
+    switch (pixelFormat) {
+        case PixelFormat_Mono8:
+        case PixelFormat_Raw8:
+            dataType = NDUInt8;
+            colorMode = NDColorModeMono;
+            numColors = 1;
+            pixelSize = 1;
+            break;
+
+        case PixelFormat_BayerGB8:
+            dataType = NDUInt8;
+            colorMode = NDColorModeBayer;
+            numColors = 1;
+            pixelSize = 1;
+            break;
+        case PixelFormat_RGB8:
+            dataType = NDUInt8;
+            colorMode = NDColorModeRGB1;
+            numColors = 3;
+            pixelSize = 1;
+            break;
+
+        case PixelFormat_Mono16:
+        case PixelFormat_Raw16:
+            dataType = NDUInt16;
+            colorMode = NDColorModeMono;
+            numColors = 1;
+            pixelSize = 2;
+            break;
+
+        case PixelFormat_RGB16:
+            dataType = NDUInt16;
+            colorMode = NDColorModeRGB1;
+            numColors = 3;
+            pixelSize = 2;
+            break;
+
+        default:
+            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s:%s: unsupported pixel format=0x%x\n",
+                driverName, functionName, pixelFormat);
+            return asynError;
+    }
+
+    dataSize = nCols * nRows * numColors * pixelSize;
+    dataSizePG = info.bufferSize;
+    // Note, we should be testing for equality here.  However, there appears to be a bug in the
+    // SDK when images are converted.  When converting from raw8 to mono8, for example, the
+    // size returned by GetDataSize is the size of an RGB8 image, not a mono8 image.
+    if (dataSize > dataSizePG) {
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+            "%s:%s: data size mismatch: calculated=%lu, reported=%lu\n",
+            driverName, functionName, (long)dataSize, (long)dataSizePG);
+        //return asynError;
+    }
+    configureFrameProcessor();
+    frameProcessor_.prepare(dataType, numColors, nCols, nRows, &outCols, &outRows, &outType);
+    outPixelSize = (outType == NDFloat32) ? 4 : (outType == NDUInt16) ? 2 : 1;
+    if (numColors == 1) {
+        nDims = 2;
+        dims[0] = outCols;
+        dims[1] = outRows;
+    } else {
+        nDims = 3;
+        dims[0] = 3;
+        dims[1] = outCols;
+        dims[2] = outRows;
+    }
+    setIntegerParam(NDArraySizeX, (int)outCols);
+    setIntegerParam(NDArraySizeY, (int)outRows);
+    setIntegerParam(NDArraySize, (int)(outCols * outRows * numColors * outPixelSize));
+    setIntegerParam(NDDataType, outType);
+    if (nDims == 3) {
+        colorMode = NDColorModeRGB1;
+    } 
+    setIntegerParam(NDColorMode, colorMode);
+
+    // While frames are accumulated an NDArray is only allocated for the frame that completes the sum
+    if (frameProcessor_.hasOutput()) {
+        pRaw_ = pNDArrayPool->alloc(nDims, dims, outType, 0, NULL);
+        if (!pRaw_) {
+            int backpressureMode;
+            getIntegerParam(SPBackpressureMode, &backpressureMode);
+            if (backpressureMode != SPBackpressureAbort) {
+                // Drop this image and keep acquiring
+                backpressureDropped_++;
+                setIntegerParam(SPBackpressureDropped, backpressureDropped_);
+                frameProcessor_.resetAccumulation();
+                return asynError;
+            }
+            // If we didn't get a valid buffer from the NDArrayPool we must abort
+            // the acquisition as we have nowhere to dump the data...
+            setIntegerParam(ADStatus, ADStatusAborting);
+            callParamCallbacks();
+            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+                "%s::%s [%s] ERROR: Serious problem: not enough buffers left! Aborting acquisition!\n",
+                driverName, functionName, portName);
+            setIntegerParam(ADAcquire, 0);
+            return(asynError);
+        }
+    }
+    // Print the first 8 pixels of the buffer in decimal
+    //for (int i=0; i<8; i++) printf("%u ", ((epicsUInt16 *)pData)[i]); printf("\n");
+    if (pData) {
+        // Crop, flip, rotate, shift, correct, accumulate and compute statistics and the centroid
+        // in the same pass as the copy
+        accumulateFirst = frameProcessor_.isAccumulating() && (frameProcessor_.getAccumulateCount() == 0);
+        epicsTimeGetCurrent(&copyStart);
+        frameProcessor_.process(pData, pRaw_ ? pRaw_->pData : NULL);
+        epicsTimeGetCurrent(&copyEnd);
+        setDoubleParam(SPCopyTime, epicsTimeDiffInSeconds(&copyEnd, &copyStart) * 1000.);
+        setIntegerParam(SPCorrectionActive, frameProcessor_.isCorrecting());
+        setIntegerParam(SPDefectActive, frameProcessor_.isFixingDefects());
+        setIntegerParam(SPAccumulateCount, frameProcessor_.getAccumulateCount());
+        if (frameProcessor_.isComputingStatistics()) updateStatistics();
+        updateReferenceStatus();
+        if (frameProcessor_.isComputingCentroid()) updateCentroid();
+    } else {
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+            "%s::%s [%s] ERROR: pData is NULL!\n",
+            driverName, functionName, portName);
+        return asynError;
+    }
+
+    // Get the frame number
+    getIntegerParam(SPUniqueIdMode, &uniqueIdMode);
+    if (uniqueIdMode == UniqueIdCamera) {
+        uniqueId = (int)info.frameID;
+    } else {
+        uniqueId = uniqueId_;
+    }
+    uniqueId_++;
+    epicsTS = info.epicsTS;
+    // Use the time the camera took the image, rather than the time the driver received it
+    getIntegerParam(SPClockCorrelation, &clockCorrelation);
+    if (clockCorrelation && (info.timeStamp != 0)) {
+        clockCorrelator_.cameraToHost(info.timeStamp, &epicsTS);
+    }
+    getIntegerParam(SPTimeStampMode, &timeStampMode);
+    if (timeStampMode == TimeStampCamera) {
+        long long cameraTimeStamp = info.timeStamp;
+        if (cameraTimeStamp == 0) {
+            asynPrint(pasynUserSelf, ASYN_TRACE_WARNING,
+                "%s::%s camera timestamp is 0\n",
+                driverName, functionName);
+        }
+        timeStamp = cameraTimeStamp / 1e9;
+    } else {
+        timeStamp = epicsTS.secPastEpoch + epicsTS.nsec/1e9;
+    }
+
+    if (frameProcessor_.isAccumulating()) {
+        char frameID[24];
+        if (accumulateFirst) {
+            accumulateFrameIDs_.clear();
+            accumulateFrames_ = 0;
+            accumulateUniqueId_ = uniqueId;
+            accumulateEpicsTS_ = epicsTS;
+            accumulateFirstTime_ = timeStamp;
+        }
+        epicsSnprintf(frameID, sizeof(frameID), accumulateFirst ? "%llu" : " %llu",
+                      (unsigned long long)info.frameID);
+        accumulateFrameIDs_ += frameID;
+        accumulateFrames_++;
+        accumulateLastTime_ = timeStamp;
+        // The image is in the sum, there is nothing to publish yet
+        if (!pRaw_) return asynError;
+        uniqueId = accumulateUniqueId_;
+        epicsTS = accumulateEpicsTS_;
+        timeStamp = accumulateFirstTime_;
+    }
+    // In centroid only mode publishImage() counts the image, but there is no NDArray
+    if (!pRaw_) return asynSuccess;
+
+    // Set the frame number and timestamps in the buffer
+    pRaw_->uniqueId = uniqueId;
+    pRaw_->epicsTS = epicsTS;
+    pRaw_->timeStamp = timeStamp;
+    // Get any attributes that have been defined for this driver        
+    getAttributes(pRaw_->pAttributeList);
+    
+    // Change the status to be readout...
+    setIntegerParam(ADStatus, ADStatusReadout);
+    callParamCallbacks();
+
+    pRaw_->pAttributeList->add("ColorMode", "Color mode", NDAttrInt32, &colorMode);
+    if (frameProcessor_.isAccumulating()) {
+        pRaw_->pAttributeList->add("AccumulateFrames", "Number of frames accumulated", NDAttrInt32,
+                                   &accumulateFrames_);
+        pRaw_->pAttributeList->add("AccumulateFrameIDs", "Frame IDs of the frames accumulated", NDAttrString,
+                                   (void *)accumulateFrameIDs_.c_str());
+        pRaw_->pAttributeList->add("AccumulateFirstTime", "Timestamp of the first frame accumulated",
+                                   NDAttrFloat64, &accumulateFirstTime_);
+        pRaw_->pAttributeList->add("AccumulateLastTime", "Timestamp of the last frame accumulated",
+                                   NDAttrFloat64, &accumulateLastTime_);
+    }
+    if (frameProcessor_.isComputingStatistics()) {
+        // An accumulated NDArray has the statistics of the sum, not those of the last image in it
+        SPStatistics_t const & stats = frameProcessor_.isAccumulating() ?
+            frameProcessor_.getAccumulateStatistics() : frameProcessor_.getStatistics();
+        double statsMin = stats.min, statsMax = stats.max, statsMean = stats.mean, statsSigma = stats.sigma;
+        epicsInt32 saturated = (epicsInt32)stats.saturated;
+        pRaw_->pAttributeList->add("StatsMin", "Minimum value", NDAttrFloat64, &statsMin);
+        pRaw_->pAttributeList->add("StatsMax", "Maximum value", NDAttrFloat64, &statsMax);
+        pRaw_->pAttributeList->add("StatsMean", "Mean value", NDAttrFloat64, &statsMean);
+        pRaw_->pAttributeList->add("StatsSigma", "Standard deviation of the values", NDAttrFloat64, &statsSigma);
+        pRaw_->pAttributeList->add("StatsSaturated", "Number of saturated values", NDAttrInt32, &saturated);
+    }
+    if (frameProcessor_.isComputingCentroid()) {
+        SPCentroid_t const & centroid = frameProcessor_.getCentroid();
+        double values[] = {centroid.total, centroid.x, centroid.y, centroid.sigmaX, centroid.sigmaY,
+                           centroid.sigmaXY, centroid.peakValue};
+        epicsInt32 peakX = (epicsInt32)centroid.peakX, peakY = (epicsInt32)centroid.peakY;
+        pRaw_->pAttributeList->add("CentroidTotal", "Sum of the values minus the threshold", NDAttrFloat64,
+                                   &values[0]);
+        pRaw_->pAttributeList->add("CentroidX", "Centroid X", NDAttrFloat64, &values[1]);
+        pRaw_->pAttributeList->add("CentroidY", "Centroid Y", NDAttrFloat64, &values[2]);
+        pRaw_->pAttributeList->add("SigmaX", "Sigma X", NDAttrFloat64, &values[3]);
+        pRaw_->pAttributeList->add("SigmaY", "Sigma Y", NDAttrFloat64, &values[4]);
+        pRaw_->pAttributeList->add("SigmaXY", "Correlation of X and Y", NDAttrFloat64, &values[5]);
+        pRaw_->pAttributeList->add("PeakX", "X of the peak", NDAttrInt32, &peakX);
+        pRaw_->pAttributeList->add("PeakY", "Y of the peak", NDAttrInt32, &peakY);
+        pRaw_->pAttributeList->add("PeakValue", "Value of the peak", NDAttrFloat64, &values[6]);
+    }
+    return asynSuccess;
+}
+
+/** Handles an image received while the pre-trigger ring is enabled.
+  * While armed the raw image is only held in the ring, and the oldest image is released back to the
+  * transport layer when the ring is full, so frames that are discarded are never converted or copied.
+  * The first image received after SPPreTriggerTrigger flushes the ring to the plugins and is the first
+  * of SPPostTriggerCount post-trigger images, after which the ring is armed again.
+  */
+asynStatus ADSpinnaker::preTriggerImage(ImagePtr pImage, epicsTimeStamp &epicsTS)
+{
+    asynStatus status;
+    int postTriggerCount;
+
+    if ((preTriggerState_ == SPPreTriggerArmed) && preTriggerFired_) {
+        while (!preTriggerImages_.empty()) {
+            SPHeldImage_t held = preTriggerImages_.front();
+            preTriggerImages_.pop_front();
+            if (processImage(held.pImage, held.epicsTS) == asynSuccess) {
+                publishImage();
+            } else if (pRaw_) {
+                pRaw_->release();
+                pRaw_ = NULL;
+            }
+        }
+        setIntegerParam(SPPreTriggerFill, 0);
+        preTriggerFired_ = false;
+        getIntegerParam(SPPostTriggerCount, &postTriggerCount);
+        if (postTriggerCount > 0) {
+            postTriggerRemaining_ = postTriggerCount;
+            preTriggerState_ = SPPreTriggerTriggered;
+            setIntegerParam(SPPreTriggerState, preTriggerState_);
+        }
+    }
+
+    if (preTriggerState_ == SPPreTriggerArmed) {
+        SPHeldImage_t held = {pImage, epicsTS};
+        preTriggerImages_.push_back(held);
+        releasePreTriggerImages(preTriggerCount_);
+        return asynSuccess;
+    }
+
+    status = processImage(pImage, epicsTS);
+    if (status == asynSuccess) publishImage();
+    if (--postTriggerRemaining_ <= 0) {
+        preTriggerState_ = SPPreTriggerArmed;
+        setIntegerParam(SPPreTriggerState, preTriggerState_);
+    }
+    return status;
+}
+
+/** Releases the oldest images in the pre-trigger ring until at most keep images are held */
+void ADSpinnaker::releasePreTriggerImages(size_t keep)
+{
+    static const char *functionName = "releasePreTriggerImages";
+
+    while (preTriggerImages_.size() > keep) {
+        try {
+            preTriggerImages_.front().pImage->Release();
+        }
+        catch (Spinnaker::Exception &e) {
+            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+                "%s::%s pImage->Release() exception %s\n",
+                driverName, functionName, e.what());
+        }
+        preTriggerImages_.pop_front();
+    }
+    setIntegerParam(SPPreTriggerFill, (int)preTriggerImages_.size());
+}
+
+/** Sets StreamBufferCountManual, limited to the range the SDK allows, and returns the count it accepted.
+  * Some systems cap the count far below what is requested, so the cap is kept in streamBufferCountMax_.
+  */
+int ADSpinnaker::setStreamBufferCount(int count)
+{
+    static const char *functionName = "setStreamBufferCount";
+    CIntegerPtr pBufferCount = pTLStreamNodeMap_->GetNode("StreamBufferCountManual");
+
+    streamBufferCountMax_ = (int)pBufferCount->GetMax();
+    if (count > streamBufferCountMax_) {
+        asynPrint(pasynUserSelf, ASYN_TRACE_WARNING,
+            "%s::%s %d buffers requested, the maximum allowed is %d\n",
+            driverName, functionName, count, streamBufferCountMax_);
+        count = streamBufferCountMax_;
+    }
+    if (count < pBufferCount->GetMin()) count = (int)pBufferCount->GetMin();
+    pBufferCount->SetValue(count);
+    streamBufferCount_ = (int)pBufferCount->GetValue();
+    return streamBufferCount_;
+}
+
+/** Sets the number of Spinnaker buffers before acquisition starts.
+  * In Manual mode this is numSPBuffers from ADSpinnakerConfig.  In Auto mode it is the number of frames that
+  * arrive in SPBufferLatency ms at the resulting frame rate, plus the pre-trigger ring and 2 spare buffers,
+  * limited so the buffers fit in SPBufferMemoryLimit and in the memory the NDArrayPool has left under maxMemory.
+  * If no memory is left the minimum of 3 buffers is used, so a budget of 0 is not mistaken for no limit.
+  */
+void ADSpinnaker::configureBufferCount()
+{
+    int mode, preTriggerEnable, preTriggerCount;
+    double latency, memoryLimit;
+    double budget = 0.;
+    bool limited = false;
+    int count = numSPBuffers_;
+    static const char *functionName = "configureBufferCount";
+
+    getIntegerParam(SPBufferCountMode, &mode);
+    getDoubleParam(SPBufferLatency, &latency);
+    getDoubleParam(SPBufferMemoryLimit, &memoryLimit);
+    getIntegerParam(SPPreTriggerEnable, &preTriggerEnable);
+    getIntegerParam(SPPreTriggerCount, &preTriggerCount);
+    try {
+        if (mode == SPBufferCountAuto) {
+            CIntegerPtr pPayloadSize = pNodeMap_->GetNode("PayloadSize");
+            CFloatPtr pFrameRate = findNode("AcquisitionResultingFrameRate", "AcquisitionFrameRate");
+            double frameRate = IsReadable(pFrameRate) ? pFrameRate->GetValue() : 0.;
+            double payloadSize = IsReadable(pPayloadSize) ? (double)pPayloadSize->GetValue() : 0.;
+            count = (int)ceil(frameRate * latency / 1000.) + 2;
+            if (preTriggerEnable) count += preTriggerCount;
+            if (memoryLimit > 0) {
+                budget = memoryLimit * 1e6;
+                limited = true;
+            }
+            if (pNDArrayPool->getMaxMemory() > 0) {
+                double remaining = (double)pNDArrayPool->getMaxMemory() - (double)pNDArrayPool->getMemorySize();
+                if (!limited || (remaining < budget)) budget = std::max(remaining, 0.);
+                limited = true;
+            }
+            if (limited && (payloadSize > 0) && (count > budget / payloadSize)) {
+                count = (int)(budget / payloadSize);
+            }
+            if (count < 3) count = 3;
+        }
+        setIntegerParam(SPBufferCountRequested, count);
+        if (count != streamBufferCount_) setStreamBufferCount(count);
+    }
+    catch (Spinnaker::Exception &e) {
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+            "%s::%s exception %s\n",
+            driverName, functionName, e.what());
+    }
+    setIntegerParam(SPBufferCountActual, streamBufferCount_);
+    setIntegerParam(SPBufferCountMax, streamBufferCountMax_);
+}
+
+/** Sets StreamBufferHandlingMode, which can only be changed while the camera is not streaming,
+  * and resets the latency statistics.
+  */
+void ADSpinnaker::configureBufferHandling()
+{
+    int mode;
+    static const char *functionName = "configureBufferHandling";
+
+    getIntegerParam(SPBufferHandlingMode, &mode);
+    if ((mode < 0) || (mode > SPBufferNewestFirst)) mode = SPBufferOldestFirst;
+    try {
+        CEnumerationPtr pHandlingMode = pTLStreamNodeMap_->GetNode("StreamBufferHandlingMode");
+        CEnumEntryPtr pEntry = pHandlingMode->GetEntryByName(spBufferHandlingModes[mode]);
+        if (IsWritable(pHandlingMode) && IsAvailable(pEntry)) {
+            pHandlingMode->SetIntValue(pEntry->GetValue());
+        } else {
+            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s::%s StreamBufferHandlingMode %s is not available\n",
+                driverName, functionName, spBufferHandlingModes[mode]);
+        }
+    }
+    catch (Spinnaker::Exception &e) {
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+            "%s::%s exception %s\n",
+            driverName, functionName, e.what());
+    }
+    bufferHandlingMode_ = mode;
+    queueSkipped_ = 0;
+    latencyValid_ = false;
+    latencyCount_ = 0;
+    latencySum_ = 0.;
+    latencyMax_ = 0.;
+    setIntegerParam(SPQueueSkipped, 0);
+}
+
+/** Returns how full the output path is, from 0 to 1.  This is the larger of the fraction of the driver's
+  * message queue in use and, if maxMemory is set, the estimated fraction of maxMemory held by NDArrays
+  * that the plugins have not released.
+  */
+double ADSpinnaker::backpressureLevel()
+{
+    double level = (double)pCallbackMsgQ_->pending() / CALLBACK_MESSAGE_QUEUE_SIZE;
+    double maxMemory = (double)pNDArrayPool->getMaxMemory();
+    int numBuffers = pNDArrayPool->getNumBuffers();
+
+    if ((maxMemory > 0) && (numBuffers > 0)) {
+        int inUse = numBuffers - pNDArrayPool->getNumFree();
+        level = std::max(level, (double)pNDArrayPool->getMemorySize() * inUse / numBuffers / maxMemory);
+    }
+    return level;
+}
+
+/** Returns true if the next image should be dropped because the plugins are falling behind.
+  * Drop mode drops every image from when the level reaches SPBackpressureHigh until it falls to SPBackpressureLow.
+  * Decimate mode publishes one image in decimation_.  The factor is doubled, up to SPBackpressureMaxDecimation,
+  * while the level is above SPBackpressureHigh and halved while it is below SPBackpressureLow.  It only changes
+  * at a published image so that each factor is tried for a full cycle.
+  */
+bool ADSpinnaker::checkBackpressure()
+{
+    int mode, maxDecimation;
+    double high, low, level;
+    bool drop;
+
+    getIntegerParam(SPBackpressureMode, &mode);
+    if (mode == SPBackpressureAbort) return false;
+    getDoubleParam(SPBackpressureHigh, &high);
+    getDoubleParam(SPBackpressureLow, &low);
+    getIntegerParam(SPBackpressureMaxDecimation, &maxDecimation);
+    if (maxDecimation < 1) maxDecimation = 1;
+    level = backpressureLevel() * 100.;
+    if (mode == SPBackpressureDrop) {
+        if (level >= high) backpressureActive_ = true;
+        else if (level <= low) backpressureActive_ = false;
+        decimation_ = 1;
+        drop = backpressureActive_;
+    } else {
+        if (decimationCounter_ == 0) {
+            if ((level >= high) && (decimation_ < maxDecimation)) {
+                decimation_ = std::min(decimation_ * 2, maxDecimation);
+            } else if ((level <= low) && (decimation_ > 1)) {
+                decimation_ /= 2;
+            }
+            backpressureActive_ = (decimation_ > 1);
+        }
+        drop = (decimationCounter_ != 0);
+        decimationCounter_ = (decimationCounter_ + 1) % decimation_;
+    }
+    if (drop) backpressureDropped_++;
+    setDoubleParam(SPBackpressureLevel, level);
+    setIntegerParam(SPBackpressureActive, backpressureActive_);
+    setIntegerParam(SPBackpressureDecimation, decimation_);
+    setIntegerParam(SPBackpressureDropped, backpressureDropped_);
+    return drop;
+}
+
+/** Arms the pre-trigger ring at the start of acquisition if SPPreTriggerEnable is set.
+  * Held images occupy Spinnaker buffers, so the depth is limited to leave 2 buffers for the stream.
+  */
+void ADSpinnaker::armPreTrigger()
+{
+    int enable, count;
+
+    releasePreTriggerImages(0);
+    preTriggerFired_ = false;
+    postTriggerRemaining_ = 0;
+    getIntegerParam(SPPreTriggerEnable, &enable);
+    if (burstState_ != SPBurstIdle) enable = 0;
+    getIntegerParam(SPPreTriggerCount, &count);
+    if (count > streamBufferCount_ - 2) count = streamBufferCount_ - 2;
+    if (count < 0) count = 0;
+    setIntegerParam(SPPreTriggerCount, count);
+    preTriggerCount_ = count;
+    preTriggerState_ = enable ? SPPreTriggerArmed : SPPreTriggerOff;
+    setIntegerParam(SPPreTriggerState, preTriggerState_);
+}
+
+/** Prepares the burst arena at the start of acquisition if SPBurstEnable is set.
+  * The arena has SPBurstCount slots of PayloadSize bytes.  It is only reallocated when its size changes,
+  * and it is touched, and locked in RAM where supported, so that filling it does not page fault.
+  */
+asynStatus ADSpinnaker::armBurst()
+{
+    int enable, count;
+    size_t slotSize, arenaSize;
+    static const char *functionName = "armBurst";
+
+    burstImages_.clear();
+    burstState_ = SPBurstIdle;
+    getIntegerParam(SPBurstEnable, &enable);
+    getIntegerParam(SPBurstCount, &count);
+    if (enable && (count > 0)) {
+        try {
+            CIntegerPtr pPayloadSize = pNodeMap_->GetNode("PayloadSize");
+            slotSize = (size_t)pPayloadSize->GetValue();
+        }
+        catch (Spinnaker::Exception &e) {
+            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+                "%s::%s exception %s\n",
+                driverName, functionName, e.what());
+            return asynError;
+        }
+        arenaSize = slotSize * count;
+        if (arenaSize != burstArenaSize_) {
+            if (burstArena_) {
+#ifndef _WIN32
+                munlock(burstArena_, burstArenaSize_);
+#endif
+                free(burstArena_);
+            }
+            burstArenaSize_ = 0;
+            burstArena_ = (char *)malloc(arenaSize);
+            if (!burstArena_) {
+                asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+                    "%s::%s cannot allocate %lu bytes for %d burst images\n",
+                    driverName, functionName, (unsigned long)arenaSize, count);
+                return asynError;
+            }
+            memset(burstArena_, 0, arenaSize);
+#ifndef _WIN32
+            if (mlock(burstArena_, arenaSize) != 0) {
+                asynPrint(pasynUserSelf, ASYN_TRACE_WARNING, 
+                    "%s::%s cannot lock the burst arena in RAM\n",
+                    driverName, functionName);
+            }
+#endif
+            burstArenaSize_ = arenaSize;
+        }
+        burstSlotSize_ = slotSize;
+        burstCount_ = count;
+        burstImages_.reserve(count);
+        burstState_ = SPBurstFilling;
+    }
+    setIntegerParam(SPBurstFrames, 0);
+    setIntegerParam(SPBurstState, burstState_);
+    return asynSuccess;
+}
+
+/** Copies a raw image into the next slot of the burst arena and releases its Spinnaker buffer.
+  * There is no conversion, no attributes and no callbacks until the burst is complete.
+  */
+asynStatus ADSpinnaker::burstImage(ImagePtr pImage, epicsTimeStamp &epicsTS)
+{
+    SPImageInfo_t info;
+    void *pData;
+    double elapsed;
+    static const char *functionName = "burstImage";
+
+    try {
+        info.width = pImage->GetWidth();
+        info.height = pImage->GetHeight();
+        info.pixelFormat = pImage->GetPixelFormat();
+        info.bufferSize = pImage->GetBufferSize();
+        if (info.bufferSize > burstSlotSize_) info.bufferSize = burstSlotSize_;
+        info.frameID = pImage->GetFrameID();
+        info.timeStamp = pImage->GetTimeStamp();
+        info.epicsTS = epicsTS;
+        pData = pImage->GetData();
+        if (pData) {
+            memcpy(burstArena_ + burstImages_.size()*burstSlotSize_, pData, info.bufferSize);
+        }
+        pImage->Release();
+    }
+    catch (Spinnaker::Exception &e) {
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+            "%s::%s exception %s\n",
+            driverName, functionName, e.what());
+        return asynError;
+    }
+    if (!pData) {
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+            "%s::%s [%s] ERROR: pData is NULL!\n",
+            driverName, functionName, portName);
+        return asynError;
+    }
+    burstImages_.push_back(info);
+    setIntegerParam(SPBurstFrames, (int)burstImages_.size());
+    if (burstImages_.size() >= burstCount_) {
+        elapsed = epicsTimeDiffInSeconds(&burstImages_.back().epicsTS, &burstImages_.front().epicsTS);
+        setDoubleParam(SPBurstFillRate, (elapsed > 0) ? (burstImages_.size() - 1) / elapsed : 0.);
+        burstState_ = SPBurstDraining;
+        setIntegerParam(SPBurstState, burstState_);
+    }
+    return asynSuccess;
+}
+
+/** Publishes the images in the burst arena to the plugins.
+  * The number of NDArrays in use is limited to SPBurstDrainQueue, so the arena is drained at the
+  * rate that the plugins accept rather than overflowing their queues.  The array that the driver keeps in
+  * pArrays[0] after publishing it is not counted, otherwise a limit of 1 could never be met.
+  * Setting SPBurstEnable to 0 discards the images that have not been published.
+  */
+void ADSpinnaker::drainBurst()
+{
+    int enable, drainQueue, convertPixelFormat;
+    int inUse;
+    size_t next = 0;
+    SPImageInfo_t info;
+    void *pData;
+    asynStatus status;
+    epicsTimeStamp startTime, endTime;
+    double elapsed;
+    static const char *functionName = "drainBurst";
+
+    if (burstState_ == SPBurstFilling) {
+        elapsed = epicsTimeDiffInSeconds(&burstImages_.back().epicsTS, &burstImages_.front().epicsTS);
+        setDoubleParam(SPBurstFillRate, (elapsed > 0) ? (burstImages_.size() - 1) / elapsed : 0.);
+    }
+    burstState_ = SPBurstDraining;
+    setIntegerParam(SPBurstState, burstState_);
+    callParamCallbacks();
+    epicsTimeGetCurrent(&startTime);
+    while (next < burstImages_.size()) {
+        getIntegerParam(SPBurstEnable, &enable);
+        if (exiting_ || !enable) break;
+        getIntegerParam(SPBurstDrainQueue, &drainQueue);
+        inUse = pNDArrayPool->getNumBuffers() - pNDArrayPool->getNumFree();
+        if (this->pArrays[0]) inUse--;
+        if ((drainQueue > 0) && (inUse >= drainQueue)) {
+            // Wait for the plugins to release some arrays
+            unlock();
+            epicsThreadSleep(0.001);
+            lock();
+            continue;
+        }
+        info = burstImages_[next];
+        pData = burstArena_ + next*burstSlotSize_;
+        next++;
+        getIntegerParam(SPConvertPixelFormat, &convertPixelFormat);
+        try {
+            ImagePtr pImage;
+            if (convertPixelFormat != SPPixelConvertNone) {
+                pImage = Image::Create(info.width, info.height, 0, 0, info.pixelFormat, pData);
+                if (convertImage(pImage)) {
+                    info.pixelFormat = pImage->GetPixelFormat();
+                    info.bufferSize = pImage->GetBufferSize();
+                    pData = pImage->GetData();
+                }
+            }
+            status = copyImage(info, pData);
+        }
+        catch (Spinnaker::Exception &e) {
+            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+                "%s::%s exception %s\n",
+                driverName, functionName, e.what());
+            status = asynError;
+        }
+        if (status == asynSuccess) {
+            publishImage();
+        } else if (pRaw_) {
+            pRaw_->release();
+            pRaw_ = NULL;
+        }
+        callParamCallbacks();
+    }
+    epicsTimeGetCurrent(&endTime);
+    elapsed = epicsTimeDiffInSeconds(&endTime, &startTime);
+    setDoubleParam(SPBurstDrainRate, (elapsed > 0) ? next / elapsed : 0.);
+    burstImages_.clear();
+    burstState_ = SPBurstIdle;
+    setIntegerParam(SPBurstState, burstState_);
+    callParamCallbacks();
+}
+
+/** Enables the chunks selected by SPChunkSelect and records the ones that the camera supports.
+  * readChunks() then calls the ChunkData accessor for each of these, with no node lookups per image.
+  * Must be called while the camera is not acquiring.
+  */
+void ADSpinnaker::configureChunks()
 {
-    asynStatus status = asynSuccess;
-    size_t nRows, nCols;
-    NDDataType_t dataType;
-    NDColorMode_t colorMode;
-    int timeStampMode;
-    int uniqueIdMode;
-    int convertPixelFormat;
-    bool imageConverted = false;
-    int numColors;
-    size_t dims[3];
-    ImageStatus imageStatus;
-    PixelFormatEnums pixelFormat;
-    int pixelSize;
-    size_t dataSize, dataSizePG;
-    int acquiring;
-    void *pData;
-    int nDims;
-    ImagePtr pImage;
-    ImagePtr *imagePtrAddr=0;
-    static const char *functionName = "grabImage";
+    int enable;
+    epicsUInt32 select;
+    bool chunkEnable;
+    static const char *functionName = "configureChunks";
+
+    activeChunks_.clear();
+    getIntegerParam(SPChunkEnable, &enable);
+    getUIntDigitalParam(SPChunkSelect, &select, 0xFFFFFFFF);
+    // Leave the chunk configuration alone unless this driver has changed it
+    if (enable || chunkModeSet_) {
+        try {
+            CBooleanPtr pChunkModeActive = pNodeMap_->GetNode("ChunkModeActive");
+            CEnumerationPtr pChunkSelector = pNodeMap_->GetNode("ChunkSelector");
+            CBooleanPtr pChunkEnable = pNodeMap_->GetNode("ChunkEnable");
+            if (IsWritable(pChunkModeActive)) {
+                pChunkModeActive->SetValue(true);
+                for (int i=0; i<NUM_SP_CHUNKS; i++) {
+                    if (!IsWritable(pChunkSelector)) break;
+                    CEnumEntryPtr pEntry = pChunkSelector->GetEntryByName(spChunks[i].selector);
+                    if (!IsReadable(pEntry)) continue;
+                    pChunkSelector->SetIntValue(pEntry->GetValue());
+                    chunkEnable = enable && (select & (1 << i));
+                    if (IsWritable(pChunkEnable)) pChunkEnable->SetValue(chunkEnable);
+                    // Some chunks are always enabled
+                    if (chunkEnable && IsReadable(pChunkEnable) && pChunkEnable->GetValue()) {
+                        activeChunks_.push_back(i);
+                    }
+                }
+                pChunkModeActive->SetValue(!activeChunks_.empty());
+                chunkModeSet_ = !activeChunks_.empty();
+            } else if (enable) {
+                asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+                    "%s::%s camera does not support chunk data\n",
+                    driverName, functionName);
+            }
+        }
+        catch (Spinnaker::Exception &e) {
+            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+                "%s::%s exception %s\n",
+                driverName, functionName, e.what());
+        }
+    }
+    chunkIntegers_.resize(activeChunks_.size());
+    chunkDoubles_.resize(activeChunks_.size());
+    chunksValid_ = false;
+    setIntegerParam(SPChunkActive, (int)activeChunks_.size());
+}
 
+/** Reads the active chunks of an image received from the camera */
+void ADSpinnaker::readChunks(ImagePtr pImage)
+{
+    static const char *functionName = "readChunks";
+
+    chunksValid_ = false;
+    if (activeChunks_.empty()) return;
     try {
-        unlock();
-        int recvSize = pCallbackMsgQ_->receive(&imagePtrAddr, sizeof(imagePtrAddr));
-        lock();
-        if (recvSize != sizeof(imagePtrAddr)) {
-            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
-                    "%s::%s error receiving from message queue\n",
-                    driverName, functionName);
-            return asynError;
+        const ChunkData &chunkData = pImage->GetChunkData();
+        for (size_t i=0; i<activeChunks_.size(); i++) {
+            const SPChunk_t *pChunk = &spChunks[activeChunks_[i]];
+            if (pChunk->getInteger) {
+                chunkIntegers_[i] = (chunkData.*pChunk->getInteger)();
+            } else {
+                chunkDoubles_[i] = (chunkData.*pChunk->getDouble)();
+            }
         }
-        // We are sent a null pointer to flag acquisition complete so return
-        if (imagePtrAddr == NULL)  {
-            return asynError;
+        chunksValid_ = true;
+    }
+    catch (Spinnaker::Exception &e) {
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+            "%s::%s exception %s\n",
+            driverName, functionName, e.what());
+    }
+}
+
+/** Adds the chunk values read by readChunks() to the attribute list of an NDArray */
+void ADSpinnaker::addChunkAttributes(NDAttributeList *pAttributeList)
+{
+    if (!chunksValid_) return;
+    for (size_t i=0; i<activeChunks_.size(); i++) {
+        const SPChunk_t *pChunk = &spChunks[activeChunks_[i]];
+        if (pChunk->getInteger) {
+            pAttributeList->add(pChunk->attrName, pChunk->description, NDAttrInt64, &chunkIntegers_[i]);
+        } else {
+            pAttributeList->add(pChunk->attrName, pChunk->description, NDAttrFloat64, &chunkDoubles_[i]);
         }
-        pImage = *imagePtrAddr;
-        // Delete the ImagePtr that was passed to us
-        delete imagePtrAddr;
-        imageStatus = pImage->GetImageStatus();
-        if (imageStatus != SPINNAKER_IMAGE_STATUS_NO_ERROR) {
-            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
-                "%s::%s error GetImageStatus  %d, description:  %s\n",
-                driverName, functionName, imageStatus, Image::GetImageStatusDescription(imageStatus));
-            pImage->Release();
-            return asynError;
-        } 
-        if (pImage->IsIncomplete()) {
+    }
+}
+
+/** Enables or disables IEEE 1588 PTP on the camera */
+void ADSpinnaker::enablePtp(bool enable)
+{
+    static const char *functionName = "enablePtp";
+
+    try {
+        CBooleanPtr pEnable = findNode("PtpEnable", "GevIEEE1588");
+        if (IsWritable(pEnable)) {
+            pEnable->SetValue(enable);
+        } else {
             asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
-                "%s::%s error image is incomplete\n",
+                "%s::%s camera does not support PTP\n",
                 driverName, functionName);
-            pImage->Release();
-            return asynError;
         }
-        // There is a problem on Windows in SDK 4.0.
-        // If acquisition has stopped we can receive an image,
-        // but when we try to read the data we get an access violation
-        // Prevent that by ignoring this image.
-        getIntegerParam(ADAcquire, &acquiring);
-        if (!acquiring) {
+    }
+    catch (Spinnaker::Exception &e) {
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+            "%s::%s exception %s\n",
+            driverName, functionName, e.what());
+    }
+    // The camera clock jumps to PTP time
+    clockCorrelator_.reset();
+}
+
+/** Reads the PTP status and offset from master.  Called from featureTask without the driver lock. */
+void ADSpinnaker::pollPtp()
+{
+    SPPtpState_t state;
+    static const char *functionName = "pollPtp";
+
+    if (exiting_) return;
+    try {
+        CCommandPtr pLatch = findNode("PtpDataSetLatch", "GevIEEE1588DataSetLatch");
+        CEnumerationPtr pStatus = findNode("PtpStatus", "GevIEEE1588Status");
+        CIntegerPtr pOffset = findNode("PtpOffsetFromMaster", "GevIEEE1588OffsetFromMaster");
+        if (!IsReadable(pStatus)) return;
+        if (IsWritable(pLatch)) pLatch->Execute();
+        bool offsetValid = IsReadable(pOffset);
+        state = spParsePtpState(pStatus->GetCurrentEntry(false, true)->GetSymbolic().c_str(),
+                                offsetValid, offsetValid ? (epicsInt64)pOffset->GetValue(false, true) : 0);
+    }
+    catch (Spinnaker::Exception &e) {
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+            "%s::%s exception %s\n",
+            driverName, functionName, e.what());
+        return;
+    }
+    lock();
+    setStringParam(SPPtpStatus, state.status.c_str());
+    setIntegerParam(SPPtpLocked, state.locked);
+    setDoubleParam(SPPtpOffset, state.offset);
+    callParamCallbacks();
+    unlock();
+}
+
+/** Sets the action keys of the camera at the start of acquisition if SPActionDeviceKey is not 0.
+  * The camera responds to action commands with these keys on ActionSelector 0, so TriggerSource=Action0
+  * starts each exposure, or the acquisition, on a scheduled action command.
+  */
+void ADSpinnaker::configureActions()
+{
+    int deviceKey, groupKey, groupMask;
+    static const char *functionName = "configureActions";
+
+    getIntegerParam(SPActionDeviceKey, &deviceKey);
+    getIntegerParam(SPActionGroupKey, &groupKey);
+    getIntegerParam(SPActionGroupMask, &groupMask);
+    if (deviceKey == 0) return;
+    try {
+        CIntegerPtr pSelector = pNodeMap_->GetNode("ActionSelector");
+        CIntegerPtr pDeviceKey = pNodeMap_->GetNode("ActionDeviceKey");
+        CIntegerPtr pGroupKey = pNodeMap_->GetNode("ActionGroupKey");
+        CIntegerPtr pGroupMask = pNodeMap_->GetNode("ActionGroupMask");
+        if (!IsWritable(pDeviceKey)) {
             asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
-                "%s::%s received image after acquisition stopped, ignoring\n",
+                "%s::%s camera does not support action commands\n",
                 driverName, functionName);
-            return asynError;
+            return;
         }
+        if (IsWritable(pSelector)) pSelector->SetValue(0);
+        pDeviceKey->SetValue((epicsUInt32)deviceKey);
+        if (IsWritable(pGroupKey)) pGroupKey->SetValue((epicsUInt32)groupKey);
+        if (IsWritable(pGroupMask)) pGroupMask->SetValue((epicsUInt32)groupMask);
+    }
+    catch (Spinnaker::Exception &e) {
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+            "%s::%s exception %s\n",
+            driverName, functionName, e.what());
+    }
+}
 
-        nCols = pImage->GetWidth();
-        nRows = pImage->GetHeight();
-        // Print the first 16 bytes of the buffer in hex
-        //pData = pImage->GetData();
-        //for (int i=0; i<16; i++) printf("%x ", ((epicsUInt8 *)pData)[i]); printf("\n");
-     
-        // Convert the pixel format if requested
-        getIntegerParam(SPConvertPixelFormat, &convertPixelFormat);
-        if (convertPixelFormat != SPPixelConvertNone) {
-            PixelFormatEnums convertedFormat;
-            switch (convertPixelFormat) {
-                case SPPixelConvertMono8:
-                    convertedFormat = PixelFormat_Mono8;
-                    break;
-                case SPPixelConvertMono16:
-                    convertedFormat = PixelFormat_Mono16;
-                    break;
-                case SPPixelConvertRaw16:
-                    convertedFormat = PixelFormat_Raw16;
-                    break;
-                case SPPixelConvertRGB8:
-                    convertedFormat = PixelFormat_RGB8;
-                    break;
-                case SPPixelConvertRGB16:
-                    convertedFormat = PixelFormat_RGB16;
-                    break;
-                default:
-                    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
-                        "%s::%s Error: Unknown pixel conversion format %d\n",
-                        driverName, functionName, convertPixelFormat);
-                    convertedFormat = PixelFormat_Mono8;
-                    break;
-            }
-    
-            pixelFormat = pImage->GetPixelFormat();
-            ImageProcessor processor; 
-            unlock();
-            try {
-                //epicsTimeStamp tstart, tend;
-                //epicsTimeGetCurrent(&tstart);
-                pImage  = processor.Convert(pImage, convertedFormat);
-                //epicsTimeGetCurrent(&tend);
-                //asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, "%s::%s time for pImage->convert=%f\n", 
-                //    driverName, functionName, epicsTimeDiffInSeconds(&tend, &tstart));
-                imageConverted = true;
-            }
-            catch (Spinnaker::Exception &e) {
-                 asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
-                     "%s::%s pixel format conversion exception %s\n",
-                 driverName, functionName, e.what());
-            }
-            lock();
-        }
-    
-        pixelFormat = pImage->GetPixelFormat();
-        switch (pixelFormat) {
-            case PixelFormat_Mono8:
-            case PixelFormat_Raw8:
-                dataType = NDUInt8;
-                colorMode = NDColorModeMono;
-                numColors = 1;
-                pixelSize = 1;
-                break;
-    
-            case PixelFormat_BayerGB8:
-                dataType = NDUInt8;
-                colorMode = NDColorModeBayer;
-                numColors = 1;
-                pixelSize = 1;
-                break;
-            case PixelFormat_RGB8:
-                dataType = NDUInt8;
-                colorMode = NDColorModeRGB1;
-                numColors = 3;
-                pixelSize = 1;
-                break;
-    
-            case PixelFormat_Mono16:
-            case PixelFormat_Raw16:
-                dataType = NDUInt16;
-                colorMode = NDColorModeMono;
-                numColors = 1;
-                pixelSize = 2;
-                break;
-    
-            case PixelFormat_RGB16:
-                dataType = NDUInt16;
-                colorMode = NDColorModeRGB1;
-                numColors = 3;
-                pixelSize = 2;
-                break;
-    
-            default:
+/** Sends an action command with the action keys on every GigE interface.
+  * If SPActionDelay is greater than 0 the command is scheduled for the current camera time plus the delay.
+  * With PTP all cameras that receive it act on the same tick, whichever driver sends it.
+  */
+asynStatus ADSpinnaker::sendActionCommand()
+{
+    int deviceKey, groupKey, groupMask;
+    double delay;
+    epicsInt64 cameraTime = 0;
+    epicsInt64 actionTime = 0;
+    epicsTimeStamp hostTime;
+    int numSent = 0;
+    static const char *functionName = "sendActionCommand";
+
+    getIntegerParam(SPActionDeviceKey, &deviceKey);
+    getIntegerParam(SPActionGroupKey, &groupKey);
+    getIntegerParam(SPActionGroupMask, &groupMask);
+    getDoubleParam(SPActionDelay, &delay);
+    try {
+        if (delay > 0) {
+            if (!readCameraTime(&cameraTime, &hostTime)) {
                 asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
-                    "%s:%s: unsupported pixel format=0x%x\n",
-                    driverName, functionName, pixelFormat);
-                return asynError;
-        }
-    
-        if (numColors == 1) {
-            nDims = 2;
-            dims[0] = nCols;
-            dims[1] = nRows;
-        } else {
-            nDims = 3;
-            dims[0] = 3;
-            dims[1] = nCols;
-            dims[2] = nRows;
-        }
-        dataSize = dims[0] * dims[1] * pixelSize;
-        if (nDims == 3) dataSize *= dims[2];
-        dataSizePG = pImage->GetBufferSize();
-        // Note, we should be testing for equality here.  However, there appears to be a bug in the
-        // SDK when images are converted.  When converting from raw8 to mono8, for example, the
-        // size returned by GetDataSize is the size of an RGB8 image, not a mono8 image.
-        if (dataSize > dataSizePG) {
-            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
-                "%s:%s: data size mismatch: calculated=%lu, reported=%lu\n",
-                driverName, functionName, (long)dataSize, (long)dataSizePG);
-            //return asynError;
-        }
-        setIntegerParam(NDArraySizeX, (int)nCols);
-        setIntegerParam(NDArraySizeY, (int)nRows);
-        setIntegerParam(NDArraySize, (int)dataSize);
-        setIntegerParam(NDDataType,dataType);
-        if (nDims == 3) {
-            colorMode = NDColorModeRGB1;
-        } 
-        setIntegerParam(NDColorMode, colorMode);
-    
-        pRaw_ = pNDArrayPool->alloc(nDims, dims, dataType, 0, NULL);
-        if (!pRaw_) {
-            // If we didn't get a valid buffer from the NDArrayPool we must abort
-            // the acquisition as we have nowhere to dump the data...
-            setIntegerParam(ADStatus, ADStatusAborting);
-            callParamCallbacks();
-            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
-                "%s::%s [%s] ERROR: Serious problem: not enough buffers left! Aborting acquisition!\n",
-                driverName, functionName, portName);
-            setIntegerParam(ADAcquire, 0);
-            return(asynError);
-        }
-        pData = pImage->GetData();
-        // Print the first 8 pixels of the buffer in decimal
-        //for (int i=0; i<8; i++) printf("%u ", ((epicsUInt16 *)pData)[i]); printf("\n");
-        if (pData) {
-            memcpy(pRaw_->pData, pData, dataSize);
-        } else {
-            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
-                "%s::%s [%s] ERROR: pData is NULL!\n",
-                driverName, functionName, portName);
-            return asynError;
-        }
-    
-        // Put the frame number into the buffer
-        getIntegerParam(SPUniqueIdMode, &uniqueIdMode);
-        if (uniqueIdMode == UniqueIdCamera) {
-            pRaw_->uniqueId = (int)pImage->GetFrameID();
-        } else {
-            pRaw_->uniqueId = uniqueId_;
-        }
-        uniqueId_++;
-        updateTimeStamp(&pRaw_->epicsTS);
-        getIntegerParam(SPTimeStampMode, &timeStampMode);
-        // Set the timestamps in the buffer
-        if (timeStampMode == TimeStampCamera) {
-            long long timeStamp = pImage->GetTimeStamp();
-            if (timeStamp == 0) {
-                asynPrint(pasynUserSelf, ASYN_TRACE_WARNING,
-                    "%s::%s pImage->GetTimeStamp() returned 0\n",
+                    "%s::%s cannot read the camera time to schedule the action\n",
                     driverName, functionName);
+                return asynError;
             }
-            pRaw_->timeStamp = timeStamp / 1e9;
-        } else {
-            pRaw_->timeStamp = pRaw_->epicsTS.secPastEpoch + pRaw_->epicsTS.nsec/1e9;
-        }
-        try {
-            // We get a "No Stream Available" exception if pImage points to an image resulting from ConvertPixeFormat
-            // Not sure why?
-            if (!imageConverted) {
-                pImage->Release();
-            } 
+            actionTime = spActionTime(cameraTime, delay);
         }
-        catch (Spinnaker::Exception &e) {
-            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
-                "%s::%s pImage->Release() exception %s\n",
-                driverName, functionName, e.what());
+        InterfaceList interfaces = system_->GetInterfaces(false);
+        for (unsigned int i=0; i<interfaces.GetSize(); i++) {
+            InterfacePtr pInterface = interfaces.GetByIndex(i);
+            INodeMap &nodeMap = pInterface->GetTLNodeMap();
+            CCommandPtr pCommand = nodeMap.GetNode("ActionCommand");
+            if (!IsWritable(pCommand)) continue;
+            CIntegerPtr pDeviceKey = nodeMap.GetNode("GevActionDeviceKey");
+            CIntegerPtr pGroupKey = nodeMap.GetNode("GevActionGroupKey");
+            CIntegerPtr pGroupMask = nodeMap.GetNode("GevActionGroupMask");
+            CIntegerPtr pTime = nodeMap.GetNode("GevActionTime");
+            pDeviceKey->SetValue((epicsUInt32)deviceKey);
+            pGroupKey->SetValue((epicsUInt32)groupKey);
+            pGroupMask->SetValue((epicsUInt32)groupMask);
+            if (IsWritable(pTime)) pTime->SetValue(actionTime);
+            pCommand->Execute();
+            numSent++;
         }
-        // Get any attributes that have been defined for this driver        
-        getAttributes(pRaw_->pAttributeList);
-        
-        // Change the status to be readout...
-        setIntegerParam(ADStatus, ADStatusReadout);
-        callParamCallbacks();
-    
-        pRaw_->pAttributeList->add("ColorMode", "Color mode", NDAttrInt32, &colorMode);
-        return status;
+        interfaces.Clear();
     }
     catch (Spinnaker::Exception &e) {
         asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
@@ -747,6 +3292,14 @@ asynStatus ADSpinnaker::grabImage()
             driverName, functionName, e.what());
         return asynError;
     }
+    if (numSent == 0) {
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+            "%s::%s no interface supports action commands\n",
+            driverName, functionName);
+        return asynError;
+    }
+    setDoubleParam(SPActionTime, actionTime / 1e9);
+    return asynSuccess;
 }
 
 asynStatus ADSpinnaker::readEnum(asynUser *pasynUser, char *strings[], int values[], int severities[], 
@@ -763,12 +3316,163 @@ asynStatus ADSpinnaker::readEnum(asynUser *pasynUser, char *strings[], int value
     return ADGenICam::readEnum(pasynUser, strings, values, severities, nElements, nIn);
 }
 
+/** Programs the camera to stop by itself after the requested number of frames.
+  * In Single mode AcquisitionMode is set to SingleFrame, and in Multiple mode to MultiFrame with
+  * AcquisitionFrameCount=ADNumImages.  When frames are accumulated each image needs SPAccumulateFrames frames,
+  * so Single mode also uses MultiFrame, with AcquisitionFrameCount=SPAccumulateFrames, and in Multiple mode
+  * the count is multiplied by SPAccumulateFrames.  The camera then does not expose frames after the last one,
+  * and stopCapture() does not have to discard frames that are already in the transport layer.
+  * Frames that the transport layer drops or loses are never delivered, so the camera must also report
+  * AcquisitionStatus for hardwareFrameCountDone() to detect that it has stopped.
+  * If the camera does not support this, or SPHardwareFrameCount is 0, the frames are counted in software.
+  * The pre-trigger ring and burst capture need a free-running stream, so they disable the hardware frame count.
+  * So do the StreamBufferHandlingModes other than OldestFirst, because they discard frames before the driver sees them.
+  */
+void ADSpinnaker::setHardwareFrameCount()
+{
+    int enable, imageMode, numImages;
+    int accumulateEnable, accumulateFrames;
+    bool multiFrame;
+    static const char *functionName = "setHardwareFrameCount";
+
+    hwFrameCountActive_ = false;
+    hwAcquisitionStopped_ = false;
+    streamFrameCount_ = 0;
+    getIntegerParam(SPHardwareFrameCount, &enable);
+    getIntegerParam(ADImageMode, &imageMode);
+    getIntegerParam(ADNumImages, &numImages);
+    // NumImages counts accumulated images, and each one needs AccumulateFrames frames from the camera
+    getIntegerParam(SPAccumulateEnable, &accumulateEnable);
+    getIntegerParam(SPAccumulateFrames, &accumulateFrames);
+    if (imageMode == ADImageSingle) numImages = 1;
+    if (accumulateEnable) numImages *= std::max(accumulateFrames, 1);
+    multiFrame = (imageMode == ADImageMultiple) || (numImages > 1);
+    if (enable && (preTriggerState_ == SPPreTriggerOff) && (burstState_ == SPBurstIdle) &&
+        (bufferHandlingMode_ == SPBufferOldestFirst) && (imageMode != ADImageContinuous)) {
+        try {
+            CEnumerationPtr pMode = pNodeMap_->GetNode("AcquisitionMode");
+            CEnumEntryPtr pEntry = pMode->GetEntryByName(multiFrame ? "MultiFrame" : "SingleFrame");
+            CEnumerationPtr pStatusSelector = pNodeMap_->GetNode("AcquisitionStatusSelector");
+            CBooleanPtr pStatus = pNodeMap_->GetNode("AcquisitionStatus");
+            if (IsWritable(pStatusSelector)) {
+                // AcquisitionTransfer stays true until the last frame has been sent
+                CEnumEntryPtr pSelect = pStatusSelector->GetEntryByName("AcquisitionTransfer");
+                if (!IsReadable(pSelect)) pSelect = pStatusSelector->GetEntryByName("AcquisitionActive");
+                if (IsReadable(pSelect)) pStatusSelector->SetIntValue(pSelect->GetValue());
+            }
+            if (IsWritable(pMode) && IsReadable(pEntry) && IsReadable(pStatus)) {
+                savedAcquisitionMode_ = pMode->GetCurrentEntry()->GetSymbolic();
+                pMode->SetIntValue(pEntry->GetValue());
+                hwFrameCount_ = 1;
+                hwFrameCountActive_ = true;
+                if (multiFrame) {
+                    // AcquisitionFrameCount is only writable once the mode is MultiFrame
+                    CIntegerPtr pCount = pNodeMap_->GetNode("AcquisitionFrameCount");
+                    if (IsWritable(pCount) && (numImages >= pCount->GetMin()) && (numImages <= pCount->GetMax())) {
+                        pCount->SetValue(numImages);
+                        hwFrameCount_ = numImages;
+                    } else {
+                        restoreAcquisitionMode();
+                        hwFrameCountActive_ = false;
+                    }
+                }
+            }
+        }
+        catch (Spinnaker::Exception &e) {
+            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+                "%s::%s exception %s\n",
+                driverName, functionName, e.what());
+            restoreAcquisitionMode();
+            hwFrameCountActive_ = false;
+        }
+    }
+    setIntegerParam(SPHardwareFrameCountActive, hwFrameCountActive_);
+}
+
+/** Returns true when a camera that counts frames has sent all of them.  That is when the stream has
+  * delivered hwFrameCount_ frames or, if timedOut, when AcquisitionStatus has been false at two successive
+  * timeouts of grabImage(), so that any frame still in transit has had time to arrive.
+  */
+bool ADSpinnaker::hardwareFrameCountDone(bool timedOut)
+{
+    static const char *functionName = "hardwareFrameCountDone";
+
+    if (!hwFrameCountActive_) return false;
+    if (streamFrameCount_ >= hwFrameCount_) return true;
+    if (!timedOut) return false;
+    try {
+        CBooleanPtr pStatus = pNodeMap_->GetNode("AcquisitionStatus");
+        if (IsReadable(pStatus) && pStatus->GetValue(false, true)) {
+            hwAcquisitionStopped_ = false;
+            return false;
+        }
+    }
+    catch (Spinnaker::Exception &e) {
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+            "%s::%s exception %s\n",
+            driverName, functionName, e.what());
+    }
+    if (hwAcquisitionStopped_) {
+        asynPrint(pasynUserSelf, ASYN_TRACE_WARNING,
+            "%s::%s camera stopped after %d of %d frames\n",
+            driverName, functionName, streamFrameCount_, hwFrameCount_);
+        return true;
+    }
+    hwAcquisitionStopped_ = true;
+    return false;
+}
+
+/** Restores the AcquisitionMode that was in effect before setHardwareFrameCount() */
+void ADSpinnaker::restoreAcquisitionMode()
+{
+    static const char *functionName = "restoreAcquisitionMode";
+
+    if (savedAcquisitionMode_.empty()) return;
+    try {
+        CEnumerationPtr pMode = pNodeMap_->GetNode("AcquisitionMode");
+        CEnumEntryPtr pEntry = pMode->GetEntryByName(savedAcquisitionMode_);
+        if (IsWritable(pMode) && IsReadable(pEntry)) {
+            pMode->SetIntValue(pEntry->GetValue());
+        }
+    }
+    catch (Spinnaker::Exception &e) {
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+            "%s::%s exception %s\n",
+            driverName, functionName, e.what());
+    }
+    savedAcquisitionMode_ = "";
+}
+
 asynStatus ADSpinnaker::startCapture()
 {
     static const char *functionName = "startCapture";
 
     // Start the camera transmission...
+    if (burstState_ == SPBurstDraining) {
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+            "%s::%s cannot start while a burst is being published\n",
+            driverName, functionName);
+        return asynError;
+    }
     setIntegerParam(ADNumImagesCounter, 0);
+    flushFeatureWrites();
+    if (armBurst() != asynSuccess) return asynError;
+    configureBufferCount();
+    configureBufferHandling();
+    backpressureActive_ = false;
+    decimation_ = 1;
+    decimationCounter_ = 0;
+    backpressureDropped_ = 0;
+    setIntegerParam(SPBackpressureActive, 0);
+    setIntegerParam(SPBackpressureDecimation, 1);
+    setIntegerParam(SPBackpressureDropped, 0);
+    frameProcessor_.resetAccumulation();
+    setIntegerParam(SPAccumulateCount, 0);
+    epicsTimeGetCurrent(&statsUpdateTime_);
+    armPreTrigger();
+    configureChunks();
+    configureActions();
+    setHardwareFrameCount();
     setShutter(1);
     try {
         pCamera_->BeginAcquisition();
@@ -790,6 +3494,11 @@ asynStatus ADSpinnaker::stopCapture()
     static const char *functionName = "stopCapture";
     ImagePtr *dummy = NULL;
 
+    // Held images must be released before EndAcquisition()
+    releasePreTriggerImages(0);
+    preTriggerState_ = SPPreTriggerOff;
+    setIntegerParam(SPPreTriggerState, preTriggerState_);
+
     try {
         pCamera_->EndAcquisition();
     }
@@ -824,6 +3533,13 @@ asynStatus ADSpinnaker::stopCapture()
 
     // Need to empty the message queue it could have some images in it
     while(pCallbackMsgQ_->tryReceive(&dummy, sizeof(dummy)) != -1) {}
+
+    // AcquisitionMode can only be changed after EndAcquisition()
+    if (hwFrameCountActive_) {
+        restoreAcquisitionMode();
+        hwFrameCountActive_ = false;
+        setIntegerParam(SPHardwareFrameCountActive, 0);
+    }
     return asynSuccess;
 }
 
@@ -914,6 +3630,8 @@ void ADSpinnaker::report(FILE *fp, int details)
     fprintf(fp, "\n");
     fprintf(fp, "Report for camera in use:\n");
     ADGenICam::report(fp, details);
+    fprintf(fp, "Link bandwidth:\n");
+    SPBandwidthManager::getInstance()->report(fp);
     return;
 }
 
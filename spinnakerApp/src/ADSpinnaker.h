@@ -1,9 +1,17 @@
 #ifndef ADSPINNAKER_H
 #define ADSPINNAKER_H
 
+#include <deque>
+#include <map>
+#include <set>
+#include <vector>
+
 #include <epicsEvent.h>
+#include <epicsMutex.h>
 
 #include <ADGenICam.h>
+#include "SPClock.h"
+#include "SPFrameProcessor.h"
 #include "Spinnaker.h"
 #include "SpinGenApi/SpinnakerGenApi.h"
 
@@ -26,6 +34,153 @@ using namespace Spinnaker::GenICam;
 #define SPResendReceivedPacketCountString   "SP_RESEND_RECEIVED_PACKET_COUNT"   // asynParamInt32, R/O
 #define SPTimeStampModeString               "SP_TIME_STAMP_MODE"                // asynParamInt32, R/O
 #define SPUniqueIdModeString                "SP_UNIQUE_ID_MODE"                 // asynParamInt32, R/O
+#define SPFeatureRefreshTimeString          "SP_FEATURE_REFRESH_TIME"           // asynParamFloat64, R/O
+#define SPFeatureRefreshCountString         "SP_FEATURE_REFRESH_COUNT"          // asynParamInt32, R/O
+#define SPFeaturePollPeriodString           "SP_FEATURE_POLL_PERIOD"            // asynParamFloat64, R/W
+#define SPFeatureBatchBeginString           "SP_FEATURE_BATCH_BEGIN"            // asynParamInt32, R/W
+#define SPFeatureBatchCommitString          "SP_FEATURE_BATCH_COMMIT"           // asynParamInt32, R/W
+#define SPFeatureBatchActiveString          "SP_FEATURE_BATCH_ACTIVE"           // asynParamInt32, R/O
+#define SPFeatureBatchSizeString            "SP_FEATURE_BATCH_SIZE"             // asynParamInt32, R/O
+#define SPHardwareFrameCountString          "SP_HARDWARE_FRAME_COUNT"           // asynParamInt32, R/W
+#define SPHardwareFrameCountActiveString    "SP_HARDWARE_FRAME_COUNT_ACTIVE"    // asynParamInt32, R/O
+#define SPPreTriggerEnableString            "SP_PRETRIGGER_ENABLE"              // asynParamInt32, R/W
+#define SPPreTriggerCountString             "SP_PRETRIGGER_COUNT"               // asynParamInt32, R/W
+#define SPPostTriggerCountString            "SP_POSTTRIGGER_COUNT"              // asynParamInt32, R/W
+#define SPPreTriggerTriggerString           "SP_PRETRIGGER_TRIGGER"             // asynParamInt32, R/W
+#define SPPreTriggerStateString             "SP_PRETRIGGER_STATE"               // asynParamInt32, R/O
+#define SPPreTriggerFillString              "SP_PRETRIGGER_FILL"                // asynParamInt32, R/O
+#define SPBurstEnableString                 "SP_BURST_ENABLE"                   // asynParamInt32, R/W
+#define SPBurstCountString                  "SP_BURST_COUNT"                    // asynParamInt32, R/W
+#define SPBurstDrainQueueString             "SP_BURST_DRAIN_QUEUE"              // asynParamInt32, R/W
+#define SPBurstStateString                  "SP_BURST_STATE"                    // asynParamInt32, R/O
+#define SPBurstFramesString                 "SP_BURST_FRAMES"                   // asynParamInt32, R/O
+#define SPBurstFillRateString               "SP_BURST_FILL_RATE"                // asynParamFloat64, R/O
+#define SPBurstDrainRateString              "SP_BURST_DRAIN_RATE"               // asynParamFloat64, R/O
+#define SPChunkEnableString                 "SP_CHUNK_ENABLE"                   // asynParamInt32, R/W
+#define SPChunkSelectString                 "SP_CHUNK_SELECT"                   // asynParamUInt32Digital, R/W
+#define SPChunkActiveString                 "SP_CHUNK_ACTIVE"                   // asynParamInt32, R/O
+#define SPClockCorrelationString            "SP_CLOCK_CORRELATION"              // asynParamInt32, R/W
+#define SPClockLatchPeriodString            "SP_CLOCK_LATCH_PERIOD"             // asynParamFloat64, R/W
+#define SPClockOffsetString                 "SP_CLOCK_OFFSET"                   // asynParamFloat64, R/O
+#define SPClockDriftString                  "SP_CLOCK_DRIFT"                    // asynParamFloat64, R/O
+#define SPClockResidualString               "SP_CLOCK_RESIDUAL"                 // asynParamFloat64, R/O
+#define SPClockSamplesString                "SP_CLOCK_SAMPLES"                  // asynParamInt32, R/O
+#define SPPtpEnableString                   "SP_PTP_ENABLE"                     // asynParamInt32, R/W
+#define SPPtpStatusString                   "SP_PTP_STATUS"                     // asynParamOctet, R/O
+#define SPPtpLockedString                   "SP_PTP_LOCKED"                     // asynParamInt32, R/O
+#define SPPtpOffsetString                   "SP_PTP_OFFSET"                     // asynParamFloat64, R/O
+#define SPActionDeviceKeyString             "SP_ACTION_DEVICE_KEY"              // asynParamInt32, R/W
+#define SPActionGroupKeyString              "SP_ACTION_GROUP_KEY"               // asynParamInt32, R/W
+#define SPActionGroupMaskString             "SP_ACTION_GROUP_MASK"              // asynParamInt32, R/W
+#define SPActionDelayString                 "SP_ACTION_DELAY"                   // asynParamFloat64, R/W
+#define SPActionSendString                  "SP_ACTION_SEND"                    // asynParamInt32, R/W
+#define SPActionTimeString                  "SP_ACTION_TIME"                    // asynParamFloat64, R/O
+#define SPLinkNameString                    "SP_LINK_NAME"                      // asynParamOctet, R/W
+#define SPLinkDemandString                  "SP_LINK_DEMAND"                    // asynParamFloat64, R/O
+#define SPLinkAllocationString              "SP_LINK_ALLOCATION"                // asynParamFloat64, R/O
+#define SPLinkCapacityString                "SP_LINK_CAPACITY"                  // asynParamFloat64, R/O
+#define SPLinkPacketDelayString             "SP_LINK_PACKET_DELAY"              // asynParamInt32, R/O
+#define SPAutoTuneString                    "SP_AUTOTUNE"                       // asynParamInt32, R/W
+#define SPAutoTuneDwellString               "SP_AUTOTUNE_DWELL"                 // asynParamFloat64, R/W
+#define SPAutoTuneSaveString                "SP_AUTOTUNE_SAVE"                  // asynParamInt32, R/W
+#define SPAutoTuneUserSetString             "SP_AUTOTUNE_USER_SET"              // asynParamInt32, R/W
+#define SPAutoTuneSetDefaultString          "SP_AUTOTUNE_SET_DEFAULT"           // asynParamInt32, R/W
+#define SPAutoTuneStatusString              "SP_AUTOTUNE_STATUS"                // asynParamOctet, R/O
+#define SPAutoTunePacketSizeString          "SP_AUTOTUNE_PACKET_SIZE"           // asynParamInt32, R/O
+#define SPAutoTunePacketDelayString         "SP_AUTOTUNE_PACKET_DELAY"          // asynParamInt32, R/O
+#define SPAutoTuneThroughputString          "SP_AUTOTUNE_THROUGHPUT"            // asynParamFloat64, R/O
+#define SPAutoTuneErrorsString              "SP_AUTOTUNE_ERRORS"                // asynParamInt32, R/O
+#define SPBufferCountModeString             "SP_BUFFER_COUNT_MODE"              // asynParamInt32, R/W
+#define SPBufferLatencyString               "SP_BUFFER_LATENCY"                 // asynParamFloat64, R/W
+#define SPBufferMemoryLimitString           "SP_BUFFER_MEMORY_LIMIT"            // asynParamFloat64, R/W
+#define SPBufferCountRequestedString        "SP_BUFFER_COUNT_REQUESTED"         // asynParamInt32, R/O
+#define SPBufferCountActualString           "SP_BUFFER_COUNT_ACTUAL"            // asynParamInt32, R/O
+#define SPBufferCountMaxString              "SP_BUFFER_COUNT_MAX"               // asynParamInt32, R/O
+#define SPBufferHandlingModeString          "SP_BUFFER_HANDLING_MODE"           // asynParamInt32, R/W
+#define SPQueueSkippedString                "SP_QUEUE_SKIPPED"                  // asynParamInt32, R/O
+#define SPLatencyString                     "SP_LATENCY"                        // asynParamFloat64, R/O
+#define SPLatencyMeanString                 "SP_LATENCY_MEAN"                   // asynParamFloat64, R/O
+#define SPLatencyMaxString                  "SP_LATENCY_MAX"                    // asynParamFloat64, R/O
+#define SPBackpressureModeString            "SP_BACKPRESSURE_MODE"              // asynParamInt32, R/W
+#define SPBackpressureHighString            "SP_BACKPRESSURE_HIGH"              // asynParamFloat64, R/W
+#define SPBackpressureLowString             "SP_BACKPRESSURE_LOW"               // asynParamFloat64, R/W
+#define SPBackpressureMaxDecimationString   "SP_BACKPRESSURE_MAX_DECIMATION"    // asynParamInt32, R/W
+#define SPBackpressureLevelString           "SP_BACKPRESSURE_LEVEL"             // asynParamFloat64, R/O
+#define SPBackpressureActiveString          "SP_BACKPRESSURE_ACTIVE"            // asynParamInt32, R/O
+#define SPBackpressureDecimationString      "SP_BACKPRESSURE_DECIMATION"        // asynParamInt32, R/O
+#define SPBackpressureDroppedString         "SP_BACKPRESSURE_DROPPED"           // asynParamInt32, R/O
+#define SPCropXString                       "SP_CROP_X"                         // asynParamInt32, R/W
+#define SPCropYString                       "SP_CROP_Y"                         // asynParamInt32, R/W
+#define SPCropSizeXString                   "SP_CROP_SIZE_X"                    // asynParamInt32, R/W
+#define SPCropSizeYString                   "SP_CROP_SIZE_Y"                    // asynParamInt32, R/W
+#define SPFlipXString                       "SP_FLIP_X"                         // asynParamInt32, R/W
+#define SPFlipYString                       "SP_FLIP_Y"                         // asynParamInt32, R/W
+#define SPRotationString                    "SP_ROTATION"                       // asynParamInt32, R/W
+#define SPBitShiftString                    "SP_BIT_SHIFT"                      // asynParamInt32, R/W
+#define SPCopyTimeString                    "SP_COPY_TIME"                      // asynParamFloat64, R/O
+#define SPDarkEnableString                  "SP_DARK_ENABLE"                    // asynParamInt32, R/W
+#define SPFlatEnableString                  "SP_FLAT_ENABLE"                    // asynParamInt32, R/W
+#define SPCorrectionTypeString              "SP_CORRECTION_TYPE"                // asynParamInt32, R/W
+#define SPCorrectionActiveString            "SP_CORRECTION_ACTIVE"              // asynParamInt32, R/O
+#define SPCorrectionSimdString              "SP_CORRECTION_SIMD"                // asynParamOctet, R/O
+#define SPCorrectionStatusString            "SP_CORRECTION_STATUS"              // asynParamOctet, R/O
+#define SPReferenceFramesString             "SP_REFERENCE_FRAMES"               // asynParamInt32, R/W
+#define SPCollectDarkString                 "SP_COLLECT_DARK"                   // asynParamInt32, R/W
+#define SPCollectFlatString                 "SP_COLLECT_FLAT"                   // asynParamInt32, R/W
+#define SPCollectRemainingString            "SP_COLLECT_REMAINING"              // asynParamInt32, R/O
+#define SPDarkValidString                   "SP_DARK_VALID"                     // asynParamInt32, R/O
+#define SPFlatValidString                   "SP_FLAT_VALID"                     // asynParamInt32, R/O
+#define SPDarkFileString                    "SP_DARK_FILE"                      // asynParamOctet, R/W
+#define SPFlatFileString                    "SP_FLAT_FILE"                      // asynParamOctet, R/W
+#define SPLoadDarkString                    "SP_LOAD_DARK"                      // asynParamInt32, R/W
+#define SPLoadFlatString                    "SP_LOAD_FLAT"                      // asynParamInt32, R/W
+#define SPSaveDarkString                    "SP_SAVE_DARK"                      // asynParamInt32, R/W
+#define SPSaveFlatString                    "SP_SAVE_FLAT"                      // asynParamInt32, R/W
+#define SPDefectEnableString                "SP_DEFECT_ENABLE"                  // asynParamInt32, R/W
+#define SPDefectActiveString                "SP_DEFECT_ACTIVE"                  // asynParamInt32, R/O
+#define SPDefectCountString                 "SP_DEFECT_COUNT"                   // asynParamInt32, R/O
+#define SPHotThresholdString                "SP_HOT_THRESHOLD"                  // asynParamFloat64, R/W
+#define SPDeadThresholdString               "SP_DEAD_THRESHOLD"                 // asynParamFloat64, R/W
+#define SPDetectDefectsString               "SP_DETECT_DEFECTS"                 // asynParamInt32, R/W
+#define SPDefectFileString                  "SP_DEFECT_FILE"                    // asynParamOctet, R/W
+#define SPLoadDefectsString                 "SP_LOAD_DEFECTS"                   // asynParamInt32, R/W
+#define SPSaveDefectsString                 "SP_SAVE_DEFECTS"                   // asynParamInt32, R/W
+#define SPAccumulateEnableString            "SP_ACCUMULATE_ENABLE"              // asynParamInt32, R/W
+#define SPAccumulateFramesString            "SP_ACCUMULATE_FRAMES"              // asynParamInt32, R/W
+#define SPAccumulateTypeString              "SP_ACCUMULATE_TYPE"                // asynParamInt32, R/W
+#define SPAccumulateModeString              "SP_ACCUMULATE_MODE"                // asynParamInt32, R/W
+#define SPAccumulateCountString             "SP_ACCUMULATE_COUNT"               // asynParamInt32, R/O
+#define SPStatsEnableString                 "SP_STATS_ENABLE"                   // asynParamInt32, R/W
+#define SPStatsRateString                   "SP_STATS_RATE"                     // asynParamFloat64, R/W
+#define SPHistSizeString                    "SP_HIST_SIZE"                      // asynParamInt32, R/W
+#define SPHistMinString                     "SP_HIST_MIN"                       // asynParamFloat64, R/W
+#define SPHistMaxString                     "SP_HIST_MAX"                       // asynParamFloat64, R/W
+#define SPSaturationLevelString             "SP_SATURATION_LEVEL"               // asynParamFloat64, R/W
+#define SPStatsMinString                    "SP_STATS_MIN"                      // asynParamFloat64, R/O
+#define SPStatsMaxString                    "SP_STATS_MAX"                      // asynParamFloat64, R/O
+#define SPStatsMeanString                   "SP_STATS_MEAN"                     // asynParamFloat64, R/O
+#define SPStatsSigmaString                  "SP_STATS_SIGMA"                    // asynParamFloat64, R/O
+#define SPStatsSaturatedString              "SP_STATS_SATURATED"                // asynParamInt32, R/O
+#define SPHistogramString                   "SP_HISTOGRAM"                      // asynParamFloat64Array, R/O
+#define SPCentroidEnableString              "SP_CENTROID_ENABLE"                // asynParamInt32, R/W
+#define SPCentroidOnlyString                "SP_CENTROID_ONLY"                  // asynParamInt32, R/W
+#define SPCentroidThresholdString           "SP_CENTROID_THRESHOLD"             // asynParamFloat64, R/W
+#define SPCentroidMinXString                "SP_CENTROID_MIN_X"                 // asynParamInt32, R/W
+#define SPCentroidMinYString                "SP_CENTROID_MIN_Y"                 // asynParamInt32, R/W
+#define SPCentroidSizeXString               "SP_CENTROID_SIZE_X"                // asynParamInt32, R/W
+#define SPCentroidSizeYString               "SP_CENTROID_SIZE_Y"                // asynParamInt32, R/W
+#define SPCentroidTotalString               "SP_CENTROID_TOTAL"                 // asynParamFloat64, R/O
+#define SPCentroidXString                   "SP_CENTROID_X"                     // asynParamFloat64, R/O
+#define SPCentroidYString                   "SP_CENTROID_Y"                     // asynParamFloat64, R/O
+#define SPSigmaXString                      "SP_SIGMA_X"                        // asynParamFloat64, R/O
+#define SPSigmaYString                      "SP_SIGMA_Y"                        // asynParamFloat64, R/O
+#define SPSigmaXYString                     "SP_SIGMA_XY"                       // asynParamFloat64, R/O
+#define SPPeakXString                       "SP_PEAK_X"                         // asynParamInt32, R/O
+#define SPPeakYString                       "SP_PEAK_Y"                         // asynParamInt32, R/O
+#define SPPeakValueString                   "SP_PEAK_VALUE"                     // asynParamFloat64, R/O
+
+class SPFeature;
+class SPPreview;
 
 class ADSpinnakerImageEventHandler : public ImageEventHandler
 {
@@ -60,8 +215,10 @@ public:
                 size_t maxMemory, int priority, int stackSize);
 
     // virtual methods to override from ADGenICam
-    //virtual asynStatus writeInt32( asynUser *pasynUser, epicsInt32 value);
-    //virtual asynStatus writeFloat64( asynUser *pasynUser, epicsFloat64 value);
+    virtual asynStatus writeInt32( asynUser *pasynUser, epicsInt32 value);
+    virtual asynStatus writeInt64( asynUser *pasynUser, epicsInt64 value);
+    virtual asynStatus writeFloat64( asynUser *pasynUser, epicsFloat64 value);
+    virtual asynStatus writeOctet(asynUser *pasynUser, const char *value, size_t nChars, size_t *nActual);
     virtual asynStatus readEnum(asynUser *pasynUser, char *strings[], int values[], int severities[], 
                                 size_t nElements, size_t *nIn);
     void report(FILE *fp, int details);
@@ -69,10 +226,16 @@ public:
                                           std::string const & asynName, asynParamType asynType, int asynIndex,
                                           std::string const & featureName, GCFeatureType_t featureType);
     INodeMap *getNodeMap();
+    void setPreview(SPPreview *pPreview);
     
     /**< These should be private but are called from C callback functions, must be public. */
     void imageGrabTask();
+    void featureTask();
+    void featureIOTask();
+    void autoTuneTask();
+    void featureChanged();
     void shutdown();
+    void setLinkAllocation(double allocation, double capacity);
 
 private:
     int SPConvertPixelFormat;
@@ -91,17 +254,218 @@ private:
     int SPResendReceivedPacketCount;
     int SPTimeStampMode;
     int SPUniqueIdMode;
+    int SPFeatureRefreshTime;
+    int SPFeatureRefreshCount;
+    int SPFeaturePollPeriod;
+    int SPFeatureBatchBegin;
+    int SPFeatureBatchCommit;
+    int SPFeatureBatchActive;
+    int SPFeatureBatchSize;
+    int SPHardwareFrameCount;
+    int SPHardwareFrameCountActive;
+    int SPPreTriggerEnable;
+    int SPPreTriggerCount;
+    int SPPostTriggerCount;
+    int SPPreTriggerTrigger;
+    int SPPreTriggerState;
+    int SPPreTriggerFill;
+    int SPBurstEnable;
+    int SPBurstCount;
+    int SPBurstDrainQueue;
+    int SPBurstState;
+    int SPBurstFrames;
+    int SPBurstFillRate;
+    int SPBurstDrainRate;
+    int SPChunkEnable;
+    int SPChunkSelect;
+    int SPChunkActive;
+    int SPClockCorrelation;
+    int SPClockLatchPeriod;
+    int SPClockOffset;
+    int SPClockDrift;
+    int SPClockResidual;
+    int SPClockSamples;
+    int SPPtpEnable;
+    int SPPtpStatus;
+    int SPPtpLocked;
+    int SPPtpOffset;
+    int SPActionDeviceKey;
+    int SPActionGroupKey;
+    int SPActionGroupMask;
+    int SPActionDelay;
+    int SPActionSend;
+    int SPActionTime;
+    int SPLinkName;
+    int SPLinkDemand;
+    int SPLinkAllocation;
+    int SPLinkCapacity;
+    int SPLinkPacketDelay;
+    int SPAutoTune;
+    int SPAutoTuneDwell;
+    int SPAutoTuneSave;
+    int SPAutoTuneUserSet;
+    int SPAutoTuneSetDefault;
+    int SPAutoTuneStatus;
+    int SPAutoTunePacketSize;
+    int SPAutoTunePacketDelay;
+    int SPAutoTuneThroughput;
+    int SPAutoTuneErrors;
+    int SPBufferCountMode;
+    int SPBufferLatency;
+    int SPBufferMemoryLimit;
+    int SPBufferCountRequested;
+    int SPBufferCountActual;
+    int SPBufferCountMax;
+    int SPBufferHandlingMode;
+    int SPQueueSkipped;
+    int SPLatency;
+    int SPLatencyMean;
+    int SPLatencyMax;
+    int SPBackpressureMode;
+    int SPBackpressureHigh;
+    int SPBackpressureLow;
+    int SPBackpressureMaxDecimation;
+    int SPBackpressureLevel;
+    int SPBackpressureActive;
+    int SPBackpressureDecimation;
+    int SPBackpressureDropped;
+    int SPCropX;
+    int SPCropY;
+    int SPCropSizeX;
+    int SPCropSizeY;
+    int SPFlipX;
+    int SPFlipY;
+    int SPRotation;
+    int SPBitShift;
+    int SPCopyTime;
+    int SPDarkEnable;
+    int SPFlatEnable;
+    int SPCorrectionType;
+    int SPCorrectionActive;
+    int SPCorrectionSimd;
+    int SPCorrectionStatus;
+    int SPReferenceFrames;
+    int SPCollectDark;
+    int SPCollectFlat;
+    int SPCollectRemaining;
+    int SPDarkValid;
+    int SPFlatValid;
+    int SPDarkFile;
+    int SPFlatFile;
+    int SPLoadDark;
+    int SPLoadFlat;
+    int SPSaveDark;
+    int SPSaveFlat;
+    int SPDefectEnable;
+    int SPDefectActive;
+    int SPDefectCount;
+    int SPHotThreshold;
+    int SPDeadThreshold;
+    int SPDetectDefects;
+    int SPDefectFile;
+    int SPLoadDefects;
+    int SPSaveDefects;
+    int SPAccumulateEnable;
+    int SPAccumulateFrames;
+    int SPAccumulateType;
+    int SPAccumulateMode;
+    int SPAccumulateCount;
+    int SPStatsEnable;
+    int SPStatsRate;
+    int SPHistSize;
+    int SPHistMin;
+    int SPHistMax;
+    int SPSaturationLevel;
+    int SPStatsMin;
+    int SPStatsMax;
+    int SPStatsMean;
+    int SPStatsSigma;
+    int SPStatsSaturated;
+    int SPHistogram;
+    int SPCentroidEnable;
+    int SPCentroidOnly;
+    int SPCentroidThreshold;
+    int SPCentroidMinX;
+    int SPCentroidMinY;
+    int SPCentroidSizeX;
+    int SPCentroidSizeY;
+    int SPCentroidTotal;
+    int SPCentroidX;
+    int SPCentroidY;
+    int SPSigmaX;
+    int SPSigmaY;
+    int SPSigmaXY;
+    int SPPeakX;
+    int SPPeakY;
+    int SPPeakValue;
     int SPFrameRateEnable;
 
+    // Description of a raw image, either held by Spinnaker or copied into the burst arena
+    typedef struct {
+        size_t width;
+        size_t height;
+        PixelFormatEnums pixelFormat;
+        size_t bufferSize;
+        uint64_t frameID;
+        uint64_t timeStamp;
+        epicsTimeStamp epicsTS;
+    } SPImageInfo_t;
+
     /* Local methods to this class */
-    asynStatus grabImage();
+    asynStatus grabImage(ImagePtr &pImage, epicsTimeStamp &epicsTS);
+    asynStatus processImage(ImagePtr pImage, epicsTimeStamp &epicsTS);
+    bool convertImage(ImagePtr &pImage);
+    void configureFrameProcessor();
+    asynStatus referenceCommand(int function);
+    void updateReferenceStatus();
+    asynStatus defectCommand(int function);
+    void updateStatistics();
+    void updateCentroid();
+    asynStatus copyImage(SPImageInfo_t &info, void *pData);
+    void publishImage();
+    asynStatus preTriggerImage(ImagePtr pImage, epicsTimeStamp &epicsTS);
+    void armPreTrigger();
+    void releasePreTriggerImages(size_t keep);
+    asynStatus armBurst();
+    asynStatus burstImage(ImagePtr pImage, epicsTimeStamp &epicsTS);
+    void drainBurst();
+    void configureChunks();
+    void readChunks(ImagePtr pImage);
+    void addChunkAttributes(NDAttributeList *pAttributeList);
+    void latchClock();
+    bool readCameraTime(epicsInt64 *pCameraTime, epicsTimeStamp *pHostTime);
+    INode *findNode(const char *name, const char *altName);
+    void enablePtp(bool enable);
+    void pollPtp();
+    void configureActions();
+    asynStatus sendActionCommand();
+    void updateLinkDemand();
+    void applyLinkAllocation();
+    asynStatus autoTune();
+    int setStreamBufferCount(int count);
+    void configureBufferCount();
+    void configureBufferHandling();
+    double backpressureLevel();
+    bool checkBackpressure();
+    bool measureStream(double dwell, int packetSize, double *pThroughput, int *pErrors);
+    void setAutoTuneStatus(const char *status);
     asynStatus startCapture();
     asynStatus stopCapture();
     asynStatus connectCamera();
+    void setHardwareFrameCount();
+    bool hardwareFrameCountDone(bool timedOut);
+    void restoreAcquisitionMode();
     asynStatus disconnectCamera();
     void imageEventCallback(ImagePtr pImage);
     void reportNode(FILE *fp, INodeMap *pNodeMap, gcstring nodeName, int level);
     void updateStreamStat(const char *nodeName, int param);
+    bool isQueuedMappedParam(int param);
+    SPFeature *getQueuedFeature(int param);
+    void queueFeatureWrite(SPFeature *pFeature, asynParamType valueType, epicsInt64 intValue, double doubleValue);
+    asynStatus writeFeatureValue(SPFeature *pFeature, asynParamType valueType, epicsInt64 intValue, double doubleValue);
+    void flushFeatureWrites();
+    int refreshFeatures(std::set<SPFeature *> &written);
+    std::vector<SPFeature *> & getDependents(SPFeature *pFeature);
 
     /* Data */
     int cameraId_;
@@ -112,13 +476,123 @@ private:
     CameraList camList_;
     CameraPtr pCamera_;
     int numSPBuffers_;
+    int streamBufferCount_;
+    int streamBufferCountMax_;
     ImageEventHandler *pImageEventHandler_;
+    std::vector<SPFeature *> spFeatures_;
+    std::map<std::string, std::vector<SPFeature *> > spFeatureNodeMap_;
+    std::map<int, SPFeature *> spQueuedFeatureMap_;
+    std::map<SPFeature *, std::vector<SPFeature *> > spFeatureDependents_;
+
+    // Writes to GC_ and mapped features are queued to featureIOTask so that register access
+    // is done without holding the driver lock
+    typedef struct {
+        SPFeature *pFeature;
+        asynParamType valueType;
+        epicsInt64 intValue;
+        double doubleValue;
+    } SPFeatureWrite_t;
+    std::deque<SPFeatureWrite_t> featureWriteQueue_;
+    epicsMutexId featureWriteMutex_;
+    // Held by featureIOTask while it does a write, so flushFeatureWrites() can wait for it
+    epicsMutexId featureIOMutex_;
+    bool featureBatchActive_;
+    epicsEventId featureIOEventId_;
 
     int exiting_;
     epicsEventId startEventId_;
+    epicsEventId featureEventId_;
+    // Signalled by featureTask and featureIOTask when they exit, so shutdown() can wait for them
+    epicsEventId featureTaskDoneEventId_;
+    epicsEventId featureIOTaskDoneEventId_;
     epicsMessageQueue *pCallbackMsgQ_;
     NDArray *pRaw_;
     int uniqueId_;
+
+    // Hardware frame count in Single and Multiple image modes
+    bool hwFrameCountActive_;
+    int hwFrameCount_;
+    int streamFrameCount_;
+    bool hwAcquisitionStopped_;
+    gcstring savedAcquisitionMode_;
+
+    // Pre-trigger ring of raw images that are still held in the transport layer
+    typedef struct {
+        ImagePtr pImage;
+        epicsTimeStamp epicsTS;
+    } SPHeldImage_t;
+    std::deque<SPHeldImage_t> preTriggerImages_;
+    int preTriggerState_;
+    size_t preTriggerCount_;
+    bool preTriggerFired_;
+    int postTriggerRemaining_;
+
+    // Burst arena.  Images are copied raw into fixed size slots and published after the burst.
+    int burstState_;
+    char *burstArena_;
+    size_t burstArenaSize_;
+    size_t burstSlotSize_;
+    size_t burstCount_;
+    std::vector<SPImageInfo_t> burstImages_;
+
+    // Chunks enabled for this acquisition, as indexes into the driver's chunk table, and their values
+    // for the image being processed
+    std::vector<int> activeChunks_;
+    std::vector<epicsInt64> chunkIntegers_;
+    std::vector<double> chunkDoubles_;
+    bool chunksValid_;
+    bool chunkModeSet_;
+
+    // Correlation of the camera clock with the host clock, updated by featureTask
+    SPClockCorrelator clockCorrelator_;
+    SPFrameProcessor frameProcessor_;
+
+    // Share of the network link set by SPBandwidthManager.  linkMutex_ protects these because the
+    // allocation is set from the thread of whichever camera on the link changed its demand.
+    epicsMutexId linkMutex_;
+    std::string linkName_;
+    std::string linkNameApplied_;
+    double linkDemand_;
+    double linkAllocation_;
+    double linkCapacity_;
+    bool linkAllocationPending_;
+
+    // Set while autoTuneTask is running
+    bool autoTuneActive_;
+
+    // StreamBufferHandlingMode for this acquisition.  With NewestOnly grabImage also skips
+    // all but the newest image in the driver's message queue.
+    int bufferHandlingMode_;
+    int queueSkipped_;
+
+    // Time the image being processed was taken, or received if the camera clock is not correlated,
+    // from which publishImage() measures the latency
+    epicsTimeStamp latencyStart_;
+    bool latencyValid_;
+    int latencyCount_;
+    double latencySum_;
+    double latencyMax_;
+
+    // Response to the plugins falling behind.  Images are dropped before they are converted or copied.
+    bool backpressureActive_;
+    int decimation_;
+    int decimationCounter_;
+    int backpressureDropped_;
+
+    // Frames in the sum that frameProcessor_ is accumulating.  The accumulated NDArray has the uniqueId
+    // and timestamps of the first frame.
+    std::string accumulateFrameIDs_;
+    int accumulateFrames_;
+    int accumulateUniqueId_;
+    epicsTimeStamp accumulateEpicsTS_;
+    double accumulateFirstTime_;
+    double accumulateLastTime_;
+
+    // Time the statistics parameters were last updated
+    epicsTimeStamp statsUpdateTime_;
+
+    // Optional preview port that is passed each published NDArray
+    SPPreview *pPreview_;
 };
 
 #endif
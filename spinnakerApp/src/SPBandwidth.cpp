@@ -0,0 +1,160 @@
+// SPBandwidth.cpp
+// Sharing of a network link among several cameras
+
+#include <algorithm>
+#include <vector>
+
+#include <epicsGuard.h>
+#include <iocsh.h>
+
+#include <epicsExport.h>
+#include <SPBandwidth.h>
+#include <ADSpinnaker.h>
+
+// A link that was not configured with SPLinkConfig is assumed to be Gigabit Ethernet
+#define DEFAULT_LINK_CAPACITY 125e6
+#define DEFAULT_LINK_RESERVE  0.1
+
+SPBandwidthManager::SPBandwidthManager()
+{
+}
+
+SPBandwidthManager *SPBandwidthManager::getInstance(void)
+{
+    static SPBandwidthManager *pInstance = new SPBandwidthManager();
+
+    return pInstance;
+}
+
+/** Sets the capacity of a link in bytes/s, and the fraction of it that is not allocated to the cameras */
+void SPBandwidthManager::configureLink(std::string const & linkName, double capacity, double reserve)
+{
+    epicsGuard<epicsMutex> guard(mMutex);
+    SPLink_t link;
+
+    link.capacity = capacity;
+    link.reserve = reserve;
+    mLinks[linkName] = link;
+    allocate(linkName);
+}
+
+/** Sets the payload rate that a camera needs on a link.  An empty linkName removes the camera. */
+void SPBandwidthManager::setDemand(ADSpinnaker *pCamera, std::string const & linkName, double demand)
+{
+    epicsGuard<epicsMutex> guard(mMutex);
+    std::map<ADSpinnaker *, SPLinkClient_t>::iterator it = mClients.find(pCamera);
+    std::string oldLink;
+
+    if (it != mClients.end()) {
+        oldLink = it->second.linkName;
+        if (linkName.empty()) mClients.erase(it);
+    }
+    if (!linkName.empty()) {
+        SPLinkClient_t &client = mClients[pCamera];
+        client.linkName = linkName;
+        client.demand = demand;
+        allocate(linkName);
+    }
+    // The cameras left on the old link can have its bandwidth
+    if (!oldLink.empty() && (oldLink != linkName)) allocate(oldLink);
+}
+
+void SPBandwidthManager::removeCamera(ADSpinnaker *pCamera)
+{
+    setDemand(pCamera, "", 0.);
+}
+
+double SPBandwidthManager::getCapacity(std::string const & linkName)
+{
+    epicsGuard<epicsMutex> guard(mMutex);
+    std::map<std::string, SPLink_t>::iterator it = mLinks.find(linkName);
+
+    return (it == mLinks.end()) ? DEFAULT_LINK_CAPACITY : it->second.capacity;
+}
+
+/** Recomputes the allocations of the cameras on a link and passes them to the cameras.
+  * Must be called with mMutex held.  ADSpinnaker::setLinkAllocation() does not take the driver lock,
+  * so this can be called from any camera's thread. */
+void SPBandwidthManager::allocate(std::string const & linkName)
+{
+    std::vector<std::pair<double, SPLinkClient_t *> > clients;
+    std::map<std::string, SPLink_t>::iterator link = mLinks.find(linkName);
+    double capacity = (link == mLinks.end()) ? DEFAULT_LINK_CAPACITY : link->second.capacity;
+    double reserve = (link == mLinks.end()) ? DEFAULT_LINK_RESERVE : link->second.reserve;
+    double available = capacity * (1. - reserve);
+    double totalDemand = 0.;
+    double remaining;
+    size_t i;
+
+    for (std::map<ADSpinnaker *, SPLinkClient_t>::iterator it = mClients.begin(); it != mClients.end(); ++it) {
+        if (it->second.linkName != linkName) continue;
+        clients.push_back(std::make_pair(it->second.demand, &it->second));
+        totalDemand += it->second.demand;
+    }
+    if (clients.empty()) return;
+    if (totalDemand <= available) {
+        double spare = available - totalDemand;
+        for (i=0; i<clients.size(); i++) {
+            SPLinkClient_t *pClient = clients[i].second;
+            pClient->allocation = (totalDemand > 0) ?
+                pClient->demand + spare * pClient->demand / totalDemand :
+                available / clients.size();
+        }
+    } else {
+        // Max-min fair: serve the smallest demands first
+        std::sort(clients.begin(), clients.end());
+        remaining = available;
+        for (i=0; i<clients.size(); i++) {
+            SPLinkClient_t *pClient = clients[i].second;
+            double share = remaining / (clients.size() - i);
+            pClient->allocation = std::min(pClient->demand, share);
+            remaining -= pClient->allocation;
+        }
+    }
+    for (std::map<ADSpinnaker *, SPLinkClient_t>::iterator it = mClients.begin(); it != mClients.end(); ++it) {
+        if (it->second.linkName != linkName) continue;
+        it->first->setLinkAllocation(it->second.allocation, capacity);
+    }
+}
+
+void SPBandwidthManager::report(FILE *fp)
+{
+    epicsGuard<epicsMutex> guard(mMutex);
+
+    for (std::map<ADSpinnaker *, SPLinkClient_t>::iterator it = mClients.begin(); it != mClients.end(); ++it) {
+        fprintf(fp, "  link %s: demand %.1f MB/s, allocation %.1f MB/s\n",
+            it->second.linkName.c_str(), it->second.demand / 1e6, it->second.allocation / 1e6);
+    }
+}
+
+extern "C" int SPLinkConfig(const char *linkName, double capacity, double reserve)
+{
+    if (!linkName || !linkName[0]) {
+        printf("SPLinkConfig: a link name is required\n");
+        return -1;
+    }
+    SPBandwidthManager::getInstance()->configureLink(linkName, capacity * 1e6, reserve / 100.);
+    return 0;
+}
+
+static const iocshArg linkConfigArg0 = {"Link name", iocshArgString};
+static const iocshArg linkConfigArg1 = {"Capacity (MB/s)", iocshArgDouble};
+static const iocshArg linkConfigArg2 = {"Reserve (%)", iocshArgDouble};
+static const iocshArg * const linkConfigArgs[] = {&linkConfigArg0,
+                                                  &linkConfigArg1,
+                                                  &linkConfigArg2};
+static const iocshFuncDef configSPLink = {"SPLinkConfig", 3, linkConfigArgs};
+static void linkConfigCallFunc(const iocshArgBuf *args)
+{
+    SPLinkConfig(args[0].sval, args[1].dval, args[2].dval);
+}
+
+
+static void SPBandwidthRegister(void)
+{
+    iocshRegister(&configSPLink, linkConfigCallFunc);
+}
+
+extern "C" {
+epicsExportRegistrar(SPBandwidthRegister);
+}
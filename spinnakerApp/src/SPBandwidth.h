@@ -0,0 +1,51 @@
+#ifndef SP_BANDWIDTH_H
+#define SP_BANDWIDTH_H
+
+#include <stdio.h>
+
+#include <map>
+#include <string>
+
+#include <epicsMutex.h>
+
+class ADSpinnaker;
+
+/** Shares the bandwidth of a network link among the cameras that stream over it.
+  * Each camera reports the payload rate it needs.  If the link can carry all of them every camera gets
+  * its demand, plus a share of the spare capacity in proportion to its demand so that the packets
+  * of all cameras are spread out in time.  Otherwise the capacity is shared max-min fairly:
+  * cameras that need less than an equal share get what they need, and the rest split what is left.
+  * The allocations are recomputed whenever a camera's demand changes, and passed to every camera on
+  * the link with ADSpinnaker::setLinkAllocation().  Rates are in bytes/s.  The methods are thread safe.
+  */
+class SPBandwidthManager
+{
+public:
+    static SPBandwidthManager *getInstance(void);
+    void configureLink(std::string const & linkName, double capacity, double reserve);
+    void setDemand(ADSpinnaker *pCamera, std::string const & linkName, double demand);
+    void removeCamera(ADSpinnaker *pCamera);
+    double getCapacity(std::string const & linkName);
+    void report(FILE *fp);
+
+private:
+    SPBandwidthManager();
+    void allocate(std::string const & linkName);
+
+    typedef struct {
+        std::string linkName;
+        double demand;
+        double allocation;
+    } SPLinkClient_t;
+
+    typedef struct {
+        double capacity;
+        double reserve;
+    } SPLink_t;
+
+    epicsMutex mMutex;
+    std::map<std::string, SPLink_t> mLinks;
+    std::map<ADSpinnaker *, SPLinkClient_t> mClients;
+};
+
+#endif
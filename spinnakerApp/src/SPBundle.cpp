@@ -0,0 +1,473 @@
+// SPBundle.cpp
+// Bundles the NDArrays from several synchronized ADSpinnaker cameras
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <epicsString.h>
+#include <iocsh.h>
+#include <asynDrvUser.h>
+
+#include <epicsExport.h>
+#include <SPBundle.h>
+
+static const char *driverName = "SPBundle";
+
+typedef enum {
+    SPBMatchTimeStamp,
+    SPBMatchEPICSTimeStamp,
+    SPBMatchUniqueId
+} SPBMatchMode_t;
+
+typedef enum {
+    SPBOutputStack,
+    SPBOutputSeparate
+} SPBOutputMode_t;
+
+#define DEFAULT_MAX_PENDING 10
+
+static void arrayCallbackC(void *userPvt, asynUser *, void *genericPointer)
+{
+    SPBundleInput_t *pInput = (SPBundleInput_t *)userPvt;
+    pInput->pBundle->arrayCallback(pInput->index, (NDArray *)genericPointer);
+}
+
+/** Returns the number of ports in a list separated by spaces or commas.
+  * This is needed before the base class constructor, which takes the number of addresses. */
+static int countInputPorts(const char *inputPorts)
+{
+    char *ports = epicsStrDup(inputPorts ? inputPorts : "");
+    char *lasts;
+    int count = 0;
+
+    for (char *port = epicsStrtok_r(ports, " ,", &lasts); port; port = epicsStrtok_r(NULL, " ,", &lasts)) {
+        count++;
+    }
+    free(ports);
+    return (count > 0) ? count : 1;
+}
+
+extern "C" int SPBundleConfig(const char *portName, const char *inputPorts,
+                              int maxBuffers, size_t maxMemory,
+                              int priority, int stackSize)
+{
+    new SPBundle(portName, inputPorts, maxBuffers, maxMemory, priority, stackSize);
+    return asynSuccess;
+}
+
+/** Constructor for the SPBundle class.
+  * \param[in] portName The name of the asyn port to be created.
+  * \param[in] inputPorts The NDArray ports of the cameras to bundle, separated by spaces or commas.
+  *            Arrays are received from address 0 of each port.
+  * \param[in] maxBuffers The maximum number of NDArray buffers that the NDArrayPool for this driver is
+  *            allowed to allocate. Set this to 0 to allow an unlimited number of buffers.
+  * \param[in] maxMemory The maximum amount of memory that the NDArrayPool for this driver is
+  *            allowed to allocate. Set this to 0 to allow an unlimited amount of memory.
+  * \param[in] priority The thread priority for the asyn port driver thread.
+  * \param[in] stackSize The stack size for the asyn port driver thread.
+  */
+SPBundle::SPBundle(const char *portName, const char *inputPorts, int maxBuffers, size_t maxMemory,
+                   int priority, int stackSize)
+    : asynNDArrayDriver(portName,
+                        // One address per input, the input ports are counted first
+                        countInputPorts(inputPorts),
+                        maxBuffers, maxMemory,
+                        asynInt32Mask | asynFloat64Mask | asynOctetMask | asynGenericPointerMask | asynDrvUserMask,
+                        asynInt32Mask | asynFloat64Mask | asynOctetMask | asynGenericPointerMask,
+                        ASYN_MULTIDEVICE, 1, priority, stackSize),
+      bundleCount_(0)
+{
+    char *ports = epicsStrDup(inputPorts ? inputPorts : "");
+    char *lasts;
+    char *port;
+    int i;
+    static const char *functionName = "SPBundle";
+
+    createParam(SPBMatchModeString,         asynParamInt32,   &SPBMatchMode);
+    createParam(SPBToleranceString,         asynParamFloat64, &SPBTolerance);
+    createParam(SPBOutputModeString,        asynParamInt32,   &SPBOutputMode);
+    createParam(SPBMaxPendingString,        asynParamInt32,   &SPBMaxPending);
+    createParam(SPBNumInputsString,         asynParamInt32,   &SPBNumInputs);
+    createParam(SPBBundleCountString,       asynParamInt32,   &SPBBundleCount);
+    createParam(SPBResetStatsString,        asynParamInt32,   &SPBResetStats);
+    createParam(SPBInputPortString,         asynParamOctet,   &SPBInputPort);
+    createParam(SPBInputConnectedString,    asynParamInt32,   &SPBInputConnected);
+    createParam(SPBPendingString,           asynParamInt32,   &SPBPending);
+    createParam(SPBUnmatchedString,         asynParamInt32,   &SPBUnmatched);
+    createParam(SPBSkewString,              asynParamFloat64, &SPBSkew);
+    createParam(SPBSkewMeanString,          asynParamFloat64, &SPBSkewMean);
+    createParam(SPBSkewMaxString,           asynParamFloat64, &SPBSkewMax);
+
+    setIntegerParam(SPBMatchMode, SPBMatchTimeStamp);
+    setDoubleParam(SPBTolerance, 0.001);
+    setIntegerParam(SPBOutputMode, SPBOutputStack);
+    setIntegerParam(SPBMaxPending, DEFAULT_MAX_PENDING);
+    setIntegerParam(SPBBundleCount, 0);
+    setIntegerParam(SPBResetStats, 0);
+    setStringParam(NDPortNameSelf, portName);
+
+    for (port = epicsStrtok_r(ports, " ,", &lasts); port; port = epicsStrtok_r(NULL, " ,", &lasts)) {
+        SPBundleInput_t *pInput = new SPBundleInput_t;
+        pInput->pBundle = this;
+        pInput->index = (int)inputs_.size();
+        pInput->portName = port;
+        pInput->pasynUser = 0;
+        pInput->interruptPvt = 0;
+        inputs_.push_back(pInput);
+    }
+    free(ports);
+    setIntegerParam(SPBNumInputs, (int)inputs_.size());
+
+    for (i=0; i<(int)inputs_.size(); i++) {
+        SPBundleInput_t *pInput = inputs_[i];
+        setStringParam(i, SPBInputPort, pInput->portName);
+        setIntegerParam(i, SPBPending, 0);
+        if (connectInput(pInput)) {
+            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s::%s cannot connect to NDArray port %s\n",
+                driverName, functionName, pInput->portName.c_str());
+        }
+        setIntegerParam(i, SPBInputConnected, pInput->interruptPvt != 0);
+    }
+    resetStats();
+    for (i=0; i<(int)inputs_.size(); i++) {
+        callParamCallbacks(i);
+    }
+}
+
+SPBundle::~SPBundle()
+{
+    // The callbacks are cancelled before taking the lock.  cancelInterruptUser() waits for the port's
+    // interrupt lock, which a camera driver holds while its callback waits for this lock.
+    for (size_t i=0; i<inputs_.size(); i++) {
+        SPBundleInput_t *pInput = inputs_[i];
+        if (pInput->interruptPvt) {
+            pInput->pasynGenericPointer->cancelInterruptUser(pInput->asynGenericPointerPvt,
+                                                             pInput->pasynUser, pInput->interruptPvt);
+            pInput->interruptPvt = 0;
+        }
+    }
+    lock();
+    for (size_t i=0; i<inputs_.size(); i++) {
+        SPBundleInput_t *pInput = inputs_[i];
+        if (pInput->pasynUser) {
+            pasynManager->disconnect(pInput->pasynUser);
+            pasynManager->freeAsynUser(pInput->pasynUser);
+        }
+        dropPending(pInput);
+        delete pInput;
+    }
+    unlock();
+}
+
+/** Registers for the NDArray callbacks on address 0 of an input port, in the same way as NDPluginDriver.
+  * The callbacks run in the thread of the camera driver that does the callbacks. */
+asynStatus SPBundle::connectInput(SPBundleInput_t *pInput)
+{
+    asynInterface *pasynInterface;
+    asynDrvUser *pasynDrvUser;
+    asynStatus status;
+
+    pInput->pasynUser = pasynManager->createAsynUser(0, 0);
+    status = pasynManager->connectDevice(pInput->pasynUser, pInput->portName.c_str(), 0);
+    if (status) return status;
+    pasynInterface = pasynManager->findInterface(pInput->pasynUser, asynGenericPointerType, 1);
+    if (!pasynInterface) return asynError;
+    pInput->pasynGenericPointer = (asynGenericPointer *)pasynInterface->pinterface;
+    pInput->asynGenericPointerPvt = pasynInterface->drvPvt;
+    pasynInterface = pasynManager->findInterface(pInput->pasynUser, asynDrvUserType, 1);
+    if (!pasynInterface) return asynError;
+    pasynDrvUser = (asynDrvUser *)pasynInterface->pinterface;
+    status = pasynDrvUser->create(pasynInterface->drvPvt, pInput->pasynUser, NDArrayDataString, NULL, NULL);
+    if (status) return status;
+    return pInput->pasynGenericPointer->registerInterruptUser(pInput->asynGenericPointerPvt, pInput->pasynUser,
+                                                              arrayCallbackC, pInput,
+                                                              &pInput->interruptPvt);
+}
+
+/** Called with each new NDArray from an input.  The array is held until arrays from all the inputs
+  * that match it have arrived, or until it can no longer be matched.  This never calls the input driver,
+  * so it is safe while that driver holds its lock. */
+void SPBundle::arrayCallback(int input, NDArray *pArray)
+{
+    SPBundleInput_t *pInput = inputs_[input];
+    int maxPending;
+    int unmatched;
+    int i;
+
+    lock();
+    getIntegerParam(SPBMaxPending, &maxPending);
+    if (maxPending < 1) maxPending = 1;
+    pArray->reserve();
+    pInput->pending.push_back(pArray);
+    while ((int)pInput->pending.size() > maxPending) {
+        pInput->pending.front()->release();
+        pInput->pending.pop_front();
+        getIntegerParam(input, SPBUnmatched, &unmatched);
+        setIntegerParam(input, SPBUnmatched, unmatched+1);
+    }
+    matchBundles();
+    for (i=0; i<(int)inputs_.size(); i++) {
+        setIntegerParam(i, SPBPending, (int)inputs_[i]->pending.size());
+        callParamCallbacks(i);
+    }
+    unlock();
+}
+
+double SPBundle::matchKey(NDArray *pArray, int matchMode)
+{
+    switch (matchMode) {
+        case SPBMatchEPICSTimeStamp:
+            return pArray->epicsTS.secPastEpoch + pArray->epicsTS.nsec / 1e9;
+        case SPBMatchUniqueId:
+            return pArray->uniqueId;
+        default:
+            return pArray->timeStamp;
+    }
+}
+
+void SPBundle::dropPending(SPBundleInput_t *pInput)
+{
+    while (!pInput->pending.empty()) {
+        pInput->pending.front()->release();
+        pInput->pending.pop_front();
+    }
+}
+
+/** Publishes a bundle while the oldest array from every input are within the tolerance.
+  * Otherwise the earliest of them cannot match any later array, because each input delivers in order,
+  * so it is dropped and counted as unmatched. */
+void SPBundle::matchBundles(void)
+{
+    int numInputs = (int)inputs_.size();
+    std::vector<double> keys(numInputs);
+    int matchMode;
+    double tolerance;
+    int unmatched;
+    int i;
+
+    getIntegerParam(SPBMatchMode, &matchMode);
+    getDoubleParam(SPBTolerance, &tolerance);
+    while (true) {
+        int first = 0, last = 0;
+        for (i=0; i<numInputs; i++) {
+            if (inputs_[i]->pending.empty()) return;
+            keys[i] = matchKey(inputs_[i]->pending.front(), matchMode);
+            if (keys[i] < keys[first]) first = i;
+            if (keys[i] > keys[last]) last = i;
+        }
+        if (keys[last] - keys[first] <= tolerance) {
+            publishBundle(keys);
+            for (i=0; i<numInputs; i++) {
+                inputs_[i]->pending.front()->release();
+                inputs_[i]->pending.pop_front();
+            }
+        } else {
+            inputs_[first]->pending.front()->release();
+            inputs_[first]->pending.pop_front();
+            getIntegerParam(first, SPBUnmatched, &unmatched);
+            setIntegerParam(first, SPBUnmatched, unmatched+1);
+        }
+    }
+}
+
+/** Updates the skew statistics and calls back the arrays at the head of each input queue.
+  * The skew of an input is its match key minus the mean key of the bundle. */
+void SPBundle::publishBundle(std::vector<double> const & keys)
+{
+    int numInputs = (int)inputs_.size();
+    double mean = 0.;
+    int outputMode;
+    int arrayCallbacks;
+    int arrayCounter;
+    int i;
+    static const char *functionName = "publishBundle";
+
+    for (i=0; i<numInputs; i++) mean += keys[i];
+    mean /= numInputs;
+    for (i=0; i<numInputs; i++) {
+        SPBundleInput_t *pInput = inputs_[i];
+        double skew = keys[i] - mean;
+        pInput->bundles++;
+        pInput->skewSum += skew;
+        if (fabs(skew) > pInput->skewMax) pInput->skewMax = fabs(skew);
+        setDoubleParam(i, SPBSkew, skew);
+        setDoubleParam(i, SPBSkewMean, pInput->skewSum / pInput->bundles);
+        setDoubleParam(i, SPBSkewMax, pInput->skewMax);
+    }
+    bundleCount_++;
+    setIntegerParam(SPBBundleCount, bundleCount_);
+    getIntegerParam(NDArrayCounter, &arrayCounter);
+    setIntegerParam(NDArrayCounter, arrayCounter+1);
+
+    getIntegerParam(NDArrayCallbacks, &arrayCallbacks);
+    if (!arrayCallbacks) return;
+    getIntegerParam(SPBOutputMode, &outputMode);
+    if (outputMode == SPBOutputStack) {
+        NDArray *pStack = stackBundle();
+        if (pStack) {
+            for (i=0; i<numInputs; i++) {
+                char name[32];
+                double skew = keys[i] - mean;
+                epicsSnprintf(name, sizeof(name), "BundleSkew%d", i);
+                pStack->pAttributeList->add(name, "Match key minus bundle mean", NDAttrFloat64, &skew);
+            }
+            if (pArrays[0]) pArrays[0]->release();
+            pArrays[0] = pStack;
+            setIntegerParam(NDArraySizeX, (int)pStack->dims[0].size);
+            setIntegerParam(NDArraySizeY, (pStack->ndims > 1) ? (int)pStack->dims[1].size : 0);
+            setIntegerParam(NDArraySizeZ, (pStack->ndims > 2) ? (int)pStack->dims[2].size : 0);
+            setIntegerParam(NDNDimensions, pStack->ndims);
+            setIntegerParam(NDDataType, pStack->dataType);
+            setIntegerParam(NDUniqueId, pStack->uniqueId);
+            setDoubleParam(NDTimeStamp, pStack->timeStamp);
+            setIntegerParam(NDEpicsTSSec, pStack->epicsTS.secPastEpoch);
+            setIntegerParam(NDEpicsTSNsec, pStack->epicsTS.nsec);
+            callParamCallbacks();
+            doCallbacksGenericPointer(pStack, NDArrayData, 0);
+            return;
+        }
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+            "%s::%s cannot stack bundle %d, publishing the arrays separately\n",
+            driverName, functionName, bundleCount_);
+    }
+    // Separate output.  Each array is passed on unchanged on the address of its input.
+    for (i=0; i<numInputs; i++) {
+        NDArray *pArray = inputs_[i]->pending.front();
+        pArray->reserve();
+        if (pArrays[i]) pArrays[i]->release();
+        pArrays[i] = pArray;
+    }
+    for (i=0; i<numInputs; i++) {
+        doCallbacksGenericPointer(pArrays[i], NDArrayData, i);
+    }
+}
+
+/** Copies the arrays at the head of each input queue into one NDArray with an extra last dimension.
+  * Returns NULL if the arrays do not all have the same dimensions and data type, or there is no memory.
+  * The bundle has the timestamps and attributes of the array from the first input. */
+NDArray *SPBundle::stackBundle(void)
+{
+    int numInputs = (int)inputs_.size();
+    NDArray *pFirst = inputs_[0]->pending.front();
+    size_t dims[ND_ARRAY_MAX_DIMS];
+    NDArrayInfo_t arrayInfo;
+    NDArray *pStack;
+    char *pOut;
+    int i, j;
+
+    if (pFirst->ndims >= ND_ARRAY_MAX_DIMS) return NULL;
+    for (i=1; i<numInputs; i++) {
+        NDArray *pArray = inputs_[i]->pending.front();
+        if ((pArray->ndims != pFirst->ndims) || (pArray->dataType != pFirst->dataType)) return NULL;
+        for (j=0; j<pFirst->ndims; j++) {
+            if (pArray->dims[j].size != pFirst->dims[j].size) return NULL;
+        }
+    }
+    for (j=0; j<pFirst->ndims; j++) dims[j] = pFirst->dims[j].size;
+    dims[pFirst->ndims] = numInputs;
+    pStack = pNDArrayPool->alloc(pFirst->ndims + 1, dims, pFirst->dataType, 0, NULL);
+    if (!pStack) return NULL;
+
+    pFirst->getInfo(&arrayInfo);
+    pOut = (char *)pStack->pData;
+    for (i=0; i<numInputs; i++) {
+        memcpy(pOut, inputs_[i]->pending.front()->pData, arrayInfo.totalBytes);
+        pOut += arrayInfo.totalBytes;
+    }
+    pStack->uniqueId = bundleCount_;
+    pStack->timeStamp = pFirst->timeStamp;
+    pStack->epicsTS = pFirst->epicsTS;
+    pStack->pAttributeList->clear();
+    pFirst->pAttributeList->copy(pStack->pAttributeList);
+    getAttributes(pStack->pAttributeList);
+    return pStack;
+}
+
+void SPBundle::resetStats(void)
+{
+    for (size_t i=0; i<inputs_.size(); i++) {
+        SPBundleInput_t *pInput = inputs_[i];
+        pInput->bundles = 0;
+        pInput->skewSum = 0.;
+        pInput->skewMax = 0.;
+        setIntegerParam((int)i, SPBUnmatched, 0);
+        setDoubleParam((int)i, SPBSkew, 0.);
+        setDoubleParam((int)i, SPBSkewMean, 0.);
+        setDoubleParam((int)i, SPBSkewMax, 0.);
+    }
+    bundleCount_ = 0;
+    setIntegerParam(SPBBundleCount, 0);
+}
+
+asynStatus SPBundle::writeInt32(asynUser *pasynUser, epicsInt32 value)
+{
+    int function = pasynUser->reason;
+    int addr;
+    size_t i;
+
+    getAddress(pasynUser, &addr);
+    if (function == SPBResetStats) {
+        if (value) resetStats();
+        setIntegerParam(function, 0);
+    } else if ((function == SPBMatchMode) || (function == SPBMaxPending)) {
+        // Arrays already queued were compared with the old settings
+        setIntegerParam(function, value);
+        for (i=0; i<inputs_.size(); i++) {
+            dropPending(inputs_[i]);
+            setIntegerParam((int)i, SPBPending, 0);
+        }
+    } else {
+        return asynNDArrayDriver::writeInt32(pasynUser, value);
+    }
+    for (i=0; i<inputs_.size(); i++) {
+        callParamCallbacks((int)i);
+    }
+    return asynSuccess;
+}
+
+void SPBundle::report(FILE *fp, int details)
+{
+    fprintf(fp, "%s: %d inputs, %d bundles\n", portName, (int)inputs_.size(), bundleCount_);
+    if (details > 0) {
+        for (size_t i=0; i<inputs_.size(); i++) {
+            SPBundleInput_t *pInput = inputs_[i];
+            int unmatched;
+            getIntegerParam((int)i, SPBUnmatched, &unmatched);
+            fprintf(fp, "  input %d: port %s, %s, %d pending, %d unmatched, max skew %g\n",
+                (int)i, pInput->portName.c_str(), pInput->interruptPvt ? "connected" : "not connected",
+                (int)pInput->pending.size(), unmatched, pInput->skewMax);
+        }
+    }
+    asynNDArrayDriver::report(fp, details);
+}
+
+static const iocshArg configArg0 = {"Port name", iocshArgString};
+static const iocshArg configArg1 = {"Input ports", iocshArgString};
+static const iocshArg configArg2 = {"maxBuffers", iocshArgInt};
+static const iocshArg configArg3 = {"maxMemory", iocshArgInt};
+static const iocshArg configArg4 = {"priority", iocshArgInt};
+static const iocshArg configArg5 = {"stackSize", iocshArgInt};
+static const iocshArg * const configArgs[] = {&configArg0,
+                                              &configArg1,
+                                              &configArg2,
+                                              &configArg3,
+                                              &configArg4,
+                                              &configArg5};
+static const iocshFuncDef configSPBundle = {"SPBundleConfig", 6, configArgs};
+static void configCallFunc(const iocshArgBuf *args)
+{
+    SPBundleConfig(args[0].sval, args[1].sval, args[2].ival,
+                   args[3].ival, args[4].ival, args[5].ival);
+}
+
+
+static void SPBundleRegister(void)
+{
+    iocshRegister(&configSPBundle, configCallFunc);
+}
+
+extern "C" {
+epicsExportRegistrar(SPBundleRegister);
+}
@@ -0,0 +1,92 @@
+#ifndef SP_BUNDLE_H
+#define SP_BUNDLE_H
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <asynGenericPointer.h>
+#include <asynNDArrayDriver.h>
+
+#define SPBMatchModeString                  "SPB_MATCH_MODE"                    // asynParamInt32, R/W
+#define SPBToleranceString                  "SPB_TOLERANCE"                     // asynParamFloat64, R/W
+#define SPBOutputModeString                 "SPB_OUTPUT_MODE"                   // asynParamInt32, R/W
+#define SPBMaxPendingString                 "SPB_MAX_PENDING"                   // asynParamInt32, R/W
+#define SPBNumInputsString                  "SPB_NUM_INPUTS"                    // asynParamInt32, R/O
+#define SPBBundleCountString                "SPB_BUNDLE_COUNT"                  // asynParamInt32, R/O
+#define SPBResetStatsString                 "SPB_RESET_STATS"                   // asynParamInt32, R/W
+#define SPBInputPortString                  "SPB_INPUT_PORT"                    // asynParamOctet, R/O
+#define SPBInputConnectedString             "SPB_INPUT_CONNECTED"               // asynParamInt32, R/O
+#define SPBPendingString                    "SPB_PENDING"                       // asynParamInt32, R/O
+#define SPBUnmatchedString                  "SPB_UNMATCHED"                     // asynParamInt32, R/O
+#define SPBSkewString                       "SPB_SKEW"                          // asynParamFloat64, R/O
+#define SPBSkewMeanString                   "SPB_SKEW_MEAN"                     // asynParamFloat64, R/O
+#define SPBSkewMaxString                    "SPB_SKEW_MAX"                      // asynParamFloat64, R/O
+
+class SPBundle;
+
+/** State of one input port */
+typedef struct {
+    SPBundle *pBundle;
+    int index;
+    std::string portName;
+    asynUser *pasynUser;
+    asynGenericPointer *pasynGenericPointer;
+    void *asynGenericPointerPvt;
+    void *interruptPvt;
+    std::deque<NDArray *> pending;
+    int bundles;
+    double skewSum;
+    double skewMax;
+} SPBundleInput_t;
+
+/** Bundles the NDArrays from several ADSpinnaker ports that belong to the same trigger.
+  * Arrays are matched by NDArray timeStamp, EPICS timestamp or uniqueId within a tolerance.
+  * Each bundle is output either as one NDArray with an extra last dimension, one element per input,
+  * or as the original arrays, array i on address i, all called back together.
+  * Parameters that apply to one input are on the address of that input.
+  */
+class SPBundle : public asynNDArrayDriver
+{
+public:
+    SPBundle(const char *portName, const char *inputPorts, int maxBuffers, size_t maxMemory,
+             int priority, int stackSize);
+    ~SPBundle();
+
+    // These are the methods that we override from asynNDArrayDriver
+    virtual asynStatus writeInt32(asynUser *pasynUser, epicsInt32 value);
+    virtual void report(FILE *fp, int details);
+
+    // This should be private but is called from C so must be public
+    void arrayCallback(int input, NDArray *pArray);
+
+private:
+    asynStatus connectInput(SPBundleInput_t *pInput);
+    double matchKey(NDArray *pArray, int matchMode);
+    void dropPending(SPBundleInput_t *pInput);
+    void matchBundles(void);
+    void publishBundle(std::vector<double> const & keys);
+    NDArray *stackBundle(void);
+    void resetStats(void);
+
+    int SPBMatchMode;
+    #define FIRST_SPB_PARAM SPBMatchMode
+    int SPBTolerance;
+    int SPBOutputMode;
+    int SPBMaxPending;
+    int SPBNumInputs;
+    int SPBBundleCount;
+    int SPBResetStats;
+    int SPBInputPort;
+    int SPBInputConnected;
+    int SPBPending;
+    int SPBUnmatched;
+    int SPBSkew;
+    int SPBSkewMean;
+    int SPBSkewMax;
+
+    std::vector<SPBundleInput_t *> inputs_;
+    int bundleCount_;
+};
+
+#endif
@@ -0,0 +1,142 @@
+// SPClock.cpp
+// Correlation of the camera clock with the host clock
+
+#include <math.h>
+
+#include <epicsGuard.h>
+
+#include <SPClock.h>
+
+SPClockCorrelator::SPClockCorrelator(size_t maxSamples)
+    : mMaxSamples(maxSamples), mCameraRef(0), mLastCameraTime(0),
+      mSlope(1.), mIntercept(0.), mResidual(0.)
+{
+    mHostRef.secPastEpoch = 0;
+    mHostRef.nsec = 0;
+}
+
+/** Adds a pair of times.  cameraTime is in ns.
+  * If the camera clock has gone backwards, because it was reset, the previous samples are discarded.
+  */
+void SPClockCorrelator::addSample(epicsInt64 cameraTime, epicsTimeStamp const & hostTime)
+{
+    epicsGuard<epicsMutex> guard(mMutex);
+    SPClockSample_t sample;
+
+    if (!mSamples.empty() && (cameraTime <= mLastCameraTime)) {
+        mSamples.clear();
+    }
+    if (mSamples.empty()) {
+        mCameraRef = cameraTime;
+        mHostRef = hostTime;
+    }
+    mLastCameraTime = cameraTime;
+    sample.cameraTime = (cameraTime - mCameraRef) / 1e9;
+    sample.hostTime = epicsTimeDiffInSeconds(&hostTime, &mHostRef);
+    mSamples.push_back(sample);
+    while (mSamples.size() > mMaxSamples) mSamples.pop_front();
+    fit();
+}
+
+void SPClockCorrelator::fit(void)
+{
+    double meanCamera=0, meanHost=0;
+    double sxx=0, sxy=0, sumSquares=0;
+    size_t n = mSamples.size();
+    size_t i;
+
+    for (i=0; i<n; i++) {
+        meanCamera += mSamples[i].cameraTime;
+        meanHost += mSamples[i].hostTime;
+    }
+    meanCamera /= n;
+    meanHost /= n;
+    for (i=0; i<n; i++) {
+        double dx = mSamples[i].cameraTime - meanCamera;
+        sxx += dx * dx;
+        sxy += dx * (mSamples[i].hostTime - meanHost);
+    }
+    // With a single sample, or samples all at the same time, only the offset is known
+    mSlope = (sxx > 0) ? sxy / sxx : 1.;
+    mIntercept = meanHost - mSlope * meanCamera;
+    for (i=0; i<n; i++) {
+        double residual = mSamples[i].hostTime - (mIntercept + mSlope * mSamples[i].cameraTime);
+        sumSquares += residual * residual;
+    }
+    mResidual = sqrt(sumSquares / n);
+}
+
+/** Converts a camera time in ns to host time.  Returns false if there are no samples yet. */
+bool SPClockCorrelator::cameraToHost(epicsInt64 cameraTime, epicsTimeStamp *pHostTime)
+{
+    epicsGuard<epicsMutex> guard(mMutex);
+
+    if (mSamples.empty()) return false;
+    *pHostTime = mHostRef;
+    epicsTimeAddSeconds(pHostTime, mIntercept + mSlope * ((cameraTime - mCameraRef) / 1e9));
+    return true;
+}
+
+void SPClockCorrelator::reset(void)
+{
+    epicsGuard<epicsMutex> guard(mMutex);
+
+    mSamples.clear();
+    mSlope = 1.;
+    mIntercept = 0.;
+    mResidual = 0.;
+}
+
+int SPClockCorrelator::getNumSamples(void)
+{
+    epicsGuard<epicsMutex> guard(mMutex);
+
+    return (int)mSamples.size();
+}
+
+/** Returns the host time in seconds since the EPICS epoch when the camera clock was 0 */
+double SPClockCorrelator::getOffset(void)
+{
+    epicsGuard<epicsMutex> guard(mMutex);
+
+    if (mSamples.empty()) return 0.;
+    return mHostRef.secPastEpoch + mHostRef.nsec/1e9 + mIntercept - mSlope * (mCameraRef / 1e9);
+}
+
+/** Returns the number of parts per million by which the host clock runs faster than the camera clock */
+double SPClockCorrelator::getDrift(void)
+{
+    epicsGuard<epicsMutex> guard(mMutex);
+
+    return (mSlope - 1.) * 1e6;
+}
+
+/** Returns the RMS residual of the fit in seconds */
+double SPClockCorrelator::getResidual(void)
+{
+    epicsGuard<epicsMutex> guard(mMutex);
+
+    return mResidual;
+}
+
+/** Parses the PTP status and offset read from the camera.  The clock is locked to PTP time when the
+  * camera is a Slave, or is the Master.  The offset is 0 if the camera does not report it.
+  */
+SPPtpState_t spParsePtpState(const char *status, bool offsetValid, epicsInt64 offset)
+{
+    SPPtpState_t state;
+
+    state.status = (status && *status) ? status : "Unknown";
+    state.locked = (state.status == "Slave") || (state.status == "Master");
+    state.offset = offsetValid ? (double)offset : 0.;
+    return state;
+}
+
+/** Returns the camera time in ns for which an action command sent at cameraTime is scheduled, delay seconds later.
+  * A delay of 0 or less gives 0, which GigE Vision uses for an unscheduled action.
+  */
+epicsInt64 spActionTime(epicsInt64 cameraTime, double delay)
+{
+    if (delay <= 0) return 0;
+    return cameraTime + (epicsInt64)floor(delay * 1e9 + 0.5);
+}
@@ -0,0 +1,59 @@
+#ifndef SP_CLOCK_H
+#define SP_CLOCK_H
+
+#include <deque>
+#include <string>
+
+#include <epicsTypes.h>
+#include <epicsTime.h>
+#include <epicsMutex.h>
+
+/** Correlates a camera clock with the host clock.
+  * Pairs of camera and host times are fitted by least squares with host = intercept + slope*camera
+  * over the most recent samples.  Times are stored relative to the first sample so that the fit keeps
+  * nanosecond resolution.  The methods are thread safe.
+  */
+class SPClockCorrelator
+{
+public:
+    SPClockCorrelator(size_t maxSamples);
+    void addSample(epicsInt64 cameraTime, epicsTimeStamp const & hostTime);
+    bool cameraToHost(epicsInt64 cameraTime, epicsTimeStamp *pHostTime);
+    void reset(void);
+    int getNumSamples(void);
+    double getOffset(void);
+    double getDrift(void);
+    double getResidual(void);
+
+private:
+    void fit(void);
+
+    typedef struct {
+        double cameraTime;
+        double hostTime;
+    } SPClockSample_t;
+
+    epicsMutex mMutex;
+    size_t mMaxSamples;
+    std::deque<SPClockSample_t> mSamples;
+    epicsInt64 mCameraRef;
+    epicsInt64 mLastCameraTime;
+    epicsTimeStamp mHostRef;
+    double mSlope;
+    double mIntercept;
+    double mResidual;
+};
+
+/** PTP state of a camera, from the symbolic entry of PtpStatus (GevIEEE1588Status on older cameras)
+  * and PtpOffsetFromMaster in ns. */
+typedef struct {
+    std::string status;
+    bool locked;
+    double offset;
+} SPPtpState_t;
+
+// These do not use the camera, so they can be checked without one
+SPPtpState_t spParsePtpState(const char *status, bool offsetValid, epicsInt64 offset);
+epicsInt64 spActionTime(epicsInt64 cameraTime, double delay);
+
+#endif
@@ -2,6 +2,9 @@
 // Mark Rivers
 // October 26, 2018
 
+#include <epicsAtomic.h>
+#include <epicsGuard.h>
+
 #include <SPFeature.h>
 #include <ADSpinnaker.h>
 
@@ -17,38 +20,200 @@ SPFeature::SPFeature(GenICamFeatureSet *set,
                      std::string const & asynName, asynParamType asynType, int asynIndex,
                      std::string const & featureName, GCFeatureType_t featureType)
                      
-         : GenICamFeature(set, asynName, asynType, asynIndex, featureName, featureType)
+         : GenICamFeature(set, asynName, asynType, asynIndex, featureName, featureType),
+         mDrv(0), mIsImplemented(false), mParamName(asynName), mParamIndex(asynIndex), mParamType(asynType),
+         mType(featureType), mCallbackHandle(0), mAccessModeCacheable(false), mValueCacheable(false),
+         mPushed(false), mPrefetched(false),
+         mGeneration(0), mAccessModeGeneration(-1), mValueGeneration(-1), mStringGeneration(-1),
+         mAccessMode(NI), mIntegerValue(0), mDoubleValue(0.), mBooleanValue(false), mEnumIndex(0),
+         mEntryGeneration(0), mEnumIndexGeneration(-1)
 {
     try {
-        ADSpinnaker *pDrv = (ADSpinnaker *) mSet->getPortDriver();
+        mDrv = (ADSpinnaker *) mSet->getPortDriver();
         mNodeName = featureName.c_str();
-        mPBase = (CNodePtr)pDrv->getNodeMap()->GetNode(mNodeName);
+        mPBase = (CNodePtr)mDrv->getNodeMap()->GetNode(mNodeName);
         mIsImplemented = IsImplemented(mPBase);
+        if (mIsImplemented) {
+            // The access mode can only be cached if the XML says so, e.g. not for nodes with pIsLocked.
+            // The value can only be cached if GenApi itself caches it, i.e. not for volatile nodes
+            // like DeviceTemperature that change without any node being written.
+            mAccessModeCacheable = (mPBase->IsAccessModeCacheable() == Yes);
+            mValueCacheable = mPBase->IsCachable() && (mPBase->GetCachingMode() != NoCache);
+            // Changes to volatile and streamable features are pushed to the driver's feature task
+            // from the node callback, so they update without waiting for a write or a poll.
+            mPushed = !mValueCacheable || mPBase->IsStreamable() || (mPBase->GetPollingTime() > 0);
+            mCallbackHandle = Register((INode *)mPBase, *this, &SPFeature::nodeCallback);
+            if (featureType == GCFeatureTypeEnum) {
+                CEnumerationPtr pNode = (CEnumerationPtr)mPBase;
+                NodeList_t entries;
+                pNode->GetEntries(entries);
+                for (size_t i=0; i<entries.size(); i++) {
+                    IEnumEntry *pEntry = dynamic_cast<IEnumEntry *>(entries[i]);
+                    if (!pEntry) continue;
+                    mEntries.push_back(pEntry);
+                    mEntryCallbackHandles.push_back(Register(entries[i], *this, &SPFeature::entryCallback));
+                }
+            }
+        }
     }
     catch (Spinnaker::Exception &e) {
         printf("SPProperty::SPProperty exception %s\n", e.what());
     }
 }
 
+void SPFeature::nodeCallback(INode *) {
+    epicsAtomicIncrIntT(&mGeneration);
+    if (mPushed) mDrv->featureChanged();
+}
+
+void SPFeature::entryCallback(INode *) {
+    epicsAtomicIncrIntT(&mEntryGeneration);
+}
+
+void SPFeature::invalidateCache() {
+    epicsAtomicIncrIntT(&mGeneration);
+    epicsAtomicIncrIntT(&mEntryGeneration);
+}
+
+void SPFeature::deregisterCallback() {
+    if (mCallbackHandle) {
+        mPBase->DeregisterCallback(mCallbackHandle);
+        mCallbackHandle = 0;
+    }
+    for (size_t i=0; i<mEntryCallbackHandles.size(); i++) {
+        mEntries[i]->GetNode()->DeregisterCallback(mEntryCallbackHandles[i]);
+    }
+    mEntryCallbackHandles.clear();
+}
+
+// True if the node has been invalidated since the feature was last read.
+// GenICamFeature::read() always checks the access mode first, so mAccessModeGeneration
+// records the generation at the last read.
+bool SPFeature::isStale() {
+    if (!mIsImplemented) return false;
+    return epicsAtomicGetIntT(&mGeneration) != mAccessModeGeneration;
+}
+
+bool SPFeature::isVolatile() {
+    return mIsImplemented && !mValueCacheable;
+}
+
+bool SPFeature::isPushed() {
+    return mPushed;
+}
+
+INode *SPFeature::getNode() {
+    return (INode *)mPBase;
+}
+
+std::string const & SPFeature::getParamName() {
+    return mParamName;
+}
+
+int SPFeature::getParamIndex() {
+    return mParamIndex;
+}
+
+asynParamType SPFeature::getParamType() {
+    return mParamType;
+}
+
+GCFeatureType_t SPFeature::getType() {
+    return mType;
+}
+
+/** Reads the access mode and value into the cache.
+  * This is called without the driver lock held, so that the register access for a feature
+  * that has changed does not happen while the driver is locked.  The following call to
+  * GenICamFeature::read() with the lock held then uses the cached values.  That includes
+  * volatile features, whose prefetched value is used once, by the next read of the value.
+  */
+void SPFeature::prefetch() {
+    if (!mIsImplemented) return;
+    {
+        epicsGuard<epicsMutex> guard(mCacheMutex);
+        mPrefetched = false;
+    }
+    try {
+        if (!isAvailable() || !isReadable()) return;
+        switch (mType) {
+            case GCFeatureTypeInteger:
+                readInteger();
+                break;
+            case GCFeatureTypeBoolean:
+                readBoolean();
+                break;
+            case GCFeatureTypeDouble:
+                readDouble();
+                break;
+            case GCFeatureTypeEnum:
+                readEnumIndex();
+                break;
+            case GCFeatureTypeString:
+                readString();
+                break;
+            default:
+                return;
+        }
+        epicsGuard<epicsMutex> guard(mCacheMutex);
+        mPrefetched = true;
+    }
+    catch (Spinnaker::Exception &e) {
+        // Errors are reported when the feature is read with the lock held
+    }
+}
+
+// True if the cached value can be returned.  A prefetched value is only used once.
+// Must be called with mCacheMutex held.
+bool SPFeature::useCachedValue(int generation) {
+    if (mValueGeneration != generation) return false;
+    if (mValueCacheable) return true;
+    if (!mPrefetched) return false;
+    mPrefetched = false;
+    return true;
+}
+
+// True if the cached value is the current value of the node.  The write methods use this to skip
+// writing a value that is already set, for example from autosave or an OPI.
+// Must be called with mCacheMutex held.
+bool SPFeature::valueIsCurrent() {
+    return mValueCacheable && (mValueGeneration == epicsAtomicGetIntT(&mGeneration));
+}
+
+EAccessMode SPFeature::readAccessMode() {
+    epicsGuard<epicsMutex> guard(mCacheMutex);
+    int generation = epicsAtomicGetIntT(&mGeneration);
+    if ((mAccessModeCacheable || mPrefetched) && (mAccessModeGeneration == generation)) return mAccessMode;
+    // One call to GetAccessMode() replaces separate IsAvailable/IsReadable/IsWritable graph walks
+    mAccessMode = mIsImplemented ? mPBase->GetAccessMode() : NI;
+    mAccessModeGeneration = generation;
+    return mAccessMode;
+}
+
 bool SPFeature::isImplemented() { 
     return mIsImplemented; 
 }
 
 bool SPFeature::isAvailable() { 
-    return IsAvailable(mPBase);
+    return IsAvailable(readAccessMode());
 }
 
 bool SPFeature::isReadable() { 
-    return IsReadable(mPBase);
+    return IsReadable(readAccessMode());
 }
 
 bool SPFeature::isWritable() { 
-    return IsWritable(mPBase);
+    return IsWritable(readAccessMode());
 }
 
 epicsInt64 SPFeature::readInteger() { 
+    epicsGuard<epicsMutex> guard(mCacheMutex);
+    int generation = epicsAtomicGetIntT(&mGeneration);
+    if (useCachedValue(generation)) return mIntegerValue;
     CIntegerPtr pNode = (CIntegerPtr)mPBase;
-    return pNode->GetValue();
+    mIntegerValue = pNode->GetValue();
+    mValueGeneration = generation;
+    return mIntegerValue;
 }
 
 epicsInt64 SPFeature::readIntegerMin() {
@@ -67,28 +232,53 @@ epicsInt64 SPFeature::readIncrement() {
 }
 
 void SPFeature::writeInteger(epicsInt64 value) { 
+    {
+        epicsGuard<epicsMutex> guard(mCacheMutex);
+        if (valueIsCurrent() && (value == mIntegerValue)) return;
+    }
     CIntegerPtr pNode = (CIntegerPtr)mPBase;
     pNode->SetValue(value);
+    invalidateCache();
 }
 
 bool SPFeature::readBoolean() { 
+    epicsGuard<epicsMutex> guard(mCacheMutex);
+    int generation = epicsAtomicGetIntT(&mGeneration);
+    if (useCachedValue(generation)) return mBooleanValue;
     CBooleanPtr pNode = (CBooleanPtr)mPBase;
-    return pNode->GetValue();
+    mBooleanValue = pNode->GetValue();
+    mValueGeneration = generation;
+    return mBooleanValue;
 }
 
 void SPFeature::writeBoolean(bool value) { 
+    {
+        epicsGuard<epicsMutex> guard(mCacheMutex);
+        if (valueIsCurrent() && (value == mBooleanValue)) return;
+    }
     CBooleanPtr pNode = (CBooleanPtr)mPBase;
     pNode->SetValue(value);
+    invalidateCache();
 }
 
 double SPFeature::readDouble() { 
+    epicsGuard<epicsMutex> guard(mCacheMutex);
+    int generation = epicsAtomicGetIntT(&mGeneration);
+    if (useCachedValue(generation)) return mDoubleValue;
     CFloatPtr pNode = (CFloatPtr)mPBase;
-    return pNode->GetValue();
+    mDoubleValue = pNode->GetValue();
+    mValueGeneration = generation;
+    return mDoubleValue;
 }
 
 void SPFeature::writeDouble(double value) { 
+    {
+        epicsGuard<epicsMutex> guard(mCacheMutex);
+        if (valueIsCurrent() && (value == mDoubleValue)) return;
+    }
     CFloatPtr pNode = (CFloatPtr)mPBase;
     pNode->SetValue(value);
+    invalidateCache();
 }
 
 double SPFeature::readDoubleMin() {
@@ -102,55 +292,105 @@ double SPFeature::readDoubleMax() {
 }
 
 int SPFeature::readEnumIndex() { 
+    epicsGuard<epicsMutex> guard(mCacheMutex);
+    int generation = epicsAtomicGetIntT(&mGeneration);
+    if (useCachedValue(generation)) return mEnumIndex;
     CEnumerationPtr pNode = (CEnumerationPtr)mPBase;
-    return (int)pNode->GetIntValue();
+    mEnumIndex = (int)pNode->GetIntValue();
+    mValueGeneration = generation;
+    return mEnumIndex;
 }
 
 void SPFeature::writeEnumIndex(int value) { 
+    {
+        epicsGuard<epicsMutex> guard(mCacheMutex);
+        if (valueIsCurrent() && (value == mEnumIndex)) return;
+    }
     CEnumerationPtr pNode = (CEnumerationPtr)mPBase;
     pNode->SetIntValue(value);
+    epicsAtomicIncrIntT(&mGeneration);
 }
 
 std::string SPFeature::readEnumString() { 
+    epicsGuard<epicsMutex> guard(mCacheMutex);
+    int generation = epicsAtomicGetIntT(&mGeneration);
+    if (mValueCacheable && (mStringGeneration == generation)) return mStringValue;
     CEnumerationPtr pNode = (CEnumerationPtr)mPBase;
     CEnumEntryPtr pEntry = pNode->GetCurrentEntry();
     gcstring value = pEntry->GetSymbolic();
-    return value.c_str();
+    mStringValue = value.c_str();
+    mStringGeneration = generation;
+    return mStringValue;
 }
 
 void SPFeature::writeEnumString(std::string const &value) { 
+    epicsInt64 intValue;
+    {
+        epicsGuard<epicsMutex> guard(mCacheMutex);
+        updateEnumIndex();
+        std::unordered_map<std::string, epicsInt64>::iterator it = mEnumSymbols.find(value);
+        if (it == mEnumSymbols.end()) {
+            std::string message = "Enum entry " + value + " is not available for " + mNodeName.c_str();
+            throw Spinnaker::Exception(__LINE__, __FILE__, __FUNCTION__, message.c_str(), SPINNAKER_ERR_INVALID_PARAMETER);
+        }
+        intValue = it->second;
+        if (valueIsCurrent() && (intValue == mEnumIndex)) return;
+    }
     CEnumerationPtr pNode = (CEnumerationPtr)mPBase;
-//    gcstring str(value.c_str());
-//    pNode->SetValue(str);
+    pNode->SetIntValue(intValue);
+    epicsAtomicIncrIntT(&mGeneration);
 }
 
 std::string SPFeature::readString() { 
+    epicsGuard<epicsMutex> guard(mCacheMutex);
+    int generation = epicsAtomicGetIntT(&mGeneration);
+    if ((mValueCacheable || mPrefetched) && (mStringGeneration == generation)) {
+        mPrefetched = false;
+        return mStringValue;
+    }
     CStringPtr pNode = (CStringPtr)mPBase;
-    return (pNode->GetValue()).c_str();
+    mStringValue = (pNode->GetValue()).c_str();
+    mStringGeneration = generation;
+    return mStringValue;
 }
 
 void SPFeature::writeString(std::string const & value) { 
     CStringPtr pNode = (CStringPtr)mPBase;
     gcstring str(value.c_str());
     pNode->SetValue(str);
+    invalidateCache();
 }
 
 void SPFeature::writeCommand() { 
     CCommandPtr pNode = (CCommandPtr)mPBase;
     pNode->Execute();
+    invalidateCache();
 }
 
-void SPFeature::readEnumChoices(std::vector<std::string>& enumStrings, std::vector<int>& enumValues) {
-    CEnumerationPtr pNode = (CEnumerationPtr)mPBase;
-    NodeList_t entries;
-    pNode->GetEntries(entries);
-    int numEnums = (int)entries.size();
-    for (int i=0; i<numEnums; i++) {
-        IEnumEntry *pEntry= dynamic_cast<IEnumEntry *>(entries[i]);
+// Rebuilds the enum index if the availability of any entry may have changed.
+// Must be called with mCacheMutex held.
+void SPFeature::updateEnumIndex() {
+    int generation = epicsAtomicGetIntT(&mEntryGeneration);
+    if (mEnumIndexGeneration == generation) return;
+    mEnumStrings.clear();
+    mEnumValues.clear();
+    mEnumSymbols.clear();
+    for (size_t i=0; i<mEntries.size(); i++) {
+        IEnumEntry *pEntry = mEntries[i];
         if (IsAvailable(pEntry) && IsReadable(pEntry)) {
             std::string str = pEntry->GetSymbolic().c_str();
-            enumStrings.push_back(str);
-            enumValues.push_back((int)pEntry->GetValue());
+            epicsInt64 value = pEntry->GetValue();
+            mEnumStrings.push_back(str);
+            mEnumValues.push_back((int)value);
+            mEnumSymbols[str] = value;
         }
     }
+    mEnumIndexGeneration = generation;
+}
+
+void SPFeature::readEnumChoices(std::vector<std::string>& enumStrings, std::vector<int>& enumValues) {
+    epicsGuard<epicsMutex> guard(mCacheMutex);
+    updateEnumIndex();
+    enumStrings.insert(enumStrings.end(), mEnumStrings.begin(), mEnumStrings.end());
+    enumValues.insert(enumValues.end(), mEnumValues.begin(), mEnumValues.end());
 }
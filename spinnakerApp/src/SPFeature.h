@@ -1,6 +1,12 @@
 #ifndef SP_FEATURE_H
 #define SP_FEATURE_H
 
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <epicsMutex.h>
+
 #include <GenICamFeature.h>
 
 #include "Spinnaker.h"
@@ -10,6 +16,8 @@ using namespace Spinnaker::GenApi;
 using namespace Spinnaker::GenICam;
 using namespace std;
 
+class ADSpinnaker;
+
 class SPFeature : public GenICamFeature
 {
 public:
@@ -40,11 +48,67 @@ public:
     virtual void writeString(std::string const & value);
     virtual void writeCommand(void);
 
+    void invalidateCache(void);
+    void deregisterCallback(void);
+    void nodeCallback(INode *pNode);
+    void entryCallback(INode *pNode);
+    bool isStale(void);
+    bool isVolatile(void);
+    bool isPushed(void);
+    void prefetch(void);
+    INode *getNode(void);
+    std::string const & getParamName(void);
+    int getParamIndex(void);
+    asynParamType getParamType(void);
+    GCFeatureType_t getType(void);
+
 private:
+    EAccessMode readAccessMode(void);
+    bool valueIsCurrent(void);
+    bool useCachedValue(int generation);
+    void updateEnumIndex(void);
+
+    ADSpinnaker *mDrv;
     gcstring mNodeName;
     CNodePtr mPBase;
     bool mIsImplemented;
+    std::string mParamName;
+    int mParamIndex;
+    asynParamType mParamType;
+    GCFeatureType_t mType;
+
+    // Cached access mode and value.  The node callback, which Spinnaker fires whenever this node
+    // or any node it depends on changes, increments mGeneration.  A cached item is valid while
+    // its generation matches mGeneration.  mGeneration is accessed with epicsAtomic because the
+    // callback can run on SDK threads.  The cached values are protected by mCacheMutex because
+    // features are read both from the port thread and from the driver's feature tasks.
+    epicsMutex mCacheMutex;
+    CallbackHandleType mCallbackHandle;
+    bool mAccessModeCacheable;
+    bool mValueCacheable;
+    bool mPushed;
+    // Set by prefetch() so that the next read uses the prefetched value, even if it is volatile
+    bool mPrefetched;
+    int mGeneration;
+    int mAccessModeGeneration;
+    int mValueGeneration;
+    int mStringGeneration;
+    EAccessMode mAccessMode;
+    epicsInt64 mIntegerValue;
+    double mDoubleValue;
+    bool mBooleanValue;
+    int mEnumIndex;
+    std::string mStringValue;
 
+    // Index of the available enum entries.  This is rebuilt only when a callback on one of the
+    // entry nodes reports that its availability may have changed.
+    std::vector<IEnumEntry *> mEntries;
+    std::vector<CallbackHandleType> mEntryCallbackHandles;
+    int mEntryGeneration;
+    int mEnumIndexGeneration;
+    std::vector<std::string> mEnumStrings;
+    std::vector<int> mEnumValues;
+    std::unordered_map<std::string, epicsInt64> mEnumSymbols;
 };
 
 #endif
@@ -0,0 +1,1216 @@
+// SPFrameProcessor.cpp
+// Copies a frame into an NDArray and processes it in the same pass
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <algorithm>
+#include <new>
+
+#include <epicsTypes.h>
+
+#include "SPFrameProcessor.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SP_HAVE_AVX2
+#include <immintrin.h>
+// Functions that use AVX2 are compiled for it individually, and only called if the CPU has it
+#define SP_AVX2 __attribute__((target("avx2")))
+#endif
+
+// Size in pixels of the square tiles used when the source is not read along its rows.
+// The dark and flat correction is done in bands of this many rows.
+#define TILE_SIZE 64
+
+// Reference files are this header followed by width*height*colors Float32 values
+#define REFERENCE_MAGIC "SPREF01"
+typedef struct {
+    char magic[8];
+    epicsUInt32 width;
+    epicsUInt32 height;
+    epicsUInt32 colors;
+    epicsUInt32 reserved;
+} SPReferenceHeader_t;
+
+// Defect files are this header line followed by one "x y" line for each defect
+#define DEFECT_MAGIC "SPDEFECTS"
+
+// Largest frame accepted from a reference or defect file, so a corrupt header cannot request a huge allocation
+#define MAX_FILE_DIMENSION 65536
+#define MAX_FILE_PIXELS (256 * 1024 * 1024)
+
+static bool validFileGeometry(unsigned long width, unsigned long height)
+{
+    return (width >= 1) && (height >= 1) && (width <= MAX_FILE_DIMENSION) && (height <= MAX_FILE_DIMENSION) &&
+           ((double)width * height <= MAX_FILE_PIXELS);
+}
+
+template <typename epicsType>
+static void shiftRow(const epicsType *pIn, epicsType *pOut, size_t n, int shift)
+{
+    // Separate loops with a constant shift direction, which the compiler vectorizes
+    if (shift > 0) {
+        for (size_t i=0; i<n; i++) pOut[i] = (epicsType)(pIn[i] << shift);
+    } else {
+        for (size_t i=0; i<n; i++) pOut[i] = (epicsType)(pIn[i] >> -shift);
+    }
+}
+
+/** Copies rows y0 to y1-1 of the output to pOut.  Output pixel (x, y) is source pixel
+  * pBase + x*strideX + y*strideY, with the strides in pixels. */
+template <typename epicsType>
+static void transformRows(const epicsType *pBase, ptrdiff_t strideX, ptrdiff_t strideY, int colors,
+                          size_t outWidth, size_t y0, size_t y1, int shift, epicsType *pOut)
+{
+    size_t rowSize = outWidth * colors;
+
+    if (strideX == 1) {
+        // Source rows are contiguous
+        for (size_t y=y0; y<y1; y++) {
+            const epicsType *pIn = pBase + (ptrdiff_t)y*strideY*colors;
+            epicsType *pRow = pOut + (y - y0)*rowSize;
+            if (shift == 0) {
+                memcpy(pRow, pIn, rowSize * sizeof(epicsType));
+            } else {
+                shiftRow(pIn, pRow, rowSize, shift);
+            }
+        }
+        return;
+    }
+
+    // Flipped in X or rotated.  Copy in tiles so that the source lines of a rotated tile stay in cache.
+    for (size_t ty=y0; ty<y1; ty+=TILE_SIZE) {
+        size_t yEnd = std::min(ty + TILE_SIZE, y1);
+        for (size_t tx=0; tx<outWidth; tx+=TILE_SIZE) {
+            size_t xEnd = std::min(tx + TILE_SIZE, outWidth);
+            for (size_t y=ty; y<yEnd; y++) {
+                const epicsType *pIn = pBase + (ptrdiff_t)y*strideY*colors;
+                epicsType *pRow = pOut + (y - y0)*rowSize;
+                for (size_t x=tx; x<xEnd; x++) {
+                    const epicsType *pPixel = pIn + (ptrdiff_t)x*strideX*colors;
+                    for (int c=0; c<colors; c++) {
+                        epicsType value = pPixel[c];
+                        if (shift > 0) value = (epicsType)(value << shift);
+                        else if (shift < 0) value = (epicsType)(value >> -shift);
+                        pRow[x*colors + c] = value;
+                    }
+                }
+            }
+        }
+    }
+}
+
+static inline void storeValue(epicsFloat32 *pOut, float value)
+{
+    *pOut = value;
+}
+
+static inline void storeValue(epicsUInt16 *pOut, float value)
+{
+    *pOut = (value <= 0.f) ? 0 : (value >= 65535.f) ? 65535 : (epicsUInt16)(value + 0.5f);
+}
+
+static inline void storeValue(epicsUInt8 *pOut, float value)
+{
+    *pOut = (value <= 0.f) ? 0 : (value >= 255.f) ? 255 : (epicsUInt8)(value + 0.5f);
+}
+
+template <typename inT, typename outT>
+static void correctRow(const inT *pIn, const float *pDark, const float *pGain, outT *pOut, size_t n)
+{
+    for (size_t i=0; i<n; i++) {
+        storeValue(pOut + i, ((float)pIn[i] - pDark[i]) * pGain[i]);
+    }
+}
+
+#ifdef SP_HAVE_AVX2
+SP_AVX2 static inline __m256 load8(const epicsUInt8 *pIn)
+{
+    return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)pIn)));
+}
+
+SP_AVX2 static inline __m256 load8(const epicsUInt16 *pIn)
+{
+    return _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)pIn)));
+}
+
+SP_AVX2 static inline void store8(epicsFloat32 *pOut, __m256 value)
+{
+    _mm256_storeu_ps(pOut, value);
+}
+
+/** Clamps and rounds like storeValue(), adding 0.5 and truncating, so the AVX2 and scalar paths give the
+  * same result for values halfway between integers.  _mm256_cvtps_epi32 would round them to even. */
+SP_AVX2 static inline __m128i pack8(__m256 value, float maxValue)
+{
+    value = _mm256_min_ps(_mm256_max_ps(value, _mm256_setzero_ps()), _mm256_set1_ps(maxValue));
+    __m256i rounded = _mm256_cvttps_epi32(_mm256_add_ps(value, _mm256_set1_ps(0.5f)));
+    return _mm_packus_epi32(_mm256_castsi256_si128(rounded), _mm256_extracti128_si256(rounded, 1));
+}
+
+SP_AVX2 static inline void store8(epicsUInt16 *pOut, __m256 value)
+{
+    _mm_storeu_si128((__m128i *)pOut, pack8(value, 65535.f));
+}
+
+SP_AVX2 static inline void store8(epicsUInt8 *pOut, __m256 value)
+{
+    __m128i packed = pack8(value, 255.f);
+    _mm_storel_epi64((__m128i *)pOut, _mm_packus_epi16(packed, packed));
+}
+
+template <typename inT, typename outT>
+SP_AVX2 static void correctRowAVX2(const inT *pIn, const float *pDark, const float *pGain, outT *pOut, size_t n)
+{
+    size_t i = 0;
+
+    for (; i+8 <= n; i+=8) {
+        __m256 value = _mm256_sub_ps(load8(pIn + i), _mm256_loadu_ps(pDark + i));
+        store8(pOut + i, _mm256_mul_ps(value, _mm256_loadu_ps(pGain + i)));
+    }
+    correctRow(pIn + i, pDark + i, pGain + i, pOut + i, n - i);
+}
+#endif
+
+template <typename inT, typename outT>
+static void correct(const inT *pIn, const float *pDark, const float *pGain, outT *pOut, size_t n, bool useAVX2)
+{
+#ifdef SP_HAVE_AVX2
+    if (useAVX2) {
+        correctRowAVX2(pIn, pDark, pGain, pOut, n);
+        return;
+    }
+#endif
+    correctRow(pIn, pDark, pGain, pOut, n);
+}
+
+template <typename inT, typename sumT>
+static void addRow(const inT *pIn, sumT *pSum, size_t n)
+{
+    for (size_t i=0; i<n; i++) pSum[i] += (sumT)pIn[i];
+}
+
+static void addRow(const epicsFloat32 *pIn, epicsUInt32 *pSum, size_t n)
+{
+    // Corrected values can be negative, they are rounded and clipped at 0
+    for (size_t i=0; i<n; i++) pSum[i] += (pIn[i] <= 0.f) ? 0 : (epicsUInt32)(pIn[i] + 0.5f);
+}
+
+#ifdef SP_HAVE_AVX2
+SP_AVX2 static inline __m256i loadInt8(const epicsUInt8 *pIn)
+{
+    return _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)pIn));
+}
+
+SP_AVX2 static inline __m256i loadInt8(const epicsUInt16 *pIn)
+{
+    return _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)pIn));
+}
+
+// Rounds like addRow(), adding 0.5 and truncating
+SP_AVX2 static inline __m256i loadInt8(const epicsFloat32 *pIn)
+{
+    __m256 value = _mm256_max_ps(_mm256_loadu_ps(pIn), _mm256_setzero_ps());
+    return _mm256_cvttps_epi32(_mm256_add_ps(value, _mm256_set1_ps(0.5f)));
+}
+
+SP_AVX2 static inline __m256 load8(const epicsFloat32 *pIn)
+{
+    return _mm256_loadu_ps(pIn);
+}
+
+template <typename inT>
+SP_AVX2 static inline void add8(const inT *pIn, epicsUInt32 *pSum)
+{
+    __m256i sum = _mm256_loadu_si256((const __m256i *)pSum);
+    _mm256_storeu_si256((__m256i *)pSum, _mm256_add_epi32(sum, loadInt8(pIn)));
+}
+
+template <typename inT>
+SP_AVX2 static inline void add8(const inT *pIn, epicsFloat32 *pSum)
+{
+    _mm256_storeu_ps(pSum, _mm256_add_ps(_mm256_loadu_ps(pSum), load8(pIn)));
+}
+
+template <typename inT, typename sumT>
+SP_AVX2 static void addRowAVX2(const inT *pIn, sumT *pSum, size_t n)
+{
+    size_t i = 0;
+
+    for (; i+8 <= n; i+=8) add8(pIn + i, pSum + i);
+    addRow(pIn + i, pSum + i, n - i);
+}
+#endif
+
+template <typename inT, typename sumT>
+static void add(const inT *pIn, sumT *pSum, size_t n, bool useAVX2)
+{
+#ifdef SP_HAVE_AVX2
+    if (useAVX2) {
+        addRowAVX2(pIn, pSum, n);
+        return;
+    }
+#endif
+    addRow(pIn, pSum, n);
+}
+
+/** Adds the moments of pixels x0 to x1-1 of a row, from the values minus threshold that are above it.
+  * pMoments gets the sum of the weights, of x*weight and of x*x*weight.  The largest value is kept in pPeak. */
+template <typename epicsType>
+static void centroidRow(const epicsType *pRow, int colors, size_t x0, size_t x1, double threshold,
+                        double *pMoments, double *pPeak, size_t *pPeakX)
+{
+    double sum = 0., sumX = 0., sumX2 = 0.;
+    double peak = *pPeak;
+    size_t peakX = *pPeakX;
+
+    for (size_t x=x0; x<x1; x++) {
+        double value = pRow[x*colors];
+        for (int c=1; c<colors; c++) value += pRow[x*colors + c];
+        if (value > peak) {
+            peak = value;
+            peakX = x;
+        }
+        double weight = value - threshold;
+        if (weight <= 0.) continue;
+        sum += weight;
+        sumX += weight * x;
+        sumX2 += weight * x * x;
+    }
+    pMoments[0] = sum;
+    pMoments[1] = sumX;
+    pMoments[2] = sumX2;
+    *pPeak = peak;
+    *pPeakX = peakX;
+}
+
+/** Computes the statistics of n values in one pass.  This is used for accumulated frames, whose UInt32 sums
+  * have too many possible values to count each one. */
+template <typename epicsType>
+static void computeStatistics(const epicsType *pIn, size_t n, int histSize, double histMin, double histMax,
+                              double saturation, SPStatistics_t *pStats)
+{
+    double scale = histSize / (histMax - histMin);
+    double minValue = 1e38, maxValue = -1e38;
+    double sum = 0., sumSquares = 0.;
+    size_t saturated = 0;
+
+    pStats->histogram.assign(histSize, 0.);
+    double *pHistogram = &pStats->histogram[0];
+    for (size_t i=0; i<n; i++) {
+        double value = pIn[i];
+        minValue = std::min(minValue, value);
+        maxValue = std::max(maxValue, value);
+        sum += value;
+        sumSquares += value * value;
+        if (value >= saturation) saturated++;
+        if ((value >= histMin) && (value <= histMax)) {
+            pHistogram[std::min((int)((value - histMin) * scale), histSize - 1)]++;
+        }
+    }
+    pStats->count = n;
+    pStats->min = minValue;
+    pStats->max = maxValue;
+    pStats->saturated = saturated;
+    pStats->mean = 0.;
+    pStats->sigma = 0.;
+    if (n == 0) return;
+    pStats->mean = sum / n;
+    pStats->sigma = sqrt(std::max(sumSquares / n - pStats->mean * pStats->mean, 0.));
+}
+
+template <typename epicsType>
+static void accumulate(const epicsType *pIn, double *pSum, size_t n)
+{
+    for (size_t i=0; i<n; i++) pSum[i] += pIn[i];
+}
+
+SPFrameProcessor::SPFrameProcessor()
+    : mDarkEnable(false), mFlatEnable(false), mCorrectionType(SPCorrectionNative), mUseAVX2(false),
+      mDataType(NDUInt8), mOutputType(NDUInt8), mColors(1), mBase(0), mStrideX(1), mStrideY(0),
+      mOutWidth(0), mOutHeight(0), mCorrect(false), mCorrectionDirty(true),
+      mCollectReference(SPReferenceDark), mCollectFrames(0), mCollectCount(0), mCollectWidth(0), mCollectHeight(0),
+      mDefectEnable(false), mFixDefects(false), mDefectWidth(0), mDefectHeight(0), mDefectNext(0),
+      mAccumulateFrames(0), mAccumulateType(SPAccumulateUInt32), mAccumulateAverage(false), mAccumulate(false),
+      mAccumulateCount(0), mAccumulateSize(0),
+      mStatsEnable(false), mHistSize(256), mHistMin(0.), mHistMax(0.), mSaturation(0.), mStats(false),
+      mStatsHistMin(0.), mStatsHistMax(0.), mStatsSaturation(0.), mStatsSum(0.), mStatsSumSquares(0.),
+      mCentroidEnable(false), mCentroidThreshold(0.), mCentroidRoiX(0), mCentroidRoiY(0), mCentroidRoiWidth(0),
+      mCentroidRoiHeight(0), mCentroidOnly(false), mCentroid(false), mOutput(true),
+      mCentroidX0(0), mCentroidX1(0), mCentroidY0(0), mCentroidY1(0)
+{
+    SPTransform_t transform = {0, 0, 0, 0, false, false, SPRotateNone, 0};
+    SPCentroid_t centroid = {0., 0., 0., 0., 0., 0., 0., 0, 0};
+    mTransform = transform;
+    mCentroidResult = centroid;
+    for (int i=0; i<SPReferenceCount; i++) {
+        mReferences[i].width = 0;
+        mReferences[i].height = 0;
+        mReferences[i].colors = 0;
+    }
+#ifdef SP_HAVE_AVX2
+    mUseAVX2 = __builtin_cpu_supports("avx2");
+#endif
+}
+
+/** Returns the SIMD instruction set used by the correction */
+const char *SPFrameProcessor::getSimd(void)
+{
+#ifdef SP_HAVE_AVX2
+    if (__builtin_cpu_supports("avx2")) return "AVX2";
+#endif
+    return "None";
+}
+
+void SPFrameProcessor::setTransform(SPTransform_t const & transform)
+{
+    mTransform = transform;
+}
+
+/** Enables the dark and flat correction.  correctionType is an SPCorrectionType_t that selects the output type;
+  * SPCorrectionNative keeps the input type. */
+void SPFrameProcessor::setCorrection(bool darkEnable, bool flatEnable, int correctionType)
+{
+    if ((darkEnable != mDarkEnable) || (flatEnable != mFlatEnable)) mCorrectionDirty = true;
+    mDarkEnable = darkEnable;
+    mFlatEnable = flatEnable;
+    mCorrectionType = correctionType;
+}
+
+/** Enables the replacement of the pixels in the defect list */
+void SPFrameProcessor::setDefectCorrection(bool enable)
+{
+    mDefectEnable = enable;
+}
+
+/** Sums numFrames processed frames into a UInt32 or Float32 frame before it is output, or divides the sum
+  * by numFrames if average is true.  accumulateType is an SPAccumulateType_t.  numFrames 0 disables the
+  * accumulation.  Changing the type discards a partial sum. */
+void SPFrameProcessor::setAccumulation(int numFrames, int accumulateType, bool average)
+{
+    if (accumulateType != mAccumulateType) mAccumulateCount = 0;
+    mAccumulateFrames = std::max(numFrames, 0);
+    mAccumulateType = accumulateType;
+    mAccumulateAverage = average;
+}
+
+/** Discards a partial sum, so the next frame starts a new accumulation */
+void SPFrameProcessor::resetAccumulation(void)
+{
+    mAccumulateCount = 0;
+}
+
+/** Enables the statistics of the processed frames.  The histogram has histSize bins from histMin to histMax,
+  * or over the range of the data type if histMax <= histMin.  Values at or above saturation are counted as
+  * saturated; saturation <= 0 uses the maximum of the data type, 65535 for Float32. */
+void SPFrameProcessor::setStatistics(bool enable, int histSize, double histMin, double histMax, double saturation)
+{
+    mStatsEnable = enable;
+    mHistSize = std::max(histSize, 1);
+    mHistMin = histMin;
+    mHistMax = histMax;
+    mSaturation = saturation;
+}
+
+/** Enables the centroid of the processed frames.  The region of interest is in the coordinates of the processed
+  * frame, and a width or height of 0 extends it to the edge.  In centroid only mode the frames have no output,
+  * and are not accumulated. */
+void SPFrameProcessor::setCentroid(bool enable, double threshold, size_t roiX, size_t roiY,
+                                   size_t roiWidth, size_t roiHeight, bool centroidOnly)
+{
+    mCentroidEnable = enable;
+    mCentroidThreshold = threshold;
+    mCentroidRoiX = roiX;
+    mCentroidRoiY = roiY;
+    mCentroidRoiWidth = roiWidth;
+    mCentroidRoiHeight = roiHeight;
+    mCentroidOnly = centroidOnly;
+}
+
+/** Computes the start and strides in the source, in pixels, and the output size of the transform
+  * of a width x height image.  The crop is clipped to the image. */
+void SPFrameProcessor::geometry(size_t width, size_t height)
+{
+    size_t cropX = std::min(mTransform.cropX, width - 1);
+    size_t cropY = std::min(mTransform.cropY, height - 1);
+    size_t cropWidth = width - cropX;
+    size_t cropHeight = height - cropY;
+    ptrdiff_t ax, ay, base;
+
+    if (mTransform.cropWidth > 0) cropWidth = std::min(mTransform.cropWidth, cropWidth);
+    if (mTransform.cropHeight > 0) cropHeight = std::min(mTransform.cropHeight, cropHeight);
+
+    // Step in the source for one pixel in x and y of the flipped crop
+    ax = mTransform.flipX ? -1 : 1;
+    ay = mTransform.flipY ? -(ptrdiff_t)width : (ptrdiff_t)width;
+    base = (ptrdiff_t)(cropY * width + cropX);
+    if (mTransform.flipX) base += cropWidth - 1;
+    if (mTransform.flipY) base += (cropHeight - 1) * width;
+
+    switch (mTransform.rotation) {
+        case SPRotate90:
+            mStrideX = -ay;
+            mStrideY = ax;
+            mBase = base + (ptrdiff_t)(cropHeight - 1) * ay;
+            mOutWidth = cropHeight;
+            mOutHeight = cropWidth;
+            break;
+        case SPRotate180:
+            mStrideX = -ax;
+            mStrideY = -ay;
+            mBase = base + (ptrdiff_t)(cropWidth - 1) * ax + (ptrdiff_t)(cropHeight - 1) * ay;
+            mOutWidth = cropWidth;
+            mOutHeight = cropHeight;
+            break;
+        case SPRotate270:
+            mStrideX = ay;
+            mStrideY = -ax;
+            mBase = base + (ptrdiff_t)(cropWidth - 1) * ax;
+            mOutWidth = cropHeight;
+            mOutHeight = cropWidth;
+            break;
+        default:
+            mStrideX = ax;
+            mStrideY = ay;
+            mBase = base;
+            mOutWidth = cropWidth;
+            mOutHeight = cropHeight;
+            break;
+    }
+}
+
+/** Prepares to process a width x height frame with colors values per pixel.
+  * Returns the size and data type of the processed frame, or false if the data type is not supported. */
+bool SPFrameProcessor::prepare(NDDataType_t dataType, int colors, size_t width, size_t height,
+                               size_t *pWidth, size_t *pHeight, NDDataType_t *pDataType)
+{
+    if ((dataType != NDUInt8) && (dataType != NDUInt16)) return false;
+    mDataType = dataType;
+    mColors = colors;
+    geometry(width, height);
+
+    // Frames that are collected for a reference are not corrected
+    mCorrect = (mDarkEnable || mFlatEnable) && (mCollectCount >= mCollectFrames);
+    for (int i=0; mCorrect && (i<SPReferenceCount); i++) {
+        SPReferenceFrame_t &ref = mReferences[i];
+        bool enable = (i == SPReferenceDark) ? mDarkEnable : mFlatEnable;
+        if (enable && ((ref.width != mOutWidth) || (ref.height != mOutHeight) || (ref.colors != colors))) {
+            mCorrect = false;
+        }
+    }
+    mOutputType = dataType;
+    if (mCorrect) {
+        if (mCorrectionType == SPCorrectionUInt16) mOutputType = NDUInt16;
+        else if (mCorrectionType == SPCorrectionFloat32) mOutputType = NDFloat32;
+        if (mCorrectionDirty || (mDark.size() != mOutWidth * mOutHeight * colors)) buildCorrection();
+    }
+    // The defect list is in the geometry of the processed frames, like the references
+    mFixDefects = mDefectEnable && !mDefects.empty() && (mCollectCount >= mCollectFrames) &&
+                  (mDefectWidth == mOutWidth) && (mDefectHeight == mOutHeight);
+    *pWidth = mOutWidth;
+    *pHeight = mOutHeight;
+    *pDataType = mOutputType;
+
+    mStats = mStatsEnable;
+    if (mStats) {
+        double typeMax = (mOutputType == NDUInt8) ? 255. : 65535.;
+        mStatsHistMin = (mHistMax > mHistMin) ? mHistMin : 0.;
+        mStatsHistMax = (mHistMax > mHistMin) ? mHistMax : typeMax;
+        mStatsSaturation = (mSaturation > 0.) ? mSaturation : typeMax;
+    }
+
+    mCentroid = mCentroidEnable;
+    if (mCentroid) {
+        mCentroidX0 = std::min(mCentroidRoiX, mOutWidth);
+        mCentroidY0 = std::min(mCentroidRoiY, mOutHeight);
+        mCentroidX1 = (mCentroidRoiWidth > 0) ? std::min(mCentroidX0 + mCentroidRoiWidth, mOutWidth) : mOutWidth;
+        mCentroidY1 = (mCentroidRoiHeight > 0) ? std::min(mCentroidY0 + mCentroidRoiHeight, mOutHeight) : mOutHeight;
+    }
+    mOutput = !(mCentroid && mCentroidOnly);
+
+    // A partial sum of frames of a different size is discarded
+    mAccumulate = (mAccumulateFrames > 0) && mOutput;
+    if (mAccumulate) {
+        size_t size = mOutWidth * mOutHeight * colors;
+        if (size != mAccumulateSize) mAccumulateCount = 0;
+        mAccumulateSize = size;
+        *pDataType = (mAccumulateType == SPAccumulateFloat32) ? NDFloat32 : NDUInt32;
+    }
+    return true;
+}
+
+/** Returns true if the frame being processed is corrected */
+bool SPFrameProcessor::isCorrecting(void)
+{
+    return mCorrect;
+}
+
+/** Returns true if the defects of the frame being processed are replaced */
+bool SPFrameProcessor::isFixingDefects(void)
+{
+    return mFixDefects;
+}
+
+/** Returns true if the frame being processed is added to an accumulation */
+bool SPFrameProcessor::isAccumulating(void)
+{
+    return mAccumulate;
+}
+
+/** Returns true if process() writes an output frame for the frame being processed.  It is false while a frame
+  * is only added to an accumulation, and then pOut can be NULL. */
+bool SPFrameProcessor::hasOutput(void)
+{
+    return mOutput && (!mAccumulate || (mAccumulateCount + 1 >= mAccumulateFrames));
+}
+
+/** Returns the number of frames in the partial sum */
+int SPFrameProcessor::getAccumulateCount(void)
+{
+    return mAccumulateCount;
+}
+
+bool SPFrameProcessor::isComputingStatistics(void)
+{
+    return mStats;
+}
+
+/** Returns the statistics of the last frame processed with isComputingStatistics() true */
+SPStatistics_t const & SPFrameProcessor::getStatistics(void)
+{
+    return mStatistics;
+}
+
+/** Returns the statistics of the last accumulation written with isComputingStatistics() true */
+SPStatistics_t const & SPFrameProcessor::getAccumulateStatistics(void)
+{
+    return mAccumulateStatistics;
+}
+
+bool SPFrameProcessor::isComputingCentroid(void)
+{
+    return mCentroid;
+}
+
+/** Returns the centroid of the last frame processed with isComputingCentroid() true */
+SPCentroid_t const & SPFrameProcessor::getCentroid(void)
+{
+    return mCentroidResult;
+}
+
+/** Builds the dark and gain of each value from the enabled references */
+void SPFrameProcessor::buildCorrection(void)
+{
+    size_t n = mOutWidth * mOutHeight * mColors;
+
+    mDark.assign(n, 0.f);
+    mGain.assign(n, 1.f);
+    if (mDarkEnable) {
+        mDark = mReferences[SPReferenceDark].data;
+    }
+    if (mFlatEnable) {
+        std::vector<float> const & flat = mReferences[SPReferenceFlat].data;
+        for (int c=0; c<mColors; c++) {
+            double sum = 0.;
+            size_t count = 0;
+            for (size_t i=c; i<n; i+=mColors) {
+                float signal = flat[i] - mDark[i];
+                if (signal > 0) {
+                    sum += signal;
+                    count++;
+                }
+            }
+            float mean = count ? (float)(sum / count) : 1.f;
+            // Pixels with no signal in the flat are dead and corrected to 0
+            for (size_t i=c; i<n; i+=mColors) {
+                float signal = flat[i] - mDark[i];
+                mGain[i] = (signal > 0) ? mean / signal : 0.f;
+            }
+        }
+    }
+    mCorrectionDirty = false;
+}
+
+/** Copies and corrects the frame in bands of TILE_SIZE rows, so each band is read from the source once
+  * and corrected while it is in cache.  Defects are fixed one row behind the band, once the rows below them
+  * have been written, and the finished rows are then accumulated.  Without correction outT must be inT. */
+template <typename inT, typename outT>
+void SPFrameProcessor::processBands(const inT *pBase, outT *pOut)
+{
+    size_t rowSize = mOutWidth * mColors;
+    bool direct = (mStrideX == 1) && (mTransform.shift == 0);
+    size_t rowsDone = 0;
+
+    mDefectNext = 0;
+    if (mCorrect && !direct) mBand.resize(TILE_SIZE * rowSize * sizeof(inT));
+    for (size_t y0=0; y0<mOutHeight; y0+=TILE_SIZE) {
+        size_t y1 = std::min(y0 + TILE_SIZE, mOutHeight);
+        if (!mCorrect) {
+            transformRows(pBase, mStrideX, mStrideY, mColors, mOutWidth, y0, y1, mTransform.shift,
+                          (inT *)pOut + y0*rowSize);
+        } else {
+            if (!direct) {
+                transformRows(pBase, mStrideX, mStrideY, mColors, mOutWidth, y0, y1, mTransform.shift,
+                              (inT *)&mBand[0]);
+            }
+            for (size_t y=y0; y<y1; y++) {
+                const inT *pRow = direct ? pBase + (ptrdiff_t)y*mStrideY*mColors
+                                         : (const inT *)&mBand[0] + (y - y0)*rowSize;
+                correct(pRow, &mDark[y*rowSize], &mGain[y*rowSize], pOut + y*rowSize, rowSize, mUseAVX2);
+            }
+        }
+        size_t rowLimit = y1;
+        if (mFixDefects) {
+            if (y1 < mOutHeight) rowLimit = y1 - 1;
+            fixDefects(pOut, rowLimit);
+        }
+        finishRows(pOut, rowsDone, rowLimit);
+        rowsDone = rowLimit;
+    }
+}
+
+/** Finishes a frame that needs no processing directly from the source, in bands of TILE_SIZE rows */
+template <typename epicsType>
+void SPFrameProcessor::finishFrame(const epicsType *pFrame)
+{
+    for (size_t y0=0; y0<mOutHeight; y0+=TILE_SIZE) {
+        finishRows(pFrame, y0, std::min(y0 + TILE_SIZE, mOutHeight));
+    }
+}
+
+/** Processes rows y0 to y1-1 of a processed frame, while they are still in cache */
+template <typename epicsType>
+void SPFrameProcessor::finishRows(const epicsType *pFrame, size_t y0, size_t y1)
+{
+    size_t rowSize = mOutWidth * mColors;
+    size_t offset = y0 * rowSize;
+    size_t n = (y1 - y0) * rowSize;
+
+    if (mStats) countValues(pFrame + offset, n);
+    if (mCentroid) centroidRows(pFrame, y0, y1);
+    if (mAccumulate && (n > 0)) {
+        if (mAccumulateType == SPAccumulateFloat32) {
+            add(pFrame + offset, (epicsFloat32 *)&mSum[0] + offset, n, mUseAVX2);
+        } else {
+            add(pFrame + offset, (epicsUInt32 *)&mSum[0] + offset, n, mUseAVX2);
+        }
+    }
+}
+
+/** Counts each value of an integer frame.  The statistics are computed from the counts by endStatistics(). */
+template <typename epicsType>
+void SPFrameProcessor::countValues(const epicsType *pIn, size_t n)
+{
+    epicsUInt32 *pCounts = &mValueCounts[0];
+
+    for (size_t i=0; i<n; i++) pCounts[pIn[i]]++;
+}
+
+/** Adds the values of a Float32 frame to the statistics and histogram */
+void SPFrameProcessor::countValues(const epicsFloat32 *pIn, size_t n)
+{
+    double *pHistogram = &mStatistics.histogram[0];
+    double scale = mHistSize / (mStatsHistMax - mStatsHistMin);
+    float saturation = (float)mStatsSaturation;
+    float minValue = (float)mStatistics.min;
+    float maxValue = (float)mStatistics.max;
+    double sum = 0., sumSquares = 0.;
+    size_t saturated = 0;
+
+    for (size_t i=0; i<n; i++) {
+        float value = pIn[i];
+        minValue = std::min(minValue, value);
+        maxValue = std::max(maxValue, value);
+        sum += value;
+        sumSquares += (double)value * value;
+        if (value >= saturation) saturated++;
+        if ((value >= mStatsHistMin) && (value <= mStatsHistMax)) {
+            pHistogram[std::min((int)((value - mStatsHistMin) * scale), mHistSize - 1)]++;
+        }
+    }
+    mStatistics.min = minValue;
+    mStatistics.max = maxValue;
+    mStatsSum += sum;
+    mStatsSumSquares += sumSquares;
+    mStatistics.saturated += saturated;
+}
+
+void SPFrameProcessor::startStatistics(void)
+{
+    mStatistics.count = mOutWidth * mOutHeight * mColors;
+    mStatistics.min = 1e38;
+    mStatistics.max = -1e38;
+    mStatistics.saturated = 0;
+    mStatistics.histogram.assign(mHistSize, 0.);
+    mStatsSum = 0.;
+    mStatsSumSquares = 0.;
+    if (mOutputType != NDFloat32) mValueCounts.resize((mOutputType == NDUInt8) ? 256 : 65536);
+}
+
+/** Computes the statistics of an integer frame from the counts of each value, and clears the counts */
+void SPFrameProcessor::endStatistics(void)
+{
+    if (mOutputType != NDFloat32) {
+        double scale = mHistSize / (mStatsHistMax - mStatsHistMin);
+        for (size_t value=0; value<mValueCounts.size(); value++) {
+            double count = mValueCounts[value];
+            if (count == 0) continue;
+            mValueCounts[value] = 0;
+            mStatistics.min = std::min(mStatistics.min, (double)value);
+            mStatistics.max = (double)value;
+            mStatsSum += count * value;
+            mStatsSumSquares += count * value * value;
+            if (value >= mStatsSaturation) mStatistics.saturated += (size_t)count;
+            if ((value >= mStatsHistMin) && (value <= mStatsHistMax)) {
+                mStatistics.histogram[std::min((int)((value - mStatsHistMin) * scale), mHistSize - 1)] += count;
+            }
+        }
+    }
+    if (mStatistics.count == 0) return;
+    mStatistics.mean = mStatsSum / mStatistics.count;
+    double variance = mStatsSumSquares / mStatistics.count - mStatistics.mean * mStatistics.mean;
+    mStatistics.sigma = sqrt(std::max(variance, 0.));
+}
+
+/** Adds the moments of the rows y0 to y1-1 that are in the region of interest */
+template <typename epicsType>
+void SPFrameProcessor::centroidRows(const epicsType *pFrame, size_t y0, size_t y1)
+{
+    size_t rowSize = mOutWidth * mColors;
+    double rowMoments[3];
+
+    for (size_t y=std::max(y0, mCentroidY0); y<std::min(y1, mCentroidY1); y++) {
+        double peak = mCentroidResult.peakValue;
+        size_t peakX = mCentroidResult.peakX;
+        centroidRow(pFrame + y*rowSize, mColors, mCentroidX0, mCentroidX1, mCentroidThreshold,
+                    rowMoments, &peak, &peakX);
+        if (peak > mCentroidResult.peakValue) {
+            mCentroidResult.peakValue = peak;
+            mCentroidResult.peakX = peakX;
+            mCentroidResult.peakY = y;
+        }
+        mMoments[0] += rowMoments[0];
+        mMoments[1] += rowMoments[1];
+        mMoments[2] += rowMoments[0] * y;
+        mMoments[3] += rowMoments[2];
+        mMoments[4] += rowMoments[0] * y * y;
+        mMoments[5] += rowMoments[1] * y;
+    }
+}
+
+void SPFrameProcessor::startCentroid(void)
+{
+    SPCentroid_t centroid = {0., 0., 0., 0., 0., 0., -1., mCentroidX0, mCentroidY0};
+
+    mCentroidResult = centroid;
+    for (int i=0; i<6; i++) mMoments[i] = 0.;
+}
+
+/** Computes the centroid and sigmas from the moments.  They are 0 if no value is above the threshold. */
+void SPFrameProcessor::endCentroid(void)
+{
+    double total = mMoments[0];
+
+    if (mCentroidResult.peakValue < 0.) mCentroidResult.peakValue = 0.;
+    mCentroidResult.total = total;
+    if (total <= 0.) return;
+    double x = mMoments[1] / total;
+    double y = mMoments[2] / total;
+    double varX = std::max(mMoments[3] / total - x * x, 0.);
+    double varY = std::max(mMoments[4] / total - y * y, 0.);
+    mCentroidResult.x = x;
+    mCentroidResult.y = y;
+    mCentroidResult.sigmaX = sqrt(varX);
+    mCentroidResult.sigmaY = sqrt(varY);
+    if ((varX > 0.) && (varY > 0.)) {
+        mCentroidResult.sigmaXY = (mMoments[5] / total - x * y) / (mCentroidResult.sigmaX * mCentroidResult.sigmaY);
+    }
+}
+
+/** Writes the completed accumulation to pOut, divided by the number of frames if it is averaged.
+  * With statistics enabled they are also computed from pOut, so they describe the accumulated frame.
+  * The default histogram range and saturation level of a sum are those of one frame times the number of frames. */
+void SPFrameProcessor::writeAccumulation(void *pOut)
+{
+    size_t n = mAccumulateSize;
+
+    if (!mAccumulateAverage) {
+        memcpy(pOut, &mSum[0], n * 4);
+    } else if (mAccumulateType == SPAccumulateFloat32) {
+        const epicsFloat32 *pSum = (const epicsFloat32 *)&mSum[0];
+        float scale = 1.f / mAccumulateCount;
+        for (size_t i=0; i<n; i++) ((epicsFloat32 *)pOut)[i] = pSum[i] * scale;
+    } else {
+        const epicsUInt32 *pSum = (const epicsUInt32 *)&mSum[0];
+        epicsUInt32 count = mAccumulateCount;
+        for (size_t i=0; i<n; i++) ((epicsUInt32 *)pOut)[i] = (pSum[i] + count/2) / count;
+    }
+    if (mStats) {
+        double frames = mAccumulateAverage ? 1. : (double)mAccumulateCount;
+        double typeMax = ((mOutputType == NDUInt8) ? 255. : 65535.) * frames;
+        double histMin = (mHistMax > mHistMin) ? mHistMin : 0.;
+        double histMax = (mHistMax > mHistMin) ? mHistMax : typeMax;
+        double saturation = (mSaturation > 0.) ? mSaturation * frames : typeMax;
+        if (mAccumulateType == SPAccumulateFloat32) {
+            computeStatistics((const epicsFloat32 *)pOut, n, mHistSize, histMin, histMax, saturation,
+                              &mAccumulateStatistics);
+        } else {
+            computeStatistics((const epicsUInt32 *)pOut, n, mHistSize, histMin, histMax, saturation,
+                              &mAccumulateStatistics);
+        }
+    }
+}
+
+/** Replaces each defect in rows before rowLimit with the median of its neighbours that are not defects,
+  * for each color separately.  The defects are sorted by row, so this works down the frame. */
+template <typename epicsType>
+void SPFrameProcessor::fixDefects(epicsType *pOut, size_t rowLimit)
+{
+    size_t rowSize = mOutWidth * mColors;
+    float values[8];
+
+    for (; (mDefectNext < mDefects.size()) && (mDefects[mDefectNext].y < rowLimit); mDefectNext++) {
+        size_t x = mDefects[mDefectNext].x;
+        size_t y = mDefects[mDefectNext].y;
+        for (int c=0; c<mColors; c++) {
+            int n = 0;
+            for (int dy=-1; dy<=1; dy++) {
+                if (((dy < 0) && (y == 0)) || ((dy > 0) && (y + 1 >= mOutHeight))) continue;
+                for (int dx=-1; dx<=1; dx++) {
+                    if (((dx < 0) && (x == 0)) || ((dx > 0) && (x + 1 >= mOutWidth))) continue;
+                    size_t pixel = (y + dy)*mOutWidth + x + dx;
+                    if (mDefectMask[pixel]) continue;
+                    // Insertion sort, there are at most 8 values
+                    float value = (float)pOut[(y + dy)*rowSize + (x + dx)*mColors + c];
+                    int i = n++;
+                    for (; (i > 0) && (values[i-1] > value); i--) values[i] = values[i-1];
+                    values[i] = value;
+                }
+            }
+            if (n == 0) continue;
+            float median = (n & 1) ? values[n/2] : 0.5f * (values[n/2 - 1] + values[n/2]);
+            storeValue(pOut + y*rowSize + x*mColors + c, median);
+        }
+    }
+}
+
+/** Copies the frame given to prepare() from pIn to pOut, which must hold the size and type returned by prepare().
+  * pOut is not used if hasOutput() is false. */
+void SPFrameProcessor::process(const void *pIn, void *pOut)
+{
+    size_t frameSize = mOutWidth * mOutHeight * mColors;
+    bool contiguous = (mStrideX == 1) && (mStrideY == (ptrdiff_t)mOutWidth) && (mTransform.shift == 0);
+    bool copy = mCorrect || mFixDefects || !contiguous;
+    // Statistics and the centroid are computed from the rows of each band, while they are in cache
+    bool bands = copy || mStats || mCentroid;
+    // An accumulated frame, or one with no output, is processed into mFrame, or read from the source
+    // if it needs no processing
+    bool toOutput = mOutput && !mAccumulate;
+    const void *pFrame = pOut;
+    void *pCopy = pOut;
+
+    if (mStats) startStatistics();
+    if (mCentroid) startCentroid();
+    if (mAccumulate && (mAccumulateCount == 0)) mSum.assign(frameSize * 4, 0);
+    if (!toOutput && copy) {
+        mFrame.resize(frameSize * ((mOutputType == NDFloat32) ? 4 : (mOutputType == NDUInt16) ? 2 : 1));
+        pCopy = &mFrame[0];
+        pFrame = pCopy;
+    }
+    if (mDataType == NDUInt8) {
+        const epicsUInt8 *pBase = (const epicsUInt8 *)pIn + mBase*mColors;
+        if (mCorrect && (mOutputType == NDUInt16)) processBands(pBase, (epicsUInt16 *)pCopy);
+        else if (mCorrect && (mOutputType == NDFloat32)) processBands(pBase, (epicsFloat32 *)pCopy);
+        else if (copy || (bands && toOutput)) processBands(pBase, (epicsUInt8 *)pCopy);
+        else if (toOutput) memcpy(pOut, pBase, frameSize);
+        else {
+            finishFrame(pBase);
+            pFrame = pBase;
+        }
+    } else {
+        const epicsUInt16 *pBase = (const epicsUInt16 *)pIn + mBase*mColors;
+        if (mCorrect && (mOutputType == NDFloat32)) processBands(pBase, (epicsFloat32 *)pCopy);
+        else if (copy || (bands && toOutput)) processBands(pBase, (epicsUInt16 *)pCopy);
+        else if (toOutput) memcpy(pOut, pBase, frameSize * sizeof(epicsUInt16));
+        else {
+            finishFrame(pBase);
+            pFrame = pBase;
+        }
+    }
+    if (mStats) endStatistics();
+    if (mCentroid) endCentroid();
+    if (mCollectCount < mCollectFrames) collect(pFrame);
+    if (mAccumulate && (++mAccumulateCount >= mAccumulateFrames)) {
+        writeAccumulation(pOut);
+        mAccumulateCount = 0;
+    }
+}
+
+/** Starts averaging the next numFrames processed frames into a reference.  0 cancels a collection. */
+void SPFrameProcessor::startCollect(int reference, int numFrames)
+{
+    mCollectReference = reference;
+    mCollectFrames = std::max(numFrames, 0);
+    mCollectCount = 0;
+    mCollectSum.clear();
+}
+
+/** Returns the number of frames still to be collected */
+int SPFrameProcessor::getCollectRemaining(void)
+{
+    return mCollectFrames - mCollectCount;
+}
+
+/** Adds a processed, uncorrected frame to the reference being collected */
+void SPFrameProcessor::collect(const void *pOut)
+{
+    size_t n = mOutWidth * mOutHeight * mColors;
+
+    // Start again if the frame size changes
+    if ((mCollectSum.size() != n) || (mCollectWidth != mOutWidth) || (mCollectHeight != mOutHeight)) {
+        mCollectSum.assign(n, 0.);
+        mCollectWidth = mOutWidth;
+        mCollectHeight = mOutHeight;
+        mCollectCount = 0;
+    }
+    if (mDataType == NDUInt8) accumulate((const epicsUInt8 *)pOut, &mCollectSum[0], n);
+    else accumulate((const epicsUInt16 *)pOut, &mCollectSum[0], n);
+    mCollectCount++;
+    if (mCollectCount < mCollectFrames) return;
+
+    SPReferenceFrame_t &ref = mReferences[mCollectReference];
+    ref.width = mOutWidth;
+    ref.height = mOutHeight;
+    ref.colors = mColors;
+    ref.data.resize(n);
+    for (size_t i=0; i<n; i++) {
+        ref.data[i] = (float)(mCollectSum[i] / mCollectCount);
+    }
+    mCollectSum.clear();
+    mCorrectionDirty = true;
+}
+
+bool SPFrameProcessor::hasReference(int reference)
+{
+    return !mReferences[reference].data.empty();
+}
+
+bool SPFrameProcessor::saveReference(int reference, const char *fileName, std::string &error)
+{
+    SPReferenceFrame_t &ref = mReferences[reference];
+    SPReferenceHeader_t header;
+    FILE *fp;
+    bool ok;
+
+    if (ref.data.empty()) {
+        error = "no reference to save";
+        return false;
+    }
+    fp = fopen(fileName, "wb");
+    if (!fp) {
+        error = std::string("cannot create ") + fileName;
+        return false;
+    }
+    memset(&header, 0, sizeof(header));
+    strncpy(header.magic, REFERENCE_MAGIC, sizeof(header.magic));
+    header.width = (epicsUInt32)ref.width;
+    header.height = (epicsUInt32)ref.height;
+    header.colors = (epicsUInt32)ref.colors;
+    ok = (fwrite(&header, sizeof(header), 1, fp) == 1) &&
+         (fwrite(&ref.data[0], sizeof(float), ref.data.size(), fp) == ref.data.size());
+    if (fclose(fp) != 0) ok = false;
+    if (!ok) error = std::string("error writing ") + fileName;
+    return ok;
+}
+
+bool SPFrameProcessor::loadReference(int reference, const char *fileName, std::string &error)
+{
+    SPReferenceFrame_t ref;
+    SPReferenceHeader_t header;
+    FILE *fp;
+    long fileSize;
+    bool ok;
+
+    fp = fopen(fileName, "rb");
+    if (!fp) {
+        error = std::string("cannot open ") + fileName;
+        return false;
+    }
+    ok = (fseek(fp, 0, SEEK_END) == 0) && ((fileSize = ftell(fp)) >= 0) && (fseek(fp, 0, SEEK_SET) == 0) &&
+         (fread(&header, sizeof(header), 1, fp) == 1) &&
+         (strncmp(header.magic, REFERENCE_MAGIC, sizeof(header.magic)) == 0) &&
+         (header.colors >= 1) && (header.colors <= 3) && validFileGeometry(header.width, header.height);
+    // The data must fill the rest of the file exactly, which also bounds the allocation by the file size
+    if (ok) {
+        ref.width = header.width;
+        ref.height = header.height;
+        ref.colors = header.colors;
+        ok = ((double)fileSize - sizeof(header) == (double)ref.width * ref.height * ref.colors * sizeof(float));
+    }
+    if (ok) {
+        try {
+            ref.data.resize(ref.width * ref.height * ref.colors);
+            ok = (fread(&ref.data[0], sizeof(float), ref.data.size(), fp) == ref.data.size());
+        }
+        catch (std::bad_alloc &) {
+            fclose(fp);
+            error = std::string("not enough memory for ") + fileName;
+            return false;
+        }
+    }
+    fclose(fp);
+    if (!ok) {
+        error = std::string("invalid reference file ") + fileName;
+        return false;
+    }
+    mReferences[reference] = ref;
+    mCorrectionDirty = true;
+    return true;
+}
+
+int SPFrameProcessor::getDefectCount(void)
+{
+    return (int)mDefects.size();
+}
+
+/** Replaces the defect list and builds the mask of defective pixels */
+void SPFrameProcessor::setDefects(size_t width, size_t height, std::vector<SPDefect_t> const & defects)
+{
+    mDefects = defects;
+    std::sort(mDefects.begin(), mDefects.end());
+    mDefects.erase(std::unique(mDefects.begin(), mDefects.end()), mDefects.end());
+    mDefectWidth = width;
+    mDefectHeight = height;
+    mDefectMask.assign(width * height, false);
+    for (size_t i=0; i<mDefects.size(); i++) {
+        mDefectMask[mDefects[i].y * width + mDefects[i].x] = true;
+    }
+}
+
+/** Finds the defects in the references.  A pixel is hot if any of its colors is more than hotSigma standard
+  * deviations above the mean of the dark reference, and dead if its signal in the flat reference is less than
+  * deadPercent % of the mean signal.  Dead pixels are only found if there is a flat reference.
+  * Returns the number of defects, or -1 if there is no dark reference. */
+int SPFrameProcessor::detectDefects(double hotSigma, double deadPercent)
+{
+    SPReferenceFrame_t const & dark = mReferences[SPReferenceDark];
+    SPReferenceFrame_t const & flat = mReferences[SPReferenceFlat];
+    size_t numPixels = dark.width * dark.height;
+    std::vector<bool> defective(numPixels, false);
+    std::vector<SPDefect_t> defects;
+
+    if (dark.data.empty()) return -1;
+    bool useFlat = !flat.data.empty() && (flat.width == dark.width) && (flat.height == dark.height) &&
+                   (flat.colors == dark.colors);
+
+    for (int c=0; c<dark.colors; c++) {
+        // The second pass leaves out the pixels found by the first, so a few very hot pixels
+        // do not raise the threshold
+        double threshold = 0.;
+        for (int pass=0; pass<2; pass++) {
+            double sum = 0., sumSq = 0.;
+            size_t count = 0;
+            for (size_t i=0; i<numPixels; i++) {
+                double value = dark.data[i*dark.colors + c];
+                if ((pass > 0) && (value > threshold)) continue;
+                sum += value;
+                sumSq += value * value;
+                count++;
+            }
+            if (count == 0) break;
+            double mean = sum / count;
+            double sigma = sqrt(std::max(sumSq / count - mean * mean, 0.));
+            threshold = mean + hotSigma * sigma;
+        }
+        for (size_t i=0; i<numPixels; i++) {
+            if (dark.data[i*dark.colors + c] > threshold) defective[i] = true;
+        }
+
+        if (!useFlat) continue;
+        double sum = 0.;
+        size_t count = 0;
+        for (size_t i=0; i<numPixels; i++) {
+            size_t j = i*dark.colors + c;
+            sum += flat.data[j] - dark.data[j];
+            count++;
+        }
+        double limit = (sum / count) * deadPercent / 100.;
+        for (size_t i=0; i<numPixels; i++) {
+            size_t j = i*dark.colors + c;
+            if (flat.data[j] - dark.data[j] < limit) defective[i] = true;
+        }
+    }
+
+    for (size_t i=0; i<numPixels; i++) {
+        if (!defective[i]) continue;
+        SPDefect_t defect = {(epicsUInt32)(i % dark.width), (epicsUInt32)(i / dark.width)};
+        defects.push_back(defect);
+    }
+    setDefects(dark.width, dark.height, defects);
+    return (int)mDefects.size();
+}
+
+bool SPFrameProcessor::saveDefects(const char *fileName, std::string &error)
+{
+    FILE *fp;
+    bool ok;
+
+    if (mDefects.empty()) {
+        error = "no defects to save";
+        return false;
+    }
+    fp = fopen(fileName, "w");
+    if (!fp) {
+        error = std::string("cannot create ") + fileName;
+        return false;
+    }
+    ok = fprintf(fp, "%s %lu %lu\n", DEFECT_MAGIC, (unsigned long)mDefectWidth, (unsigned long)mDefectHeight) > 0;
+    for (size_t i=0; ok && (i<mDefects.size()); i++) {
+        ok = fprintf(fp, "%u %u\n", mDefects[i].x, mDefects[i].y) > 0;
+    }
+    if (fclose(fp) != 0) ok = false;
+    if (!ok) error = std::string("error writing ") + fileName;
+    return ok;
+}
+
+bool SPFrameProcessor::loadDefects(const char *fileName, std::string &error)
+{
+    std::vector<SPDefect_t> defects;
+    char magic[16];
+    unsigned long width, height;
+    unsigned int x, y;
+    FILE *fp;
+    bool ok;
+
+    fp = fopen(fileName, "r");
+    if (!fp) {
+        error = std::string("cannot open ") + fileName;
+        return false;
+    }
+    ok = (fscanf(fp, "%15s %lu %lu", magic, &width, &height) == 3) && (strcmp(magic, DEFECT_MAGIC) == 0) &&
+         validFileGeometry(width, height);
+    while (ok && (fscanf(fp, "%u %u", &x, &y) == 2)) {
+        if ((x >= width) || (y >= height) || (defects.size() >= width * height)) {
+            ok = false;
+            break;
+        }
+        SPDefect_t defect = {x, y};
+        defects.push_back(defect);
+    }
+    if (ok && !feof(fp)) ok = false;
+    fclose(fp);
+    if (!ok) {
+        error = std::string("invalid defect file ") + fileName;
+        return false;
+    }
+    try {
+        setDefects(width, height, defects);
+    }
+    catch (std::bad_alloc &) {
+        setDefects(0, 0, std::vector<SPDefect_t>());
+        error = std::string("not enough memory for ") + fileName;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,251 @@
+#ifndef SP_FRAME_PROCESSOR_H
+#define SP_FRAME_PROCESSOR_H
+
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+#include <epicsTypes.h>
+#include <NDArray.h>
+
+typedef enum {
+    SPRotateNone,
+    SPRotate90,
+    SPRotate180,
+    SPRotate270
+} SPRotation_t;
+
+typedef enum {
+    SPReferenceDark,
+    SPReferenceFlat,
+    SPReferenceCount
+} SPReference_t;
+
+typedef enum {
+    SPCorrectionNative,
+    SPCorrectionUInt16,
+    SPCorrectionFloat32
+} SPCorrectionType_t;
+
+typedef enum {
+    SPAccumulateUInt32,
+    SPAccumulateFloat32
+} SPAccumulateType_t;
+
+/** Geometric transform and bit shift applied while a frame is copied.
+  * The crop is applied first, in sensor coordinates, then the flips, then the clockwise rotation.
+  * A crop width or height of 0 extends the crop to the edge of the image.
+  * A positive shift is a left shift, a negative shift a right shift.
+  */
+typedef struct {
+    size_t cropX;
+    size_t cropY;
+    size_t cropWidth;
+    size_t cropHeight;
+    bool flipX;
+    bool flipY;
+    int rotation;
+    int shift;
+} SPTransform_t;
+
+/** A dark or flat reference frame, in the geometry of the transformed frames */
+typedef struct {
+    size_t width;
+    size_t height;
+    int colors;
+    std::vector<float> data;
+} SPReferenceFrame_t;
+
+/** A defective pixel, in the geometry of the transformed frames.  Defects sort by row, then column. */
+typedef struct SPDefect {
+    epicsUInt32 x;
+    epicsUInt32 y;
+    bool operator<(SPDefect const & other) const
+        { return (y < other.y) || ((y == other.y) && (x < other.x)); }
+    bool operator==(SPDefect const & other) const
+        { return (x == other.x) && (y == other.y); }
+} SPDefect_t;
+
+/** Statistics of the values of a processed frame.  The histogram has histSize bins from histMin to histMax,
+  * and values outside that range are not in it. */
+typedef struct {
+    size_t count;
+    double min;
+    double max;
+    double mean;
+    double sigma;
+    size_t saturated;
+    std::vector<double> histogram;
+} SPStatistics_t;
+
+/** Centroid of a processed frame, from the first and second moments of the values above a threshold,
+  * minus the threshold, in a region of interest.  The values of the colors of a pixel are added.
+  * The coordinates are pixels of the processed frame.  sigmaXY is the correlation coefficient of x and y.
+  * The peak is the first pixel with the largest value in the region. */
+typedef struct {
+    double total;
+    double x;
+    double y;
+    double sigmaX;
+    double sigmaY;
+    double sigmaXY;
+    double peakValue;
+    size_t peakX;
+    size_t peakY;
+} SPCentroid_t;
+
+/** Copies a frame from a Spinnaker buffer into an NDArray and processes it in the same pass,
+  * so the frame is read only once.  Mono and RGB1 images of UInt8 and UInt16 are supported.
+  * The dark and flat correction is (pixel - dark) * gain, where gain is the mean of (flat - dark) for the color
+  * divided by (flat - dark) for the pixel.  It uses AVX2 when the CPU has it.
+  * Hot and dead pixels in the defect list are replaced by the median of their neighbours after the correction.
+  * Processed frames can be summed into a UInt32 or Float32 accumulation, which is only output when it has
+  * the requested number of frames.
+  * The statistics of the processed frames are computed in the same pass.  For integer frames each value only
+  * increments a count for that value, and the statistics and histogram are computed from these counts.
+  * The centroid is also computed in the same pass, and in centroid only mode the frame has no output.
+  * The class is not thread safe; it is used by one camera with the driver lock held.
+  */
+class SPFrameProcessor
+{
+public:
+    SPFrameProcessor();
+    void setTransform(SPTransform_t const & transform);
+    void setCorrection(bool darkEnable, bool flatEnable, int correctionType);
+    bool prepare(NDDataType_t dataType, int colors, size_t width, size_t height,
+                 size_t *pWidth, size_t *pHeight, NDDataType_t *pDataType);
+    void process(const void *pIn, void *pOut);
+    bool isCorrecting(void);
+    void startCollect(int reference, int numFrames);
+    int getCollectRemaining(void);
+    bool hasReference(int reference);
+    bool saveReference(int reference, const char *fileName, std::string &error);
+    bool loadReference(int reference, const char *fileName, std::string &error);
+    void setDefectCorrection(bool enable);
+    bool isFixingDefects(void);
+    int getDefectCount(void);
+    int detectDefects(double hotSigma, double deadPercent);
+    bool saveDefects(const char *fileName, std::string &error);
+    bool loadDefects(const char *fileName, std::string &error);
+    void setAccumulation(int numFrames, int accumulateType, bool average);
+    void resetAccumulation(void);
+    bool isAccumulating(void);
+    bool hasOutput(void);
+    int getAccumulateCount(void);
+    void setStatistics(bool enable, int histSize, double histMin, double histMax, double saturation);
+    bool isComputingStatistics(void);
+    SPStatistics_t const & getStatistics(void);
+    SPStatistics_t const & getAccumulateStatistics(void);
+    void setCentroid(bool enable, double threshold, size_t roiX, size_t roiY, size_t roiWidth, size_t roiHeight,
+                     bool centroidOnly);
+    bool isComputingCentroid(void);
+    SPCentroid_t const & getCentroid(void);
+    static const char *getSimd(void);
+
+private:
+    void geometry(size_t width, size_t height);
+    void buildCorrection(void);
+    void collect(const void *pOut);
+    void setDefects(size_t width, size_t height, std::vector<SPDefect_t> const & defects);
+    template <typename inT, typename outT> void processBands(const inT *pBase, outT *pOut);
+    template <typename epicsType> void fixDefects(epicsType *pOut, size_t rowLimit);
+    template <typename epicsType> void finishFrame(const epicsType *pFrame);
+    template <typename epicsType> void finishRows(const epicsType *pFrame, size_t y0, size_t y1);
+    void writeAccumulation(void *pOut);
+    template <typename epicsType> void countValues(const epicsType *pIn, size_t n);
+    void countValues(const epicsFloat32 *pIn, size_t n);
+    void startStatistics(void);
+    void endStatistics(void);
+    template <typename epicsType> void centroidRows(const epicsType *pFrame, size_t y0, size_t y1);
+    void startCentroid(void);
+    void endCentroid(void);
+
+    SPTransform_t mTransform;
+    bool mDarkEnable;
+    bool mFlatEnable;
+    int mCorrectionType;
+    bool mUseAVX2;
+
+    // Geometry of the frame being processed, set by prepare()
+    NDDataType_t mDataType;
+    NDDataType_t mOutputType;
+    int mColors;
+    ptrdiff_t mBase;
+    ptrdiff_t mStrideX;
+    ptrdiff_t mStrideY;
+    size_t mOutWidth;
+    size_t mOutHeight;
+    bool mCorrect;
+
+    SPReferenceFrame_t mReferences[SPReferenceCount];
+    // Dark and gain applied to each value, rebuilt when a reference or the enables change
+    bool mCorrectionDirty;
+    std::vector<float> mDark;
+    std::vector<float> mGain;
+    std::vector<char> mBand;
+
+    int mCollectReference;
+    int mCollectFrames;
+    int mCollectCount;
+    size_t mCollectWidth;
+    size_t mCollectHeight;
+    std::vector<double> mCollectSum;
+
+    bool mDefectEnable;
+    bool mFixDefects;
+    std::vector<SPDefect_t> mDefects;
+    std::vector<bool> mDefectMask;
+    size_t mDefectWidth;
+    size_t mDefectHeight;
+    size_t mDefectNext;
+
+    int mAccumulateFrames;
+    int mAccumulateType;
+    bool mAccumulateAverage;
+    bool mAccumulate;
+    int mAccumulateCount;
+    size_t mAccumulateSize;
+    // Sum of the UInt32 or Float32 values, and the processed frame when it is not the output
+    std::vector<char> mSum;
+    std::vector<char> mFrame;
+
+    bool mStatsEnable;
+    int mHistSize;
+    double mHistMin;
+    double mHistMax;
+    double mSaturation;
+    bool mStats;
+    // Histogram range and saturation level for the frame being processed
+    double mStatsHistMin;
+    double mStatsHistMax;
+    double mStatsSaturation;
+    // Count of each value of integer frames
+    std::vector<epicsUInt32> mValueCounts;
+    double mStatsSum;
+    double mStatsSumSquares;
+    SPStatistics_t mStatistics;
+    // Statistics of the last completed accumulation
+    SPStatistics_t mAccumulateStatistics;
+
+    bool mCentroidEnable;
+    double mCentroidThreshold;
+    size_t mCentroidRoiX;
+    size_t mCentroidRoiY;
+    size_t mCentroidRoiWidth;
+    size_t mCentroidRoiHeight;
+    bool mCentroidOnly;
+    bool mCentroid;
+    // False if the frame being processed has no output, in centroid only mode
+    bool mOutput;
+    // Region of the frame being processed, clipped to the frame
+    size_t mCentroidX0;
+    size_t mCentroidX1;
+    size_t mCentroidY0;
+    size_t mCentroidY1;
+    // Moments of the thresholded values
+    double mMoments[6];
+    SPCentroid_t mCentroidResult;
+};
+
+#endif
@@ -0,0 +1,372 @@
+// SPPreview.cpp
+// Publishes a binned, rate limited, 8-bit preview of the images of an ADSpinnaker camera
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <algorithm>
+
+#include <epicsThread.h>
+#include <iocsh.h>
+
+#include <epicsExport.h>
+#include "ADSpinnaker.h"
+#include "SPPreview.h"
+
+static const char *driverName = "SPPreview";
+
+typedef enum {
+    SPPScaleAuto,
+    SPPScaleManual
+} SPPScaleMode_t;
+
+#define DEFAULT_MAX_RATE 10.
+#define DEFAULT_MAX_SIZE 512
+
+static void previewTaskC(void *drvPvt)
+{
+    SPPreview *pPvt = (SPPreview *)drvPvt;
+    pPvt->previewTask();
+}
+
+extern "C" int SPPreviewConfig(const char *portName, const char *cameraPort,
+                               int maxBuffers, size_t maxMemory,
+                               int priority, int stackSize)
+{
+    ADSpinnaker *pCamera = dynamic_cast<ADSpinnaker *>((asynPortDriver *)findAsynPortDriver(cameraPort));
+
+    if (!pCamera) {
+        printf("%s::SPPreviewConfig %s is not an ADSpinnaker port\n", driverName, cameraPort);
+        return asynError;
+    }
+    pCamera->setPreview(new SPPreview(portName, maxBuffers, maxMemory, priority, stackSize));
+    return asynSuccess;
+}
+
+/** Returns the size and number of colors of a Mono or RGB1 image.  Other layouts cannot be previewed. */
+static bool imageLayout(NDArray *pArray, size_t *pSizeX, size_t *pSizeY, int *pColors)
+{
+    NDArrayInfo_t arrayInfo;
+
+    pArray->getInfo(&arrayInfo);
+    if (pArray->ndims == 2) {
+        *pSizeX = pArray->dims[0].size;
+        *pSizeY = pArray->dims[1].size;
+        *pColors = 1;
+        return true;
+    }
+    if ((pArray->ndims == 3) && (arrayInfo.colorMode == NDColorModeRGB1) && (pArray->dims[0].size == 3)) {
+        *pSizeX = pArray->dims[1].size;
+        *pSizeY = pArray->dims[2].size;
+        *pColors = 3;
+        return true;
+    }
+    return false;
+}
+
+/** Averages bin x bin blocks of pixels, each color separately.  Pixels beyond the last full block are ignored. */
+template <typename epicsType>
+static void binImage(const epicsType *pIn, size_t sizeX, int colors, int bin,
+                     size_t outX, size_t outY, double *pOut)
+{
+    size_t rowSize = outX * colors;
+    double scale = 1. / (bin * bin);
+
+    for (size_t oy=0; oy<outY; oy++) {
+        double *pRow = pOut + oy*rowSize;
+        std::fill(pRow, pRow + rowSize, 0.);
+        for (int ky=0; ky<bin; ky++) {
+            const epicsType *pLine = pIn + (oy*bin + ky)*sizeX*colors;
+            for (size_t ox=0; ox<outX; ox++) {
+                const epicsType *pBlock = pLine + ox*bin*colors;
+                double *pSum = pRow + ox*colors;
+                for (int kx=0; kx<bin; kx++) {
+                    for (int c=0; c<colors; c++) {
+                        pSum[c] += pBlock[kx*colors + c];
+                    }
+                }
+            }
+        }
+        for (size_t i=0; i<rowSize; i++) {
+            pRow[i] *= scale;
+        }
+    }
+}
+
+/** Constructor for the SPPreview class.
+  * \param[in] portName The name of the asyn port to be created.  The preview is published on address 0.
+  * \param[in] maxBuffers The maximum number of NDArray buffers that the NDArrayPool for this driver is
+  *            allowed to allocate. Set this to 0 to allow an unlimited number of buffers.
+  * \param[in] maxMemory The maximum amount of memory that the NDArrayPool for this driver is
+  *            allowed to allocate. Set this to 0 to allow an unlimited amount of memory.
+  * \param[in] priority The thread priority for the asyn port driver thread and the preview thread.
+  *            0 uses epicsThreadPriorityLow for the preview thread.
+  * \param[in] stackSize The stack size for the asyn port driver thread and the preview thread.
+  *            0 uses epicsThreadStackMedium for the preview thread.
+  */
+SPPreview::SPPreview(const char *portName, int maxBuffers, size_t maxMemory, int priority, int stackSize)
+    : asynNDArrayDriver(portName, 1, maxBuffers, maxMemory,
+                        asynInt32Mask | asynFloat64Mask | asynOctetMask | asynGenericPointerMask | asynDrvUserMask,
+                        asynInt32Mask | asynFloat64Mask | asynOctetMask | asynGenericPointerMask,
+                        0, 1, priority, stackSize),
+      queue_(1, sizeof(NDArray *))
+{
+    createParam(SPPEnableString,            asynParamInt32,   &SPPEnable);
+    createParam(SPPMaxRateString,           asynParamFloat64, &SPPMaxRate);
+    createParam(SPPBinningString,           asynParamInt32,   &SPPBinning);
+    createParam(SPPMaxSizeString,           asynParamInt32,   &SPPMaxSize);
+    createParam(SPPBinningActualString,     asynParamInt32,   &SPPBinningActual);
+    createParam(SPPScaleModeString,         asynParamInt32,   &SPPScaleMode);
+    createParam(SPPScaleMinString,          asynParamFloat64, &SPPScaleMin);
+    createParam(SPPScaleMaxString,          asynParamFloat64, &SPPScaleMax);
+    createParam(SPPLevelMinString,          asynParamFloat64, &SPPLevelMin);
+    createParam(SPPLevelMaxString,          asynParamFloat64, &SPPLevelMax);
+    createParam(SPPProcessTimeString,       asynParamFloat64, &SPPProcessTime);
+
+    setIntegerParam(SPPEnable, 1);
+    setDoubleParam(SPPMaxRate, DEFAULT_MAX_RATE);
+    setIntegerParam(SPPBinning, 0);
+    setIntegerParam(SPPMaxSize, DEFAULT_MAX_SIZE);
+    setIntegerParam(SPPBinningActual, 1);
+    setIntegerParam(SPPScaleMode, SPPScaleAuto);
+    setDoubleParam(SPPScaleMin, 0.);
+    setDoubleParam(SPPScaleMax, 255.);
+    setDoubleParam(SPPLevelMin, 0.);
+    setDoubleParam(SPPLevelMax, 0.);
+    setDoubleParam(SPPProcessTime, 0.);
+    setStringParam(NDPortNameSelf, portName);
+    callParamCallbacks();
+
+    epicsTimeGetCurrent(&lastSubmit_);
+    epicsThreadCreate("SPPreviewTask",
+                      priority ? priority : epicsThreadPriorityLow,
+                      stackSize ? stackSize : epicsThreadGetStackSize(epicsThreadStackMedium),
+                      previewTaskC, this);
+}
+
+/** Called by the camera with each NDArray it publishes.  If a preview is due and the preview thread is idle
+  * the array is reserved and passed to that thread, otherwise nothing is done.  This never blocks. */
+void SPPreview::submit(NDArray *pArray)
+{
+    int enable;
+    double maxRate;
+    epicsTimeStamp now;
+
+    lock();
+    getIntegerParam(SPPEnable, &enable);
+    getDoubleParam(SPPMaxRate, &maxRate);
+    epicsTimeGetCurrent(&now);
+    if (enable && ((maxRate <= 0) || (epicsTimeDiffInSeconds(&now, &lastSubmit_) >= 1./maxRate))) {
+        pArray->reserve();
+        if (queue_.trySend(&pArray, sizeof(pArray)) == 0) {
+            lastSubmit_ = now;
+        } else {
+            pArray->release();
+        }
+    }
+    unlock();
+}
+
+/** Bins and scales an image to an 8-bit preview with the same layout.
+  * In SPPScaleAuto mode *pLevelMin and *pLevelMax are set to the range of the binned image,
+  * otherwise they give the range that is mapped to 0-255. */
+NDArray *SPPreview::makePreview(NDArray *pArray, int bin, int scaleMode, double *pLevelMin, double *pLevelMax)
+{
+    size_t sizeX, sizeY, outX, outY, nElements, dims[3];
+    int colors;
+    double levelMin, levelMax, scale;
+    NDArray *pPreview;
+    static const char *functionName = "makePreview";
+
+    imageLayout(pArray, &sizeX, &sizeY, &colors);
+    outX = sizeX / bin;
+    outY = sizeY / bin;
+    if ((outX == 0) || (outY == 0)) return NULL;
+    nElements = outX * outY * colors;
+    binned_.resize(nElements);
+
+    switch (pArray->dataType) {
+        case NDInt8:
+            binImage((epicsInt8 *)pArray->pData, sizeX, colors, bin, outX, outY, &binned_[0]);
+            break;
+        case NDUInt8:
+            binImage((epicsUInt8 *)pArray->pData, sizeX, colors, bin, outX, outY, &binned_[0]);
+            break;
+        case NDInt16:
+            binImage((epicsInt16 *)pArray->pData, sizeX, colors, bin, outX, outY, &binned_[0]);
+            break;
+        case NDUInt16:
+            binImage((epicsUInt16 *)pArray->pData, sizeX, colors, bin, outX, outY, &binned_[0]);
+            break;
+        case NDInt32:
+            binImage((epicsInt32 *)pArray->pData, sizeX, colors, bin, outX, outY, &binned_[0]);
+            break;
+        case NDUInt32:
+            binImage((epicsUInt32 *)pArray->pData, sizeX, colors, bin, outX, outY, &binned_[0]);
+            break;
+        case NDFloat32:
+            binImage((epicsFloat32 *)pArray->pData, sizeX, colors, bin, outX, outY, &binned_[0]);
+            break;
+        case NDFloat64:
+            binImage((epicsFloat64 *)pArray->pData, sizeX, colors, bin, outX, outY, &binned_[0]);
+            break;
+        default:
+            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s::%s unsupported data type %d\n",
+                driverName, functionName, pArray->dataType);
+            return NULL;
+    }
+
+    if (scaleMode == SPPScaleAuto) {
+        levelMin = *std::min_element(binned_.begin(), binned_.end());
+        levelMax = *std::max_element(binned_.begin(), binned_.end());
+        *pLevelMin = levelMin;
+        *pLevelMax = levelMax;
+    } else {
+        levelMin = *pLevelMin;
+        levelMax = *pLevelMax;
+    }
+
+    if (colors == 1) {
+        dims[0] = outX;
+        dims[1] = outY;
+    } else {
+        dims[0] = colors;
+        dims[1] = outX;
+        dims[2] = outY;
+    }
+    pPreview = pNDArrayPool->alloc((colors == 1) ? 2 : 3, dims, NDUInt8, 0, NULL);
+    if (!pPreview) {
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+            "%s::%s not enough memory for the preview\n",
+            driverName, functionName);
+        return NULL;
+    }
+    scale = (levelMax > levelMin) ? 255. / (levelMax - levelMin) : 0.;
+    epicsUInt8 *pOut = (epicsUInt8 *)pPreview->pData;
+    for (size_t i=0; i<nElements; i++) {
+        double value = (binned_[i] - levelMin) * scale + 0.5;
+        pOut[i] = (epicsUInt8)std::min(std::max(value, 0.), 255.);
+    }
+    pPreview->uniqueId = pArray->uniqueId;
+    pPreview->timeStamp = pArray->timeStamp;
+    pPreview->epicsTS = pArray->epicsTS;
+    pArray->pAttributeList->copy(pPreview->pAttributeList);
+    // A binned Bayer image is no longer a mosaic
+    int colorMode = (colors == 1) ? NDColorModeMono : NDColorModeRGB1;
+    pPreview->pAttributeList->add("ColorMode", "Color mode", NDAttrInt32, &colorMode);
+    return pPreview;
+}
+
+/** Makes and publishes a preview of each array passed by submit(), without holding the lock. */
+void SPPreview::previewTask(void)
+{
+    NDArray *pArray;
+    NDArray *pPreview;
+    size_t sizeX, sizeY;
+    int colors;
+    int binning, maxSize, scaleMode, arrayCounter, arrayCallbacks;
+    double levelMin, levelMax;
+    epicsTimeStamp startTime, endTime;
+    static const char *functionName = "previewTask";
+
+    while (1) {
+        queue_.receive(&pArray, sizeof(pArray));
+        epicsTimeGetCurrent(&startTime);
+        if (!imageLayout(pArray, &sizeX, &sizeY, &colors)) {
+            asynPrint(pasynUserSelf, ASYN_TRACE_WARNING,
+                "%s::%s cannot preview an array with %d dimensions\n",
+                driverName, functionName, pArray->ndims);
+            pArray->release();
+            continue;
+        }
+        lock();
+        getIntegerParam(SPPBinning, &binning);
+        getIntegerParam(SPPMaxSize, &maxSize);
+        getIntegerParam(SPPScaleMode, &scaleMode);
+        getDoubleParam(SPPScaleMin, &levelMin);
+        getDoubleParam(SPPScaleMax, &levelMax);
+        unlock();
+        // Binning 0 uses the smallest binning that fits the preview in maxSize x maxSize
+        if ((binning < 1) && (maxSize > 0)) {
+            binning = (int)std::max((sizeX + maxSize - 1) / maxSize, (sizeY + maxSize - 1) / maxSize);
+        }
+        if (binning < 1) binning = 1;
+
+        pPreview = makePreview(pArray, binning, scaleMode, &levelMin, &levelMax);
+        pArray->release();
+        epicsTimeGetCurrent(&endTime);
+
+        lock();
+        setIntegerParam(SPPBinningActual, binning);
+        setDoubleParam(SPPProcessTime, epicsTimeDiffInSeconds(&endTime, &startTime) * 1000.);
+        if (pPreview) {
+            setDoubleParam(SPPLevelMin, levelMin);
+            setDoubleParam(SPPLevelMax, levelMax);
+            getIntegerParam(NDArrayCounter, &arrayCounter);
+            setIntegerParam(NDArrayCounter, ++arrayCounter);
+            setIntegerParam(NDArraySizeX, (int)(sizeX / binning));
+            setIntegerParam(NDArraySizeY, (int)(sizeY / binning));
+            setIntegerParam(NDArraySizeZ, (colors == 1) ? 0 : colors);
+            setIntegerParam(NDArraySize, (int)((sizeX / binning) * (sizeY / binning) * colors));
+            setIntegerParam(NDNDimensions, pPreview->ndims);
+            setIntegerParam(NDDataType, NDUInt8);
+            setIntegerParam(NDColorMode, (colors == 1) ? NDColorModeMono : NDColorModeRGB1);
+            setIntegerParam(NDUniqueId, pPreview->uniqueId);
+            setDoubleParam(NDTimeStamp, pPreview->timeStamp);
+            setIntegerParam(NDEpicsTSSec, pPreview->epicsTS.secPastEpoch);
+            setIntegerParam(NDEpicsTSNsec, pPreview->epicsTS.nsec);
+            getIntegerParam(NDArrayCallbacks, &arrayCallbacks);
+            if (arrayCallbacks) {
+                doCallbacksGenericPointer(pPreview, NDArrayData, 0);
+            }
+            if (this->pArrays[0]) {
+                this->pArrays[0]->release();
+            }
+            this->pArrays[0] = pPreview;
+        }
+        callParamCallbacks();
+        unlock();
+    }
+}
+
+void SPPreview::report(FILE *fp, int details)
+{
+    int binning;
+    double processTime;
+
+    getIntegerParam(SPPBinningActual, &binning);
+    getDoubleParam(SPPProcessTime, &processTime);
+    fprintf(fp, "%s: binning %d, last preview took %g ms\n", portName, binning, processTime);
+    asynNDArrayDriver::report(fp, details);
+}
+
+static const iocshArg configArg0 = {"Port name", iocshArgString};
+static const iocshArg configArg1 = {"Camera port", iocshArgString};
+static const iocshArg configArg2 = {"maxBuffers", iocshArgInt};
+static const iocshArg configArg3 = {"maxMemory", iocshArgInt};
+static const iocshArg configArg4 = {"priority", iocshArgInt};
+static const iocshArg configArg5 = {"stackSize", iocshArgInt};
+static const iocshArg * const configArgs[] = {&configArg0,
+                                              &configArg1,
+                                              &configArg2,
+                                              &configArg3,
+                                              &configArg4,
+                                              &configArg5};
+static const iocshFuncDef configSPPreview = {"SPPreviewConfig", 6, configArgs};
+static void configCallFunc(const iocshArgBuf *args)
+{
+    SPPreviewConfig(args[0].sval, args[1].sval, args[2].ival,
+                    args[3].ival, args[4].ival, args[5].ival);
+}
+
+
+static void SPPreviewRegister(void)
+{
+    iocshRegister(&configSPPreview, configCallFunc);
+}
+
+extern "C" {
+epicsExportRegistrar(SPPreviewRegister);
+}
@@ -0,0 +1,61 @@
+#ifndef SP_PREVIEW_H
+#define SP_PREVIEW_H
+
+#include <vector>
+
+#include <epicsTime.h>
+#include <epicsMessageQueue.h>
+#include <asynNDArrayDriver.h>
+
+#define SPPEnableString                     "SPP_ENABLE"                        // asynParamInt32, R/W
+#define SPPMaxRateString                    "SPP_MAX_RATE"                      // asynParamFloat64, R/W
+#define SPPBinningString                    "SPP_BINNING"                       // asynParamInt32, R/W
+#define SPPMaxSizeString                    "SPP_MAX_SIZE"                      // asynParamInt32, R/W
+#define SPPBinningActualString              "SPP_BINNING_ACTUAL"                // asynParamInt32, R/O
+#define SPPScaleModeString                  "SPP_SCALE_MODE"                    // asynParamInt32, R/W
+#define SPPScaleMinString                   "SPP_SCALE_MIN"                     // asynParamFloat64, R/W
+#define SPPScaleMaxString                   "SPP_SCALE_MAX"                     // asynParamFloat64, R/W
+#define SPPLevelMinString                   "SPP_LEVEL_MIN"                     // asynParamFloat64, R/O
+#define SPPLevelMaxString                   "SPP_LEVEL_MAX"                     // asynParamFloat64, R/O
+#define SPPProcessTimeString                "SPP_PROCESS_TIME"                  // asynParamFloat64, R/O
+
+/** Publishes a binned, rate limited, 8-bit preview of the images of an ADSpinnaker camera on its own port.
+  * The camera passes each published NDArray to submit(), which only takes a reference when a preview is due,
+  * so the full rate stream is never copied.  The preview is made and called back in a separate low priority
+  * thread, and images that arrive while it is busy are not previewed.
+  * Mono images give a 2-D UInt8 preview and RGB1 images an RGB1 UInt8 preview.
+  */
+class SPPreview : public asynNDArrayDriver
+{
+public:
+    SPPreview(const char *portName, int maxBuffers, size_t maxMemory, int priority, int stackSize);
+
+    virtual void report(FILE *fp, int details);
+
+    void submit(NDArray *pArray);
+
+    // This should be private but is called from C so must be public
+    void previewTask(void);
+
+private:
+    NDArray *makePreview(NDArray *pArray, int bin, int scaleMode, double *pLevelMin, double *pLevelMax);
+
+    int SPPEnable;
+    #define FIRST_SPP_PARAM SPPEnable
+    int SPPMaxRate;
+    int SPPBinning;
+    int SPPMaxSize;
+    int SPPBinningActual;
+    int SPPScaleMode;
+    int SPPScaleMin;
+    int SPPScaleMax;
+    int SPPLevelMin;
+    int SPPLevelMax;
+    int SPPProcessTime;
+
+    epicsMessageQueue queue_;
+    epicsTimeStamp lastSubmit_;
+    std::vector<double> binned_;
+};
+
+#endif